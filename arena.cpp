@@ -0,0 +1,101 @@
+#include "arena.h"
+#include "sim.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+#if defined(__SANITIZE_ADDRESS__)
+#define ARENA_MALLOC 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define ARENA_MALLOC 1
+#endif
+#endif
+
+typedef struct ArenaBlock {
+    ArenaBlock *next;
+    size_t size; // including this header
+} ArenaBlock;
+
+static uintptr_t align_up(uintptr_t p, size_t align)
+{
+    return (p + align - 1) & ~(static_cast<uintptr_t>(align) - 1);
+}
+
+Arena *arena_create(bool huge)
+{
+    Arena *a = new Arena;
+    a->huge = huge;
+    return a;
+}
+
+#ifndef ARENA_MALLOC
+// Map a block of at least 'size' bytes and make it the current one.
+static void arena_grow(Arena *a, size_t size)
+{
+    size = align_up(size, HUGE_PAGE_SIZE);
+    // Map a huge page more than needed, and trim it to a huge page boundary.
+    size_t len = size + (a->huge ? HUGE_PAGE_SIZE : 0);
+    void *m = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED)
+        fatal("arena: cannot map %zu bytes\n", len);
+    char *p = static_cast<char *>(m);
+    if (a->huge) {
+        char *q = reinterpret_cast<char *>(
+            align_up(reinterpret_cast<uintptr_t>(p), HUGE_PAGE_SIZE));
+        if (q > p)
+            munmap(p, q - p);
+        if (p + len > q + size)
+            munmap(q + size, p + len - (q + size));
+        p = q;
+#ifdef MADV_HUGEPAGE
+        madvise(p, size, MADV_HUGEPAGE);
+#endif
+    }
+
+    ArenaBlock *b = reinterpret_cast<ArenaBlock *>(p);
+    b->next = a->blocks;
+    b->size = size;
+    a->blocks = b;
+    a->mapped += size;
+    a->cur = p + sizeof(ArenaBlock);
+    a->end = p + size;
+}
+#endif
+
+void *arena_alloc(Arena *a, size_t size, size_t align)
+{
+    a->used += size;
+#ifdef ARENA_MALLOC
+    align = std::max(align, sizeof(void *));
+    void *m = aligned_alloc(align, align_up(size ? size : 1, align));
+    if (!m)
+        fatal("arena: cannot allocate %zu bytes\n", size);
+    a->mallocs.push_back(m);
+    return m;
+#else
+    uintptr_t p = align_up(reinterpret_cast<uintptr_t>(a->cur), align);
+    if (!a->cur || p + size > reinterpret_cast<uintptr_t>(a->end)) {
+        // Start a new block; a large allocation gets a block of its own.
+        arena_grow(a, std::max(sizeof(ArenaBlock) + align + size,
+                               static_cast<size_t>(ARENA_BLOCK_SIZE)));
+        p = align_up(reinterpret_cast<uintptr_t>(a->cur), align);
+    }
+    a->cur = reinterpret_cast<char *>(p + size);
+    return reinterpret_cast<void *>(p);
+#endif
+}
+
+void arena_destroy(Arena *a)
+{
+    for (void *m : a->mallocs)
+        free(m);
+    while (a->blocks) {
+        ArenaBlock *b = a->blocks;
+        a->blocks = b->next;
+        munmap(b, b->size);
+    }
+    delete a;
+}
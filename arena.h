@@ -0,0 +1,98 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "queue.h"
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Per-simulation arena.
+//
+// The long-lived state of a simulation (nodes, their VCs and arbitration
+// state, and the flit queues of VCs and channels) is carved out of large
+// blocks mapped up front, so that it is packed together in the order it is
+// created instead of scattered over the heap, and is all released at once by
+// arena_destroy().  Nothing is freed individually: objects in the arena
+// only have their destructors run.  Flits and credits come and go during the
+// run and stay on the heap, as do the large, sparsely used source queues.
+//
+// With 'huge' set, blocks are aligned to and advised for 2 MiB transparent
+// huge pages, which cuts TLB misses in large networks.  Whether the kernel
+// actually backs them with huge pages depends on its THP setting.
+//
+// Under AddressSanitizer every allocation is a separate malloc() instead, so
+// that overflows between objects are still caught.
+
+#define ARENA_BLOCK_SIZE (32L << 20)
+#define HUGE_PAGE_SIZE (2L << 20)
+
+struct ArenaBlock;
+typedef struct Arena {
+    bool huge;               // back the blocks with huge pages
+    char *cur = NULL;        // free space in the current block
+    char *end = NULL;
+    ArenaBlock *blocks = NULL;
+    long mapped = 0;         // bytes mapped
+    long used = 0;           // bytes allocated
+    std::vector<void *> mallocs; // under AddressSanitizer only
+} Arena;
+
+Arena *arena_create(bool huge);
+void *arena_alloc(Arena *a, size_t size, size_t align);
+void arena_destroy(Arena *a);
+
+// Construct a T in the arena.
+template <typename T, typename... Args> T *arena_new(Arena *a, Args &&...args)
+{
+    return new (arena_alloc(a, sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+}
+
+// Destroys an object in the arena without freeing it, for std::unique_ptr.
+struct ArenaDelete {
+    template <typename T> void operator()(T *p) const { p->~T(); }
+};
+
+// Allocate a queue of 'len' elements of type T in the arena.
+template <typename T> T *arena_queue(Arena *a, size_t len)
+{
+    void *mem = arena_alloc(a, queue_bytes(sizeof(T), len), alignof(Queue));
+    return static_cast<T *>(queue_placef(mem, len));
+}
+
+// Allocator for standard containers whose storage lives in the arena.
+// Deallocation is a no-op, so it only suits containers that are sized once.
+template <typename T> struct ArenaAllocator {
+    typedef T value_type;
+
+    explicit ArenaAllocator(Arena *a) : arena(a) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena)
+    {
+    }
+
+    T *allocate(size_t n)
+    {
+        return static_cast<T *>(arena_alloc(arena, n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T *p, size_t n) {}
+
+    Arena *arena;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
+{
+    return a.arena == b.arena;
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b)
+{
+    return a.arena != b.arena;
+}
+
+template <typename T> using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+#endif
@@ -0,0 +1,161 @@
+#include "cc.h"
+#include "sim.h"
+#include <stdio.h>
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+
+CcState *cc_create(enum CcPolicy policy, double rate, int window,
+                   double ecn_thresh, long packet_len, int terminal_count)
+{
+    if (policy == CC_RATE && rate <= 0.0)
+        fatal("cc: invalid rate: %lf\n", rate);
+    if (policy != CC_RATE && window <= 0)
+        fatal("cc: invalid window: %d\n", window);
+
+    CcState *cc = new CcState;
+    cc->policy = policy;
+    cc->rate = rate;
+    cc->packet_len = packet_len;
+    cc->window = window;
+    cc->ecn_thresh = ecn_thresh;
+    cc->sources.resize(terminal_count);
+    for (CcSource &s : cc->sources) {
+        s.tokens = static_cast<double>(packet_len);
+        s.window = window;
+    }
+    return cc;
+}
+
+void cc_destroy(CcState *cc)
+{
+    delete cc;
+}
+
+// Process the acknowledgments that reached 'src' by 'now'.
+void cc_poll(CcState *cc, int src, long now)
+{
+    CcSource &s = cc->sources[src];
+    while (!s.acks.empty() && s.acks.top().time <= now) {
+        CcAck ack = s.acks.top();
+        s.acks.pop();
+        s.in_flight--;
+        assert(s.in_flight >= 0);
+        cc->acked++;
+        if (ack.ecn)
+            cc->acked_marked++;
+        if (cc->policy != CC_ECN)
+            continue;
+
+        if (ack.ecn) {
+            // Only react to packets sent after the last cut, i.e. once per
+            // round trip.
+            if (ack.inject_time > s.last_cut) {
+                s.window = std::max(1.0, s.window / 2.0);
+                s.last_cut = now;
+                cc->cuts++;
+            }
+        } else {
+            s.window = std::min(static_cast<double>(cc->window),
+                                s.window + 1.0 / s.window);
+        }
+    }
+}
+
+bool cc_may_inject(CcState *cc, int src, long now)
+{
+    CcSource &s = cc->sources[src];
+    bool ok;
+    if (cc->policy == CC_RATE) {
+        s.tokens = std::min(static_cast<double>(cc->packet_len),
+                            s.tokens + cc->rate * (now - s.last_fill));
+        s.last_fill = now;
+        ok = s.tokens >= cc->packet_len;
+    } else {
+        ok = s.in_flight < static_cast<int>(s.window);
+    }
+    // Sources poll again every tick while held back: count the injection
+    // once.
+    if (!ok && !s.held) {
+        s.held = true;
+        cc->throttled++;
+    }
+    return ok;
+}
+
+void cc_inject(CcState *cc, int src)
+{
+    CcSource &s = cc->sources[src];
+    if (cc->policy == CC_RATE)
+        s.tokens -= cc->packet_len;
+    else
+        s.in_flight++;
+    s.held = false;
+    cc->injected++;
+}
+
+// Cycle at which a throttled source should tick again, or -1 if it need not
+// or a wakeup is already pending.
+long cc_wake_time(CcState *cc, int src, long now)
+{
+    CcSource &s = cc->sources[src];
+    // Windows open with acknowledgments, which wake the source themselves.
+    if (cc->policy != CC_RATE)
+        return -1;
+    long t = now + static_cast<long>(
+                       ceil((cc->packet_len - s.tokens) / cc->rate));
+    t = std::max(t, now + 1);
+    if (s.wake > now && s.wake <= t)
+        return -1;
+    s.wake = t;
+    return t;
+}
+
+// A packet in flight was discarded in the network.
+void cc_lost(CcState *cc, int src)
+{
+    if (cc->policy != CC_RATE)
+        cc->sources[src].in_flight--;
+}
+
+// The head of a packet reached its destination: send the acknowledgment back
+// to the source, taking the same time as the packet did.
+void cc_deliver(Sim *sim, const Flit *head)
+{
+    CcState *cc = sim->cc;
+    if (cc->policy == CC_RATE)
+        return;
+    long now = curr_time(&sim->eventq);
+    long delay = std::max(1L, now - head->inject_time);
+    int src = head->packet_id.src;
+    cc->sources[src].acks.push({now + delay, head->inject_time, head->ecn});
+    schedule(&sim->eventq, now + delay, tick_event(sim->src_nodes[src].get()));
+}
+
+void cc_report(const CcState *cc)
+{
+    static const char *names[] = {"rate", "window", "ecn"};
+
+    printf("\n");
+    printf("==== INJECTION CONTROL ====\n");
+    printf("Policy: %s\n", names[cc->policy]);
+    if (cc->policy == CC_RATE) {
+        printf("Rate: %lf flits/cycle/node\n", cc->rate);
+    } else {
+        printf("Window: %d packets\n", cc->window);
+    }
+    printf("# of packets injected: %ld\n", cc->injected);
+    printf("# of injections throttled: %ld\n", cc->throttled);
+    if (cc->policy == CC_ECN) {
+        double window_sum = 0.0;
+        for (const CcSource &s : cc->sources)
+            window_sum += s.window;
+        printf("ECN threshold: %.2lf of input buffers\n", cc->ecn_thresh);
+        printf("# of packets marked: %ld\n", cc->marked);
+        printf("# of marked acknowledgments: %ld / %ld\n", cc->acked_marked,
+               cc->acked);
+        printf("# of window cuts: %ld\n", cc->cuts);
+        printf("Average window at end: %lf packets\n",
+               window_sum / cc->sources.size());
+    }
+}
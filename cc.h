@@ -0,0 +1,82 @@
+#ifndef CC_H
+#define CC_H
+
+#include <vector>
+#include <queue>
+
+// Injection control at the source terminals.
+//
+// A packet may only leave the source queue for the network when the policy
+// of its source allows it; the packets behind it wait in the source queue.
+//
+// - rate: token bucket of 'rate' flits per cycle, one packet deep.
+// - window: at most 'window' packets in flight per source.  A packet is
+//   acknowledged when its head reaches the destination, and the
+//   acknowledgment takes as long to get back as the packet took to get there.
+// - ecn: the window of each source follows the congestion marks instead.
+//   Routers mark the head flits that arrive at an input port whose buffers
+//   are filled above 'ecn_thresh', and the destination echoes the mark in the
+//   acknowledgment.  Unmarked acknowledgments grow the window by one packet
+//   per window, and a marked one halves it, at most once per round trip.
+//   The window starts at, and never exceeds, 'window'.
+
+enum CcPolicy {
+    CC_RATE,
+    CC_WINDOW,
+    CC_ECN,
+};
+
+typedef struct CcAck {
+    long time;        // cycle the acknowledgment reaches the source
+    long inject_time; // cycle the packet was injected
+    bool ecn;         // the packet was marked
+} CcAck;
+
+struct CcAckLater {
+    bool operator()(const CcAck &a, const CcAck &b) const
+    {
+        return a.time > b.time;
+    }
+};
+
+typedef struct CcSource {
+    double tokens = 0.0; // rate: flits that may be injected
+    long last_fill = 0;  // rate: cycle 'tokens' was last updated
+    int in_flight = 0;   // window, ecn: packets not yet acknowledged
+    double window = 0.0; // window, ecn: packets allowed in flight
+    long last_cut = -1;  // ecn: cycle the window was last halved
+    long wake = -1;      // cycle a wakeup is scheduled at, if any
+    bool held = false;   // the next injection was counted as throttled
+    std::priority_queue<CcAck, std::vector<CcAck>, CcAckLater> acks;
+} CcSource;
+
+struct Sim;
+struct Flit;
+typedef struct CcState {
+    enum CcPolicy policy;
+    double rate;       // flits per cycle per source
+    long packet_len;   // tokens needed to inject a packet
+    int window;        // packets
+    double ecn_thresh; // fraction of the input port buffers
+    std::vector<CcSource> sources;
+
+    long injected = 0;  // packets let into the network
+    long throttled = 0; // injections held back, each counted once
+    long marked = 0;    // head flits marked by routers
+    long acked = 0;
+    long acked_marked = 0;
+    long cuts = 0;      // window halvings
+} CcState;
+
+CcState *cc_create(enum CcPolicy policy, double rate, int window,
+                   double ecn_thresh, long packet_len, int terminal_count);
+void cc_destroy(CcState *cc);
+void cc_poll(CcState *cc, int src, long now);
+bool cc_may_inject(CcState *cc, int src, long now);
+void cc_inject(CcState *cc, int src);
+long cc_wake_time(CcState *cc, int src, long now);
+void cc_lost(CcState *cc, int src);
+void cc_deliver(Sim *sim, const Flit *head);
+void cc_report(const CcState *cc);
+
+#endif
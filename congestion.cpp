@@ -0,0 +1,209 @@
+#include "congestion.h"
+#include "sim.h"
+#include "queue.h"
+#include <stdio.h>
+#include <assert.h>
+#include <algorithm>
+
+// parent[] values other than downstream router IDs.
+#define NOT_CONGESTED -2
+#define DOWNSTREAM_TERMINAL -1
+
+CongestionMonitor *congestion_create(long period, int router_count)
+{
+    CongestionMonitor *cm = new CongestionMonitor;
+    cm->period = period;
+    cm->next_sample = period;
+    cm->streak.assign(router_count, 0);
+    cm->parent.assign(router_count, NOT_CONGESTED);
+    return cm;
+}
+
+void congestion_destroy(CongestionMonitor *cm)
+{
+    delete cm;
+}
+
+// Returns the downstream node of the first full input VC that is stalled on
+// credits, or NULL if there is none.
+static const Id *router_blocked_downstream(Router *r)
+{
+    for (int port = 0; port < r->radix; port++) {
+        for (int vc = 0; vc < r->vc_count; vc++) {
+            InputVC &ivc = r->ivc(port, vc);
+            if (queue_len(ivc.buf) < r->cfg->input_buf_size ||
+                ivc.route_port < 0 || ivc.output_vc < 0) {
+                continue;
+            }
+            if (ivc.global != STATE_ACTIVE && ivc.global != STATE_CREDWAIT) {
+                continue;
+            }
+            OutputVC &ovc =
+                r->ovc(ivc.route_port, ivc.output_vc);
+            if (ovc.global == STATE_CREDWAIT) {
+                return &r->output_channels[ivc.route_port]->conn.dst.id;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Follow the parent links from 'id' and return the root of its tree.  Routers
+// already resolved are memoized in 'root'.
+static int find_root(const CongestionMonitor *cm, std::vector<int> &root,
+                     std::vector<char> &on_path, int id, bool *cyclic)
+{
+    std::vector<int> path;
+    int cur = id;
+    int res = -1;
+    *cyclic = false;
+    while (true) {
+        if (root[cur] >= 0) {
+            res = root[cur];
+            break;
+        }
+        if (on_path[cur]) {
+            // Blocked routers waiting on each other in a cycle.  Name the
+            // tree after the smallest router ID in the cycle.
+            res = cur;
+            for (auto it = std::find(path.begin(), path.end(), cur);
+                 it != path.end(); ++it) {
+                res = std::min(res, *it);
+            }
+            *cyclic = true;
+            break;
+        }
+        on_path[cur] = 1;
+        path.push_back(cur);
+        int p = cm->parent[cur];
+        if (p < 0) {
+            res = cur;
+            break;
+        } else if (cm->parent[p] == NOT_CONGESTED) {
+            // The downstream router has a full input buffer but is not
+            // itself stalled on credits, i.e. it is the bottleneck.
+            res = p;
+            break;
+        }
+        cur = p;
+    }
+    for (int x : path) {
+        root[x] = res;
+        on_path[x] = 0;
+    }
+    return res;
+}
+
+void congestion_sample(CongestionMonitor *cm, Sim *sim)
+{
+    long now = curr_time(&sim->eventq);
+    int n = static_cast<int>(sim->routers.size());
+    cm->sample_count++;
+
+    for (int i = 0; i < n; i++) {
+        Router *r = sim->routers[i].get();
+        const Id *down = router_blocked_downstream(r);
+        cm->streak[i] = down ? cm->streak[i] + 1 : 0;
+        if (cm->streak[i] >= CONGESTION_PERSIST) {
+            cm->parent[i] = is_rtr(*down) ? down->value : DOWNSTREAM_TERMINAL;
+        } else {
+            cm->parent[i] = NOT_CONGESTED;
+        }
+    }
+
+    // Group the congested routers into trees.
+    std::vector<int> root(n, -1);
+    std::vector<char> on_path(n, 0);
+    std::map<int, int> sizes;
+    std::map<int, bool> cyclic;
+    for (int i = 0; i < n; i++) {
+        if (cm->parent[i] == NOT_CONGESTED)
+            continue;
+        bool cyc;
+        int rt = find_root(cm, root, on_path, i, &cyc);
+        sizes[rt]++;
+        if (cyc)
+            cyclic[rt] = true;
+    }
+    for (auto &kv : sizes) {
+        if (cm->parent[kv.first] == NOT_CONGESTED)
+            kv.second++; // the bottleneck router itself
+    }
+
+    // Update the live trees.
+    for (auto &kv : sizes) {
+        auto it = cm->active.find(kv.first);
+        if (it == cm->active.end()) {
+            CongestionTree t = {kv.first, now, now, kv.second, kv.second,
+                                cyclic[kv.first]};
+            cm->active.insert({kv.first, t});
+        } else {
+            CongestionTree &t = it->second;
+            t.last_seen = now;
+            t.size_last = kv.second;
+            t.size_max = std::max(t.size_max, kv.second);
+            t.cyclic |= cyclic[kv.first];
+        }
+    }
+    for (auto it = cm->active.begin(); it != cm->active.end();) {
+        if (sizes.find(it->first) == sizes.end()) {
+            cm->finished.push_back(it->second);
+            it = cm->active.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    for (auto &kv : cm->active) {
+        const CongestionTree &t = kv.second;
+        printf("[@%3ld] Congestion tree: root Rtr %d, size %d, age %ld%s\n",
+               now, t.root, t.size_last, t.last_seen - t.first_seen,
+               t.cyclic ? " (cyclic)" : "");
+    }
+}
+
+void congestion_report(CongestionMonitor *cm, long curr_time)
+{
+    std::vector<CongestionTree> trees = cm->finished;
+    for (auto &kv : cm->active)
+        trees.push_back(kv.second);
+    std::sort(trees.begin(), trees.end(),
+              [](const CongestionTree &a, const CongestionTree &b) {
+                  return (a.last_seen - a.first_seen) >
+                         (b.last_seen - b.first_seen);
+              });
+
+    printf("\n");
+    printf("==== CONGESTION TREES ====\n");
+    printf("# of samples: %ld (every %ld cycles)\n", cm->sample_count,
+           cm->period);
+    printf("# of trees: %zu (%zu live at @%ld)\n", trees.size(),
+           cm->active.size(), curr_time);
+
+    // Hotspots: routers that were a root for the longest in total.
+    std::map<int, long> root_time;
+    for (auto &t : trees)
+        root_time[t.root] += t.last_seen - t.first_seen + cm->period;
+    std::vector<std::pair<int, long>> hotspots(root_time.begin(),
+                                               root_time.end());
+    std::sort(hotspots.begin(), hotspots.end(),
+              [](const std::pair<int, long> &a, const std::pair<int, long> &b) {
+                  return a.second > b.second;
+              });
+    for (size_t i = 0; i < hotspots.size() && i < 10; i++) {
+        printf("Hotspot: Rtr %d, rooted trees for %ld cycles\n",
+               hotspots[i].first, hotspots[i].second);
+    }
+
+    if (!trees.empty()) {
+        printf("\n");
+        printf("%8s %10s %10s %8s %8s\n", "root", "from", "duration",
+               "maxsize", "cyclic");
+    }
+    for (size_t i = 0; i < trees.size() && i < 20; i++) {
+        const CongestionTree &t = trees[i];
+        printf("%8d %10ld %10ld %8d %8s\n", t.root, t.first_seen,
+               t.last_seen - t.first_seen + cm->period, t.size_max,
+               t.cyclic ? "yes" : "no");
+    }
+}
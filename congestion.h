@@ -0,0 +1,46 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <vector>
+#include <map>
+
+// Periodic congestion tree detection.
+//
+// Every 'period' cycles, each router is checked for an input VC that is full
+// and whose output VC is stalled in STATE_CREDWAIT.  If a router stays in that
+// condition for CONGESTION_PERSIST consecutive samples it is considered
+// congested, and linked to the downstream router its blocked VC routes to.
+// The root of a tree is the router at the end of these links that is not
+// stalled on credits itself (its buffer is full, but it is limited by switch
+// or ejection bandwidth), usually the hotspot destination.  The live trees
+// are printed at every sample, and summarized at the end of the run.
+
+// Number of consecutive samples a router has to stay blocked.
+#define CONGESTION_PERSIST 2
+
+typedef struct CongestionTree {
+    int root;        // router ID of the root
+    long first_seen; // cycle of the first sample the tree was seen
+    long last_seen;  // cycle of the last sample the tree was seen
+    int size_last;   // number of routers in the tree at the last sample
+    int size_max;    // maximum number of routers in the tree
+    bool cyclic;     // the blocked routers form a cycle (deadlock?)
+} CongestionTree;
+
+struct Sim;
+typedef struct CongestionMonitor {
+    long period;
+    long next_sample = 0;
+    long sample_count = 0;
+    std::vector<int> streak;  // consecutive blocked samples, per router
+    std::vector<int> parent;  // downstream router, per congested router
+    std::map<int, CongestionTree> active; // live trees, by root
+    std::vector<CongestionTree> finished;
+} CongestionMonitor;
+
+CongestionMonitor *congestion_create(long period, int router_count);
+void congestion_destroy(CongestionMonitor *cm);
+void congestion_sample(CongestionMonitor *cm, Sim *sim);
+void congestion_report(CongestionMonitor *cm, long curr_time);
+
+#endif
@@ -1,4 +1,5 @@
 #include "event.h"
+#include "stb_ds.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -16,34 +17,33 @@ char *id_str(Id id, char *s)
   return s;
 }
 
-static int cmp_pri(pqueue_pri_t next, pqueue_pri_t curr) { return next > curr; }
-static pqueue_pri_t get_pri(void *a) { return ((TimedEvent *)a)->time; }
-static void set_pri(void *a, pqueue_pri_t pri) { ((TimedEvent *)a)->time = pri; }
-static size_t get_pos(void *a) { return ((TimedEvent *)a)->pos; }
-static void set_pos(void *a, size_t pos) { ((TimedEvent *)a)->pos = pos; }
-
 void eventq_init(EventQueue *eq)
 {
     eq->time_ = -1;
-    eq->pq = pqueue_init(1000, cmp_pri, get_pri, set_pri, get_pos, set_pos);
-    assert(eq->pq);
+    eq->heap = NULL;
+    arrsetcap(eq->heap, 1024);
 }
 
 void eventq_destroy(EventQueue *eq)
 {
-    while (pqueue_size(eq->pq) > 0) {
-        TimedEvent *te = (TimedEvent *)pqueue_pop(eq->pq);
-        free(te);
-    }
-    pqueue_free(eq->pq);
+    arrfree(eq->heap);
 }
 
 void schedule(EventQueue *eq, long time, Event e)
 {
-    TimedEvent *te = (TimedEvent *)malloc(sizeof(TimedEvent));
-    te->time = time;
-    te->event = e;
-    pqueue_insert(eq->pq, te);
+    TimedEvent te = {time, e};
+    arrput(eq->heap, te);
+
+    // Sift up.
+    ptrdiff_t i = arrlen(eq->heap) - 1;
+    while (i > 0) {
+        ptrdiff_t parent = (i - 1) / 2;
+        if (eq->heap[parent].time <= time)
+            break;
+        eq->heap[i] = eq->heap[parent];
+        i = parent;
+    }
+    eq->heap[i] = te;
 }
 
 void reschedule(EventQueue *eq, long reltime, Event e)
@@ -60,22 +60,38 @@ long curr_time(const EventQueue *eq)
 // all events at a specific time and stop right before the time changes.
 long next_time(const EventQueue *eq)
 {
-    return ((TimedEvent *)pqueue_peek(eq->pq))->time;
+    return eq->heap[0].time;
 }
 
 Event eventq_pop(EventQueue *eq)
 {
-    TimedEvent *te = (TimedEvent *)pqueue_pop(eq->pq);
-    long time = te->time;
-    Event e = te->event;
-    assert(time >= eq->time_ && "time goes backward!");
+    TimedEvent top = eq->heap[0];
+    assert(top.time >= eq->time_ && "time goes backward!");
     // Update simulation time.
-    eq->time_ = time;
-    free(te);
-    return e;
+    eq->time_ = top.time;
+
+    // Move the last event to the root and sift it down.
+    TimedEvent last = arrpop(eq->heap);
+    ptrdiff_t n = arrlen(eq->heap);
+    if (n > 0) {
+        ptrdiff_t i = 0;
+        while (true) {
+            ptrdiff_t child = 2 * i + 1;
+            if (child >= n)
+                break;
+            if (child + 1 < n && eq->heap[child + 1].time < eq->heap[child].time)
+                child++;
+            if (last.time <= eq->heap[child].time)
+                break;
+            eq->heap[i] = eq->heap[child];
+            i = child;
+        }
+        eq->heap[i] = last;
+    }
+    return top.event;
 }
 
 int eventq_empty(const EventQueue *eq)
 {
-    return pqueue_size(eq->pq) == 0;
+    return arrlen(eq->heap) == 0;
 }
@@ -2,9 +2,7 @@
 #define EVENT_H
 
 #include "stdio.h"
-extern "C" {
-#include "pqueue.h"
-}
+#include <stdint.h>
 
 #define IDSTRLEN 20
 
@@ -29,27 +27,39 @@ static inline Id rtr_id(int id) { return (Id){.type = ID_RTR, .value = id}; }
 
 char *id_str(Id id, char *s);
 
-typedef struct Router Router;
+// Events are addressed by a dense global node index rather than by Id, which
+// is kept for display.  Source nodes come first, then destination nodes, then
+// routers; see Sim::nodes.
+typedef int32_t NodeIndex;
 
-void tick_func(Router *);
+// Event types, dispatched through event_table[] (router.cpp).  The tick of
+// each node type has its own entry.
+enum EventType {
+    EVENT_SRC_TICK,
+    EVENT_DST_TICK,
+    EVENT_RTR_TICK,
+    EVENT_TYPE_COUNT,
+};
 
 // This type is intended to be used by value.
 typedef struct Event {
-    Id id; // target router ID
-    void (*f)(Router *);
+    NodeIndex node; // target node
+    int32_t type;   // enum EventType
 } Event;
 
+// Stored by value in the event heap.
 typedef struct TimedEvent {
     long time;
     Event event;
-    size_t pos; // used for libpqueue
 } TimedEvent;
 
+static_assert(sizeof(TimedEvent) == 16, "TimedEvent should be 16 bytes");
+
 struct EventQueue {
     long curr_time() const { return time_; }
 
     long time_;
-    pqueue_t *pq;
+    TimedEvent *heap; // binary min-heap on time (stb_ds array)
 };
 
 void eventq_init(EventQueue *eq);
@@ -0,0 +1,334 @@
+#include "fault.h"
+#include "sim.h"
+#include <stdio.h>
+#include <limits.h>
+#include <assert.h>
+#include <algorithm>
+
+FaultState *fault_create(enum FaultPolicy policy, int router_count, int radix,
+                         int terminal_count)
+{
+    FaultState *fs = new FaultState;
+    fs->policy = policy;
+    fs->router_count = router_count;
+    fs->radix = radix;
+    fs->link_down.assign(router_count * radix, 0);
+    fs->router_down.assign(router_count, 0);
+    fs->retry.resize(terminal_count);
+    fs->current = {0, 0, 0, 0, 0, 0, 0};
+    return fs;
+}
+
+void fault_destroy(FaultState *fs)
+{
+    delete fs;
+}
+
+// Parses "R:P[@T]" for links and "R[@T]" for routers.  Faults without a time
+// are applied at startup.  Returns 0 on success.
+int fault_parse(const char *spec, enum FaultType type, FaultEvent *ev)
+{
+    int n = 0;
+    ev->type = type;
+    ev->time = 0;
+    ev->port = -1;
+    if (type == FAULT_LINK) {
+        if (sscanf(spec, "%d:%d%n", &ev->router, &ev->port, &n) != 2)
+            return -1;
+    } else {
+        if (sscanf(spec, "%d%n", &ev->router, &n) != 1)
+            return -1;
+    }
+    spec += n;
+    if (*spec == '@') {
+        if (sscanf(spec + 1, "%ld%n", &ev->time, &n) != 1)
+            return -1;
+        spec += 1 + n;
+    }
+    return (*spec == '\0' && ev->time >= 0) ? 0 : -1;
+}
+
+void fault_add(FaultState *fs, FaultEvent ev)
+{
+    if (ev.router < 0 || ev.router >= fs->router_count)
+        fatal("fault: no such router: %d\n", ev.router);
+    if (ev.type == FAULT_LINK &&
+        (ev.port == TERMINAL_PORT || ev.port < 0 || ev.port >= fs->radix))
+        fatal("fault: Rtr %d has no network port %d\n", ev.router, ev.port);
+
+    auto it = std::upper_bound(
+        fs->schedule.begin(), fs->schedule.end(), ev,
+        [](const FaultEvent &a, const FaultEvent &b) { return a.time < b.time; });
+    fs->schedule.insert(it, ev);
+}
+
+// Detours need a second set of dateline VC classes.
+void fault_attach(Sim *sim, FaultState *fs)
+{
+    RouterConfig &cfg = sim->config;
+    if (sim->topology.desc.type != TOP_TORUS)
+        fatal("fault: only supported on tori\n");
+    int classes = cfg.vc_class_count * 2;
+    if (cfg.vc_count < classes || cfg.vc_count % classes != 0)
+        fatal("fault: detours need a multiple of %d VCs (have %d); leave out "
+              "-vc to get one\n", classes, cfg.vc_count);
+    cfg.vc_class_count = classes;
+    cfg.vc_phase_count = 2;
+    sim->faults = fs;
+}
+
+long fault_next_time(const FaultState *fs)
+{
+    if (fs->next < fs->schedule.size())
+        return fs->schedule[fs->next].time;
+    return LONG_MAX;
+}
+
+static int neighbor(Sim *sim, int router, int port)
+{
+    const Id &id = sim->routers[router]->output_channels[port]->conn.dst.id;
+    assert(is_rtr(id));
+    return id.value;
+}
+
+// A link fails in both directions.
+static void fail_link(Sim *sim, FaultState *fs, int router, int port)
+{
+    const Connection &conn = sim->routers[router]->output_channels[port]->conn;
+    int peer = conn.dst.id.value;
+    int peer_port = conn.dst.port;
+    fs->link_down[router * fs->radix + port] = 1;
+    if (sim->routers[peer]->output_channels[peer_port]->conn.dst.id.value ==
+        router) {
+        fs->link_down[peer * fs->radix + peer_port] = 1;
+    }
+}
+
+static void fault_close_epoch(Sim *sim, FaultState *fs, long now)
+{
+    FaultEpoch e = fs->current;
+    e.end = now;
+    e.packet_arrive_count = sim->stat.packet_arrive_count - e.packet_arrive_count;
+    e.latency_sum = sim->stat.latency_sum - e.latency_sum;
+    e.flit_arrive_count = sim->stat.flit_arrive_count - e.flit_arrive_count;
+    e.dropped = fs->dropped - e.dropped;
+    e.retried = fs->retried - e.retried;
+    if (e.end > e.start)
+        fs->epochs.push_back(e);
+
+    fs->current = {now,
+                   now,
+                   sim->stat.packet_arrive_count,
+                   sim->stat.latency_sum,
+                   sim->stat.flit_arrive_count,
+                   fs->dropped,
+                   fs->retried};
+}
+
+// Apply every scheduled fault up to 'time'.  Called at cycle boundaries.
+void fault_apply_due(Sim *sim, long time)
+{
+    FaultState *fs = sim->faults;
+    while (fs->next < fs->schedule.size() &&
+           fs->schedule[fs->next].time <= time) {
+        const FaultEvent &ev = fs->schedule[fs->next++];
+        fault_close_epoch(sim, fs, ev.time);
+        if (ev.type == FAULT_LINK) {
+            fail_link(sim, fs, ev.router, ev.port);
+            printf("[@%3ld] Fault: link Rtr %d port %d -> Rtr %d down\n",
+                   ev.time, ev.router, ev.port,
+                   neighbor(sim, ev.router, ev.port));
+        } else {
+            fs->router_down[ev.router] = 1;
+            for (int port = 0; port < fs->radix; port++) {
+                if (port != TERMINAL_PORT)
+                    fail_link(sim, fs, ev.router, port);
+            }
+            // Its terminal will never retransmit.
+            for (const RetryPacket &rp : fs->retry[ev.router]) {
+                sim->stat.packet_ledger.erase(rp.packet_id);
+                fs->dropped++;
+            }
+            fs->retry[ev.router].clear();
+            printf("[@%3ld] Fault: Rtr %d down\n", ev.time, ev.router);
+        }
+        fs->fault_count++;
+    }
+}
+
+// Walks 'n' ports from router 'from'.  Returns false if the walk crosses a
+// failed link or router; otherwise stores the router it ends at in 'end'.
+static bool path_ok(Sim *sim, const FaultState *fs, int from, const int *ports,
+                    size_t n, int *end)
+{
+    int cur = from;
+    for (size_t i = 0; i < n; i++) {
+        if (fault_router_down(fs, cur) || fault_link_down(fs, cur, ports[i]))
+            return false;
+        cur = neighbor(sim, cur, ports[i]);
+    }
+    if (fault_router_down(fs, cur))
+        return false;
+    *end = cur;
+    return true;
+}
+
+static bool route_ok(Sim *sim, const FaultState *fs, int src, int dst,
+                     const std::vector<int> &path)
+{
+    // The last port is the one to the destination terminal.
+    int end;
+    return path_ok(sim, fs, src, path.data(), path.size() - 1, &end) &&
+           end == dst;
+}
+
+// Search for an intermediate router such that both dimension-order segments
+// src -> mid and mid -> dst avoid the faults.  Candidates are tried in
+// breadth-first order over the healthy links, so shorter detours come first.
+static bool detour_compute(Sim *sim, const FaultState *fs, int src, int dst,
+                           Detour *d)
+{
+    const Topology *top = &sim->topology;
+    std::vector<char> seen(fs->router_count, 0);
+    std::deque<int> frontier{src};
+    seen[src] = 1;
+
+    while (!frontier.empty()) {
+        int cur = frontier.front();
+        frontier.pop_front();
+        for (int port = 0; port < fs->radix; port++) {
+            if (port == TERMINAL_PORT || fault_link_down(fs, cur, port))
+                continue;
+            int next = neighbor(sim, cur, port);
+            if (seen[next] || fault_router_down(fs, next))
+                continue;
+            seen[next] = 1;
+            frontier.push_back(next);
+            if (next == dst)
+                continue;
+
+            unsigned ccw;
+            std::vector<int> first =
+                source_route_compute(NULL, top, src, next, &ccw);
+            std::vector<int> second =
+                source_route_compute(NULL, top, next, dst, &ccw);
+            if (!route_ok(sim, fs, src, next, first) ||
+                !route_ok(sim, fs, next, dst, second))
+                continue;
+
+            d->path.assign(first.begin(), first.end() - 1);
+            d->detour_hop = static_cast<int>(d->path.size());
+            d->path.insert(d->path.end(), second.begin(), second.end());
+            d->fault_count = fs->fault_count;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Make the source route in 'ri' avoid the known faults, detouring if needed.
+// Returns false if the destination is unreachable.
+bool fault_route(Sim *sim, int src, int dst, RouteInfo *ri)
+{
+    FaultState *fs = sim->faults;
+    ri->detour_hop = -1;
+    if (fault_router_down(fs, src) || fault_router_down(fs, dst))
+        return false;
+    if (fs->fault_count == 0 || route_ok(sim, fs, src, dst, ri->path))
+        return true;
+
+    long key = static_cast<long>(src) * fs->router_count + dst;
+    auto it = fs->detours.find(key);
+    if (it != fs->detours.end() && it->second.fault_count != fs->fault_count) {
+        // Faults happened since; keep the detour if it still works.
+        if (route_ok(sim, fs, src, dst, it->second.path)) {
+            it->second.fault_count = fs->fault_count;
+        } else {
+            fs->detours.erase(it);
+            it = fs->detours.end();
+        }
+    }
+    if (it == fs->detours.end()) {
+        Detour d;
+        if (!detour_compute(sim, fs, src, dst, &d))
+            return false;
+        it = fs->detours.insert({key, d}).first;
+    }
+
+    ri->path = it->second.path;
+    ri->detour_hop = it->second.detour_hop;
+    // Recover the counterclockwise dimensions from the ports themselves.
+    ri->ccw_dims = 0;
+    for (int port : ri->path) {
+        if (port != TERMINAL_PORT && (port - 1) % 2 == 0)
+            ri->ccw_dims |= (1u << ((port - 1) / 2));
+    }
+    return true;
+}
+
+// The head flit of a packet was discarded in the network.
+void fault_drop(Sim *sim, Flit *head)
+{
+    FaultState *fs = sim->faults;
+    if (sim->cc)
+        cc_lost(sim->cc, head->packet_id.src);
+    if (fs->policy == FAULT_RETRY && !fault_router_down(fs, head->packet_id.src)) {
+        // Keep the ledger entry, so that latency counts from the original
+        // generation.
+        fs->retry[head->packet_id.src].push_back(
+            {head->packet_id, head->route_info.dst, head->qos_class});
+        fs->retried++;
+        schedule(&sim->eventq, curr_time(&sim->eventq) + 1,
+                 tick_event(sim->src_nodes[head->packet_id.src].get()));
+    } else {
+        sim->stat.packet_ledger.erase(head->packet_id);
+        fs->dropped++;
+    }
+}
+
+bool fault_retry_pop(FaultState *fs, int src, RetryPacket *rp)
+{
+    if (fs->retry[src].empty())
+        return false;
+    *rp = fs->retry[src].front();
+    fs->retry[src].pop_front();
+    return true;
+}
+
+void fault_report(Sim *sim)
+{
+    FaultState *fs = sim->faults;
+    fault_close_epoch(sim, fs, curr_time(&sim->eventq));
+
+    long links = 0, routers = 0;
+    for (char c : fs->link_down)
+        links += c;
+    for (char c : fs->router_down)
+        routers += c;
+
+    printf("\n");
+    printf("==== FAULTS ====\n");
+    printf("Policy: %s\n", fs->policy == FAULT_RETRY ? "retry" : "drop");
+    printf("# of failed links: %ld (one-way)\n", links);
+    printf("# of failed routers: %ld\n", routers);
+    printf("# of packets dropped: %ld\n", fs->dropped);
+    printf("# of packets retried: %ld\n", fs->retried);
+    printf("# of unroutable packets: %ld\n", fs->unroutable);
+    printf("# of cached detours: %zu\n", fs->detours.size());
+    printf("\n");
+
+    // Throughput in flits/cycle/node over all terminals, failed or not.
+    printf("%10s %10s %12s %10s %8s %8s\n", "from", "to", "throughput",
+           "latency", "dropped", "retried");
+    double nodes = static_cast<double>(sim->src_nodes.size());
+    for (const FaultEpoch &e : fs->epochs) {
+        double cycles = static_cast<double>(e.end - e.start);
+        double latency =
+            e.packet_arrive_count > 0
+                ? static_cast<double>(e.latency_sum) / e.packet_arrive_count
+                : 0.0;
+        printf("%10ld %10ld %12.4lf %10.3lf %8ld %8ld\n", e.start, e.end,
+               e.flit_arrive_count / cycles / nodes, latency, e.dropped,
+               e.retried);
+    }
+}
@@ -0,0 +1,108 @@
+#ifndef FAULT_H
+#define FAULT_H
+
+#include "router.h"
+#include <vector>
+#include <deque>
+#include <unordered_map>
+
+// Link and router fault injection.
+//
+// Faults are applied at startup or at scheduled cycles.  A failed link stops
+// accepting new packets in both directions; worms that already hold a VC on it
+// drain normally.  A failed router drops every packet that is routed through
+// it, and its terminal stops injecting.  Packets whose head reaches a failed
+// link are discarded flit by flit at that router, and are either dropped for
+// good or retransmitted by their source, depending on the policy.
+//
+// Routes are still computed at the source.  The dimension-order route is used
+// whenever it avoids all faults.  Otherwise the packet is detoured through an
+// intermediate router, taking two dimension-order phases: src -> mid and
+// mid -> dst.  Each phase has its own pair of dateline VC classes, so the
+// detour stays deadlock-free.  Detours are computed on demand and cached per
+// source-destination pair; a new fault only bumps a counter, and cached routes
+// are revalidated lazily when next used.
+
+enum FaultType {
+    FAULT_LINK,
+    FAULT_ROUTER,
+};
+
+enum FaultPolicy {
+    FAULT_DROP,  // discard packets that run into a failed link
+    FAULT_RETRY, // retransmit them from the source
+};
+
+typedef struct FaultEvent {
+    long time;
+    enum FaultType type;
+    int router;
+    int port; // output port of the failed link, for FAULT_LINK
+} FaultEvent;
+
+typedef struct RetryPacket {
+    PacketId packet_id;
+    int dst;
+    int qos_class;
+} RetryPacket;
+
+// Throughput and latency between two consecutive fault times.
+typedef struct FaultEpoch {
+    long start;
+    long end;
+    long packet_arrive_count;
+    long latency_sum;
+    long flit_arrive_count;
+    long dropped;
+    long retried;
+} FaultEpoch;
+
+typedef struct Detour {
+    std::vector<int> path;
+    int detour_hop;   // index in path where the second phase starts
+    long fault_count; // number of faults the detour was validated against
+} Detour;
+
+struct Sim;
+typedef struct FaultState {
+    enum FaultPolicy policy;
+    int router_count;
+    int radix;
+    std::vector<FaultEvent> schedule; // sorted by time
+    size_t next = 0;                  // next fault in 'schedule' to apply
+    std::vector<char> link_down;      // by router * radix + output port
+    std::vector<char> router_down;    // by router ID
+    long fault_count = 0;
+    std::unordered_map<long, Detour> detours; // by src * router_count + dst
+    std::vector<std::deque<RetryPacket>> retry; // per source terminal
+    long dropped = 0;    // packets discarded for good
+    long retried = 0;    // packets retransmitted from the source
+    long unroutable = 0; // packets with no route at generation
+    FaultEpoch current;
+    std::vector<FaultEpoch> epochs;
+} FaultState;
+
+FaultState *fault_create(enum FaultPolicy policy, int router_count, int radix,
+                         int terminal_count);
+void fault_destroy(FaultState *fs);
+int fault_parse(const char *spec, enum FaultType type, FaultEvent *ev);
+void fault_add(FaultState *fs, FaultEvent ev);
+void fault_attach(Sim *sim, FaultState *fs);
+long fault_next_time(const FaultState *fs);
+void fault_apply_due(Sim *sim, long time);
+bool fault_route(Sim *sim, int src, int dst, RouteInfo *ri);
+void fault_drop(Sim *sim, Flit *head);
+bool fault_retry_pop(FaultState *fs, int src, RetryPacket *rp);
+void fault_report(Sim *sim);
+
+static inline bool fault_link_down(const FaultState *fs, int router, int port)
+{
+    return fs->link_down[router * fs->radix + port];
+}
+
+static inline bool fault_router_down(const FaultState *fs, int router)
+{
+    return fs->router_down[router];
+}
+
+#endif
@@ -0,0 +1,293 @@
+#include "flight.h"
+#include "sim.h"
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+
+thread_local NodeIndex flight_node = -1;
+// Recorder of the simulation run by this thread.
+static thread_local FlightRecorder *flight_current = NULL;
+
+static const int flight_signals[] = {SIGABRT, SIGSEGV, SIGBUS, SIGFPE,
+                                     SIGILL};
+#define FLIGHT_SIGNAL_COUNT                                                    \
+    static_cast<int>(sizeof(flight_signals) / sizeof(flight_signals[0]))
+static struct sigaction flight_old_actions[FLIGHT_SIGNAL_COUNT];
+
+static const char *const flight_kind_names[FLIGHT_KIND_COUNT] = {
+    "gen", "inject", "arrive", "RC", "VA", "SA", "ST", "drop", "consume",
+    "credit in", "credit out",
+};
+
+// A line of the dump.  The dump runs in a signal handler, where neither stdio
+// nor the heap can be used, so lines are formatted by hand into a buffer on
+// the stack and written with write(2).
+typedef struct FlightLine {
+    char buf[256];
+    int len;
+} FlightLine;
+
+static void line_str(FlightLine *l, const char *s)
+{
+    while (*s && l->len < static_cast<int>(sizeof(l->buf)))
+        l->buf[l->len++] = *s++;
+}
+
+static void line_long(FlightLine *l, long v)
+{
+    char digits[24];
+    int n = 0;
+    unsigned long u = v < 0 ? 0ul - static_cast<unsigned long>(v) : v;
+
+    do {
+        digits[n++] = static_cast<char>('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0)
+        digits[n++] = '-';
+    while (n > 0 && l->len < static_cast<int>(sizeof(l->buf)))
+        l->buf[l->len++] = digits[--n];
+}
+
+// Pad with spaces up to column 'col'.
+static void line_pad(FlightLine *l, int col)
+{
+    while (l->len < col && l->len < static_cast<int>(sizeof(l->buf)))
+        l->buf[l->len++] = ' ';
+}
+
+static void line_id(FlightLine *l, Id id)
+{
+    line_str(l, is_src(id) ? "Src " : is_dst(id) ? "Dst " : "Rtr ");
+    line_long(l, id.value);
+}
+
+// Write out the line followed by a newline, and empty it.
+static void line_write(FlightLine *l)
+{
+    if (l->len == static_cast<int>(sizeof(l->buf)))
+        l->len--;
+    l->buf[l->len++] = '\n';
+    for (int off = 0; off < l->len;) {
+        ssize_t w = write(STDERR_FILENO, l->buf + off, l->len - off);
+        if (w <= 0)
+            break;
+        off += static_cast<int>(w);
+    }
+    l->len = 0;
+}
+
+// Dump the recorder of the thread that caught 'sig', then hand the signal
+// back to whoever handled it before.  It stays blocked until the handler
+// returns, so the raised copy reaches the restored action right after.
+static void flight_signal(int sig)
+{
+    for (int i = 0; i < FLIGHT_SIGNAL_COUNT; i++)
+        sigaction(flight_signals[i], &flight_old_actions[i], NULL);
+    if (flight_current && flight_node >= 0) {
+        FlightLine l = {};
+        line_write(&l);
+        line_str(&l, "Caught signal ");
+        line_long(&l, sig);
+        line_str(&l, ".");
+        line_write(&l);
+        flight_dump(flight_current, flight_node);
+    }
+    raise(sig);
+}
+
+FlightRecorder *flight_create(long len)
+{
+    if (len <= 0)
+        fatal("flight recorder: invalid length: %ld\n", len);
+    FlightRecorder *fr = new FlightRecorder;
+    fr->sim = NULL;
+    fr->len = 1;
+    while (fr->len < len)
+        fr->len *= 2;
+    return fr;
+}
+
+void flight_attach(Sim *sim, FlightRecorder *fr)
+{
+    static bool installed = false;
+    const RouterConfig *cfg = &sim->config;
+
+    if (cfg->vc_count > UINT8_MAX || cfg->input_buf_size > INT16_MAX ||
+        cfg->packet_len > UINT16_MAX)
+        fatal("flight recorder: VCs, buffers or packets too large to "
+              "record; use -flight 0\n");
+    for (Router *node : sim->nodes) {
+        if (node->input_count > INT16_MAX || node->output_count > INT16_MAX)
+            fatal("flight recorder: radix too large to record; use -flight "
+                  "0\n");
+    }
+    for (Router *node : sim->nodes) {
+        node->flight = static_cast<FlightEvent *>(arena_alloc(
+            sim->arena, fr->len * sizeof(FlightEvent), alignof(FlightEvent)));
+        node->flight_pos = 0;
+        node->flight_mask = fr->len - 1;
+    }
+    fr->sim = sim;
+    sim->flight = fr;
+
+    if (!installed) {
+        struct sigaction sa = {};
+        sa.sa_handler = flight_signal;
+        sigemptyset(&sa.sa_mask);
+        for (int i = 0; i < FLIGHT_SIGNAL_COUNT; i++)
+            sigaction(flight_signals[i], &sa, &flight_old_actions[i]);
+        installed = true;
+    }
+}
+
+// Make 'fr' the recorder to dump if this thread dies.
+void flight_enter(FlightRecorder *fr)
+{
+    flight_current = fr;
+    flight_node = -1;
+}
+
+static Router *flight_node_of(Sim *sim, Id id)
+{
+    if (is_src(id))
+        return sim->src_nodes[id.value].get();
+    if (is_dst(id))
+        return sim->dst_nodes[id.value].get();
+    return sim->routers[id.value].get();
+}
+
+static void flight_dump_node(Router *r)
+{
+    FlightLine l = {};
+    long now = curr_time(r->cfg->eventq);
+    long count = std::min(r->flight_pos, r->flight_mask + 1);
+
+    line_str(&l, "[");
+    line_id(&l, r->id);
+    line_str(&l, "] last ");
+    line_long(&l, count);
+    line_str(&l, " events:");
+    line_write(&l);
+    for (long i = r->flight_pos - count; i < r->flight_pos; i++) {
+        const FlightEvent &e = r->flight[i & r->flight_mask];
+        long time = now - static_cast<uint32_t>(static_cast<uint32_t>(now) -
+                                                e.time);
+        line_str(&l, "  @");
+        line_long(&l, time);
+        line_str(&l, " ");
+        int col = l.len;
+        line_str(&l, flight_kind_names[e.kind]);
+        line_pad(&l, col + 10);
+        line_str(&l, " ");
+        col = l.len;
+        if (e.src >= 0) {
+            line_str(&l, "{s");
+            line_long(&l, e.src);
+            line_str(&l, ".p");
+            line_long(&l, e.id);
+            line_str(&l, ".f");
+            line_long(&l, e.flitnum);
+            line_str(&l, "}");
+        }
+        line_pad(&l, col + 16);
+
+        switch (e.kind) {
+        case FLIGHT_GEN:
+            line_str(&l, " class ");
+            line_long(&l, e.arg[0]);
+            break;
+        case FLIGHT_INJECT:
+            line_str(&l, " VC");
+            line_long(&l, e.vc);
+            line_str(&l, ", credits ");
+            line_long(&l, e.arg[0]);
+            break;
+        case FLIGHT_CREDIT_IN:
+            line_str(&l, " out ");
+            line_long(&l, e.port);
+            line_str(&l, " VC");
+            line_long(&l, e.vc);
+            line_str(&l, ", credits ");
+            line_long(&l, e.arg[0]);
+            break;
+        default:
+            line_str(&l, " in ");
+            line_long(&l, e.port);
+            line_str(&l, " VC");
+            line_long(&l, e.vc);
+            break;
+        }
+        switch (e.kind) {
+        case FLIGHT_ARRIVE:
+            line_str(&l, ", buffer ");
+            line_long(&l, e.arg[0]);
+            break;
+        case FLIGHT_RC:
+        case FLIGHT_VA:
+        case FLIGHT_SA:
+        case FLIGHT_ST:
+            line_str(&l, " -> out ");
+            line_long(&l, e.arg[0]);
+            if (e.kind == FLIGHT_SA) {
+                line_str(&l, ", credits ");
+                line_long(&l, e.arg[1]);
+            } else if (e.kind != FLIGHT_RC) {
+                line_str(&l, " VC");
+                line_long(&l, e.arg[1]);
+            }
+            break;
+        default:
+            break;
+        }
+        line_write(&l);
+    }
+}
+
+// The k-th node at the other end of the channels of 'r', inputs first.
+static Router *flight_neighbor(Sim *sim, Router *r, int k)
+{
+    if (k < r->input_count)
+        return flight_node_of(sim, r->input_channels[k]->conn.src.id);
+    return flight_node_of(
+        sim, r->output_channels[k - r->input_count]->conn.dst.id);
+}
+
+// Dump the rings of 'node' and of the nodes at the other end of its channels.
+// Nodes reached by several channels are found by scanning the earlier ones,
+// which needs no memory.
+void flight_dump(FlightRecorder *fr, NodeIndex node)
+{
+    Sim *sim = fr->sim;
+    Router *r = sim->nodes[node];
+    FlightLine l = {};
+
+    line_str(&l, "==== FLIGHT RECORDER ====");
+    line_write(&l);
+    line_str(&l, "Running ");
+    line_id(&l, r->id);
+    line_str(&l, " at cycle ");
+    line_long(&l, curr_time(r->cfg->eventq));
+    line_str(&l, ".");
+    line_write(&l);
+    flight_dump_node(r);
+
+    int count = r->input_count + r->output_count;
+    for (int k = 0; k < count; k++) {
+        Router *n = flight_neighbor(sim, r, k);
+        bool seen = n == r;
+        for (int j = 0; j < k && !seen; j++)
+            seen = flight_neighbor(sim, r, j) == n;
+        if (!seen)
+            flight_dump_node(n);
+    }
+}
+
+void flight_destroy(FlightRecorder *fr)
+{
+    if (flight_current == fr)
+        flight_enter(NULL);
+    for (Router *node : fr->sim->nodes)
+        node->flight = NULL;
+    delete fr;
+}
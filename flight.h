@@ -0,0 +1,83 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include "router.h"
+#include <stdint.h>
+
+// Flight recorder.
+//
+// Every node keeps a ring of its last 'len' pipeline events (flits arriving,
+// RC, VA, SA, ST, credits in and out) in a compact binary form, in the arena
+// of the simulation.  Recording one is a few stores.  Nothing is ever printed
+// unless the simulator dies of an assertion or a fatal signal: then the rings
+// of the node that was running and of its neighbors are dumped to stderr,
+// oldest event first.
+//
+// Times are kept as their low 32 bits, and restored against the current cycle
+// when dumped.  flight_attach() refuses networks whose ports, VCs, buffers or
+// packets do not fit the fields below.
+
+#define FLIGHT_DEFAULT_LEN 64
+
+enum FlightKind : uint8_t {
+    FLIGHT_GEN,        // flit generated into a source queue
+    FLIGHT_INJECT,     // flit sent from a source queue
+    FLIGHT_ARRIVE,     // flit written into an input buffer
+    FLIGHT_RC,         // route computed
+    FLIGHT_VA,         // output VC allocated
+    FLIGHT_SA,         // switch allocated
+    FLIGHT_ST,         // flit sent through the switch
+    FLIGHT_DROP,       // flit discarded at the switch
+    FLIGHT_CONSUME,    // flit consumed at the destination
+    FLIGHT_CREDIT_IN,  // credit received on an output port
+    FLIGHT_CREDIT_OUT, // credit sent back on an input port
+    FLIGHT_KIND_COUNT,
+};
+
+typedef struct FlightEvent {
+    uint32_t time;   // low 32 bits of the cycle
+    int32_t src;     // source of the packet, or -1
+    int32_t id;      // packet ID at the source
+    uint8_t kind;     // enum FlightKind
+    uint8_t vc;
+    uint16_t port;    // input port; output port for credits in
+    uint16_t flitnum;
+    int16_t arg[2];   // by kind: output port and VC, credits, buffer length
+} FlightEvent;
+
+static_assert(sizeof(FlightEvent) == 24, "FlightEvent should be 24 bytes");
+
+struct Sim;
+typedef struct FlightRecorder {
+    Sim *sim;
+    long len; // events per node, a power of two
+} FlightRecorder;
+
+FlightRecorder *flight_create(long len);
+void flight_attach(Sim *sim, FlightRecorder *fr);
+void flight_enter(FlightRecorder *fr);
+void flight_dump(FlightRecorder *fr, NodeIndex node);
+void flight_destroy(FlightRecorder *fr);
+
+// Node whose event is being run by this thread, for the dump.
+extern thread_local NodeIndex flight_node;
+
+static inline void flight_record(Router *r, enum FlightKind kind, int port,
+                                 int vc, const Flit *flit, int arg0 = -1,
+                                 int arg1 = -1)
+{
+    if (!r->flight)
+        return;
+    FlightEvent *e = &r->flight[r->flight_pos++ & r->flight_mask];
+    e->time = static_cast<uint32_t>(curr_time(r->cfg->eventq));
+    e->src = flit ? flit->route_info.src : -1;
+    e->id = flit ? static_cast<int32_t>(flit->packet_id.id) : -1;
+    e->kind = kind;
+    e->vc = static_cast<uint8_t>(vc);
+    e->port = static_cast<uint16_t>(port);
+    e->flitnum = flit ? static_cast<uint16_t>(flit->flitnum) : 0;
+    e->arg[0] = static_cast<int16_t>(arg0);
+    e->arg[1] = static_cast<int16_t>(arg1);
+}
+
+#endif
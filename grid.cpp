@@ -0,0 +1,422 @@
+#include "grid.h"
+#include "sim.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
+
+#define GRID_LINE_MAX 4096
+
+typedef struct GridPool {
+    GridPool(int threads) : workers(threads) {}
+
+    std::vector<GridWorker> workers;
+    GridRunFn run;
+    std::vector<char *> base_args; // options common to all jobs
+
+    // Admission control.
+    std::mutex admit_lock;
+    std::condition_variable admit_cv;
+    long mem_limit = 0;
+    long mem_used = 0;
+    int running = 0;
+
+    // Results.
+    const char *cache_dir = NULL;
+    std::mutex out_lock;
+    FILE *out = NULL;
+    long done = 0;
+    long total = 0;
+    long cached = 0;
+    std::chrono::steady_clock::time_point start;
+} GridPool;
+
+static double seconds_since(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t)
+        .count();
+}
+
+// Reads the grid spec at 'path' and appends every combination of its values
+// to 'jobs'.
+void grid_parse(const char *path, std::vector<GridJob> *jobs)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        fatal("grid: cannot open %s\n", path);
+
+    // One axis per line: the option, then its values.
+    std::vector<std::vector<std::string>> axes;
+    char line[GRID_LINE_MAX];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        std::vector<std::string> axis;
+        for (char *tok = strtok(line, " \t\r\n"); tok;
+             tok = strtok(NULL, " \t\r\n")) {
+            axis.push_back(tok);
+        }
+        if (axis.empty() || axis[0][0] == '#')
+            continue;
+        if (axis[0][0] != '-' || axis.size() < 2)
+            fatal("grid: %s:%d: expected an option and its values\n", path,
+                  lineno);
+        axes.push_back(axis);
+    }
+    fclose(f);
+
+    // Odometer over the value index of each axis, the last one fastest.
+    std::vector<size_t> idx(axes.size(), 1);
+    for (;;) {
+        GridJob job;
+        job.id = static_cast<long>(jobs->size());
+        for (size_t a = 0; a < axes.size(); a++) {
+            job.args.push_back(axes[a][0]);
+            job.args.push_back(axes[a][idx[a]]);
+        }
+        job.cost = 0.0;
+        job.mem = 0;
+        jobs->push_back(job);
+
+        size_t a = axes.size();
+        while (a > 0) {
+            a--;
+            if (++idx[a] < axes[a].size())
+                break;
+            idx[a] = 1;
+            if (a == 0)
+                return;
+        }
+        if (axes.empty())
+            return;
+    }
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+
+// Hash of the contents of the file at 'path' into '*h'.  Returns false if it
+// cannot be read.
+bool grid_file_hash(const char *path, uint64_t *h)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return false;
+    *h = FNV_OFFSET;
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        *h = fnv1a(*h, buf, n);
+    fclose(f);
+    return true;
+}
+
+// Identifies the simulator build: a hash of the running executable, so that
+// any rebuild invalidates the cached results.
+static uint64_t build_id(void)
+{
+    uint64_t h;
+    if (!grid_file_hash("/proc/self/exe", &h)) {
+        // Fall back to the compile time of this file.
+        const char *t = __DATE__ " " __TIME__;
+        return fnv1a(FNV_OFFSET, t, strlen(t));
+    }
+    return h;
+}
+
+static std::string cache_path(const GridPool *pool, const GridJob *job)
+{
+    return std::string(pool->cache_dir) + "/" + job->key;
+}
+
+// Load the cached result of a job.  The entry holds the configuration it was
+// made for, which must match, then the result record.
+static bool cache_load(const GridPool *pool, GridJob *job, double *seconds)
+{
+    FILE *f = fopen(cache_path(pool, job).c_str(), "r");
+    if (!f)
+        return false;
+    char line[GRID_LINE_MAX];
+    bool hit = false;
+    if (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        GridResult &res = job->res;
+        hit = job->res.config == line &&
+              fscanf(f, "%lf %ld %ld %ld %lf %lf %lf %lf %lf", seconds,
+                     &res.cycles, &res.packets_generated, &res.packets_arrived,
+                     &res.latency, &res.hops, &res.throughput,
+                     &res.throughput_min, &res.fairness) == 9;
+    }
+    fclose(f);
+    return hit;
+}
+
+// Store the result of a job.  The entry is written under a temporary name
+// and renamed, so that readers never see a partial one.
+static void cache_store(const GridPool *pool, const GridJob *job,
+                        double seconds)
+{
+    std::string path = cache_path(pool, job);
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "grid: cannot write %s\n", tmp.c_str());
+        return;
+    }
+    const GridResult &res = job->res;
+    fprintf(f, "%s\n%.17g %ld %ld %ld %.17g %.17g %.17g %.17g %.17g\n",
+            res.config.c_str(), seconds, res.cycles, res.packets_generated,
+            res.packets_arrived, res.latency, res.hops, res.throughput,
+            res.throughput_min, res.fairness);
+    fclose(f);
+    if (rename(tmp.c_str(), path.c_str()) != 0)
+        fprintf(stderr, "grid: cannot write %s\n", path.c_str());
+}
+
+// Command line of a job: the common options, then the job's own, so that the
+// grid overrides the command line.
+static std::vector<char *> job_argv(const GridPool *pool, GridJob *job)
+{
+    std::vector<char *> argv = pool->base_args;
+    for (std::string &arg : job->args)
+        argv.push_back(&arg[0]);
+    argv.push_back(NULL);
+    return argv;
+}
+
+// Estimate the work and the memory of a job from the size of its network.
+static void job_estimate(GridJob *job)
+{
+    const GridResult &n = job->res;
+    long vcs = n.routers * n.radix * n.vc_count;
+    double interval = std::max(n.mean_interval, 1.0);
+
+    // Every tick visits each VC, plus the flits injected.
+    job->cost = static_cast<double>(n.cycles) *
+                (vcs + n.terminals * n.packet_len / interval);
+    // VCs with full buffers, the terminals and their source queues, and a
+    // fixed overhead.
+    job->mem = vcs * static_cast<long>(sizeof(InputVC) + sizeof(OutputVC) +
+                                       n.input_buf_size * (2 * sizeof(Flit *) +
+                                                           sizeof(Flit))) +
+               n.terminals * static_cast<long>(2 * sizeof(Router) +
+                                               SOURCE_QUEUE_LEN * sizeof(Flit *)) +
+               (1L << 20);
+}
+
+// Take the next job for worker 'self': its own largest one, or else the
+// largest one of the worker that has the largest pending job.
+static GridJob *grid_take(GridPool *pool, int self)
+{
+    GridWorker &own = pool->workers[self];
+    {
+        std::lock_guard<std::mutex> l(own.lock);
+        if (!own.jobs.empty()) {
+            GridJob *job = own.jobs.front();
+            own.jobs.pop_front();
+            return job;
+        }
+    }
+
+    for (;;) {
+        int victim = -1;
+        double victim_cost = -1.0;
+        for (int w = 0; w < static_cast<int>(pool->workers.size()); w++) {
+            if (w == self)
+                continue;
+            GridWorker &other = pool->workers[w];
+            std::lock_guard<std::mutex> l(other.lock);
+            if (!other.jobs.empty() && other.jobs.front()->cost > victim_cost) {
+                victim = w;
+                victim_cost = other.jobs.front()->cost;
+            }
+        }
+        if (victim < 0)
+            return NULL;
+
+        GridWorker &other = pool->workers[victim];
+        std::lock_guard<std::mutex> l(other.lock);
+        // The victim may have taken it in the meantime; look again.
+        if (other.jobs.empty())
+            continue;
+        GridJob *job = other.jobs.front();
+        other.jobs.pop_front();
+        own.steal_count++;
+        return job;
+    }
+}
+
+// Wait until the job fits in the memory budget.
+static void grid_admit(GridPool *pool, const GridJob *job)
+{
+    std::unique_lock<std::mutex> l(pool->admit_lock);
+    pool->admit_cv.wait(l, [&] {
+        return pool->mem_limit == 0 || pool->running == 0 ||
+               pool->mem_used + job->mem <= pool->mem_limit;
+    });
+    pool->mem_used += job->mem;
+    pool->running++;
+}
+
+static void grid_release(GridPool *pool, const GridJob *job)
+{
+    {
+        std::lock_guard<std::mutex> l(pool->admit_lock);
+        pool->mem_used -= job->mem;
+        pool->running--;
+    }
+    pool->admit_cv.notify_all();
+}
+
+static void grid_write(GridPool *pool, const GridJob *job, double seconds,
+                       bool cached)
+{
+    const GridResult &res = job->res;
+    std::lock_guard<std::mutex> l(pool->out_lock);
+    fprintf(pool->out, "%ld\t%.3lf\t%ld\t%ld\t%ld\t%lf\t%lf\t%lf\t%lf\t%lf\t",
+            job->id, seconds, res.cycles, res.packets_generated,
+            res.packets_arrived, res.latency, res.hops, res.throughput,
+            res.throughput_min, res.fairness);
+    for (size_t i = 0; i < job->args.size(); i++)
+        fprintf(pool->out, "%s%s", i ? " " : "", job->args[i].c_str());
+    fprintf(pool->out, "\n");
+    fflush(pool->out);
+
+    pool->done++;
+    if (!cached) {
+        fprintf(stderr, "[grid %ld/%ld] job %ld took %.2lfs\n", pool->done,
+                pool->total, job->id, seconds);
+    }
+}
+
+static void grid_worker(GridPool *pool, int self)
+{
+    GridWorker &own = pool->workers[self];
+    while (GridJob *job = grid_take(pool, self)) {
+        grid_admit(pool, job);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<char *> argv = job_argv(pool, job);
+        pool->run(static_cast<int>(argv.size()) - 1, argv.data(), false,
+                  &job->res);
+        double seconds = seconds_since(start);
+        grid_release(pool, job);
+
+        own.run_count++;
+        own.busy += seconds;
+        if (!job->key.empty())
+            cache_store(pool, job, seconds);
+        grid_write(pool, job, seconds, false);
+    }
+}
+
+int grid_run(const GridOptions *opts, int argc, char **argv, GridRunFn run)
+{
+    std::vector<GridJob> jobs;
+    grid_parse(opts->spec_path, &jobs);
+
+    int threads = opts->threads;
+    if (threads <= 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    GridPool pool{threads};
+    pool.run = run;
+    pool.base_args.assign(argv, argv + argc);
+    pool.mem_limit = opts->mem_limit;
+    pool.cache_dir = opts->cache_dir;
+    pool.total = static_cast<long>(jobs.size());
+
+    // Check every job before starting any, and size them.
+    for (GridJob &job : jobs) {
+        std::vector<char *> jargv = job_argv(&pool, &job);
+        run(static_cast<int>(jargv.size()) - 1, jargv.data(), true, &job.res);
+        job_estimate(&job);
+    }
+
+    pool.out = opts->out_path ? fopen(opts->out_path, "w") : stdout;
+    if (!pool.out)
+        fatal("grid: cannot open %s\n", opts->out_path);
+    fprintf(pool.out, "# id\tseconds\tcycles\tgenerated\tarrived\tlatency\t"
+                      "hops\tthroughput\tmin_throughput\tfairness\toptions\n");
+    fflush(pool.out);
+
+    // Jobs with a cached result are reported right away.
+    std::vector<GridJob *> order;
+    uint64_t build = pool.cache_dir ? build_id() : 0;
+    if (pool.cache_dir && mkdir(pool.cache_dir, 0777) != 0 && errno != EEXIST)
+        fatal("grid: cannot create %s\n", pool.cache_dir);
+    for (GridJob &job : jobs) {
+        if (pool.cache_dir && job.res.seeded) {
+            uint64_t h = fnv1a(FNV_OFFSET, &build, sizeof(build));
+            h = fnv1a(h, job.res.config.data(), job.res.config.size());
+            char key[17];
+            snprintf(key, sizeof(key), "%016llx",
+                     static_cast<unsigned long long>(h));
+            job.key = key;
+            double seconds;
+            if (cache_load(&pool, &job, &seconds)) {
+                pool.cached++;
+                grid_write(&pool, &job, seconds, true);
+                continue;
+            }
+        }
+        order.push_back(&job);
+    }
+    if (pool.cache_dir) {
+        fprintf(stderr, "[grid] %ld of %ld jobs cached\n", pool.cached,
+                pool.total);
+    }
+
+    // Deal the jobs out largest first, so that every worker's queue is also
+    // ordered largest first.
+    std::stable_sort(order.begin(), order.end(),
+                     [](const GridJob *a, const GridJob *b) {
+                         return a->cost > b->cost;
+                     });
+    for (size_t i = 0; i < order.size(); i++)
+        pool.workers[i % threads].jobs.push_back(order[i]);
+
+    pool.start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for (int w = 0; w < threads; w++)
+        workers.emplace_back(grid_worker, &pool, w);
+    for (std::thread &t : workers)
+        t.join();
+    double elapsed = seconds_since(pool.start);
+
+    if (pool.out != stdout)
+        fclose(pool.out);
+
+    printf("\n");
+    printf("==== EXPERIMENT GRID ====\n");
+    printf("# of jobs: %ld\n", pool.total);
+    if (pool.cache_dir)
+        printf("# of cached jobs: %ld\n", pool.cached);
+    printf("# of workers: %d\n", threads);
+    if (pool.mem_limit > 0)
+        printf("Memory budget: %ld MiB\n", pool.mem_limit >> 20);
+    printf("Elapsed: %.2lfs\n", elapsed);
+    printf("\n");
+    printf("%6s %6s %6s %10s %6s\n", "worker", "jobs", "stolen", "busy",
+           "util");
+    for (int w = 0; w < threads; w++) {
+        const GridWorker &gw = pool.workers[w];
+        printf("%6d %6ld %6ld %9.2lfs %5.1lf%%\n", w, gw.run_count,
+               gw.steal_count, gw.busy,
+               elapsed > 0.0 ? 100.0 * gw.busy / elapsed : 0.0);
+    }
+    return 0;
+}
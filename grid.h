@@ -0,0 +1,93 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+
+// Experiment grids.
+//
+// A grid spec lists netsim options, one per line, each followed by one or
+// more values; lines starting with '#' are comments.  The grid is every
+// combination of the values, e.g. 2 x 3 x 2 = 12 jobs for:
+//
+//   -topology torus hyperx
+//   -interval 4 8 16
+//   -seed 1 2
+//
+// Every job runs as its own in-process simulation on a pool of worker threads.
+// Jobs are ordered by an estimate of their work and dealt out to the workers,
+// each of which runs its own jobs largest first and then steals the largest
+// pending job of another worker, so that no long job is left for the end of
+// the run.  A job only starts once its estimated memory fits in the budget
+// left by the running ones; a job larger than the whole budget runs alone.
+// Results are appended to the output file as jobs finish, one tab-separated
+// line per job.
+//
+// With a cache directory, the result of each job is also stored there in a
+// file named after a hash of the job's normalized configuration and of the
+// netsim executable itself, and later grids reuse it instead of running the
+// job again.  Changing any option that affects the results, or rebuilding
+// netsim, gives a new key.  Jobs without -seed are random, so they always
+// run and are never cached.
+
+// Size of the network of a job, and its results.
+typedef struct GridResult {
+    // From a dry run.
+    long routers = 0;
+    long terminals = 0;
+    int radix = 0;
+    int vc_count = 0;
+    long input_buf_size = 0;
+    long packet_len = 0;
+    double mean_interval = 0.0;
+    long cycles = 0; // cycles to run, then cycles run
+    bool seeded = false; // reproducible, and so cacheable
+    std::string config; // normalized configuration, the cache key
+    // From the run.
+    long packets_generated = 0;
+    long packets_arrived = 0;
+    double latency = 0.0;    // cycles per packet
+    double hops = 0.0;       // per packet
+    double throughput = 0.0; // flits/cycle/node
+    double throughput_min = 0.0; // flits/cycle of the worst-served source
+    double fairness = 0.0;       // Jain's index of the source throughputs
+} GridResult;
+
+// Set up a simulation from a command line and run it, or with 'dry' set only
+// check the options and fill in the size of the network.
+typedef void (*GridRunFn)(int argc, char **argv, bool dry, GridResult *res);
+
+typedef struct GridJob {
+    long id;
+    std::vector<std::string> args; // options that vary across the grid
+    GridResult res;
+    double cost; // estimated work
+    long mem;    // estimated memory in bytes
+    std::string key; // hash of the configuration and the build, in hex, if
+                     // the job is cached
+} GridJob;
+
+typedef struct GridWorker {
+    std::mutex lock;
+    std::deque<GridJob *> jobs; // largest first
+    long run_count = 0;
+    long steal_count = 0;
+    double busy = 0.0; // seconds spent running jobs
+} GridWorker;
+
+typedef struct GridOptions {
+    const char *spec_path = NULL;
+    const char *out_path = NULL; // stdout if NULL
+    int threads = 0;             // 0: one per core
+    long mem_limit = 0;          // bytes, 0 for no limit
+    const char *cache_dir = NULL; // result cache, if any
+} GridOptions;
+
+void grid_parse(const char *path, std::vector<GridJob> *jobs);
+bool grid_file_hash(const char *path, uint64_t *h);
+int grid_run(const GridOptions *opts, int argc, char **argv, GridRunFn run);
+
+#endif
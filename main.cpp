@@ -1,27 +1,360 @@
 #include "sim.h"
 #include "router.h"
 #include "queue.h"
+#include "model.h"
+#include "grid.h"
+#include "mapping.h"
+#include <stdarg.h>
+#include <algorithm>
+#include <thread>
+#include <tuple>
 
-int main(int argc, char **argv) {
+// Parse a comma-separated list of positive numbers, e.g. "8,8,16".  Returns the
+// number of values, or -1 on error.
+static int parse_dims(const char *s, long *vals)
+{
+    int n = 0;
+    while (n < TOPO_MAXDIM) {
+        char *end;
+        vals[n] = strtol(s, &end, 10);
+        if (end == s || vals[n] <= 0)
+            return -1;
+        n++;
+        if (*end == '\0')
+            return n;
+        if (*end != ',')
+            return -1;
+        s = end + 1;
+    }
+    return -1;
+}
+
+static void strappendf(std::string *s, const char *fmt, ...)
+{
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    s->append(buf);
+}
+
+// Everything the results of a run depend on, in a fixed order and format, so
+// that equivalent command lines give the same string.  Options that only add
+// reports (tracing, recording, congestion detection) are left out.
+static std::string normalized_config(const TopoDesc *desc, int vc_count,
+                                     enum RoutingMode routing,
+                                     enum DeadlockMode deadlock,
+                                     long input_buf_size, long total_cycles,
+                                     double mean_interval, long seed,
+                                     int hotspot, double hotspot_frac,
+                                     const QosState *qos, long nic_msg_flits,
+                                     long nic_mtu, int nic_outstanding,
+                                     long nic_reasm_buf, bool cc,
+                                     enum CcPolicy cc_policy, double cc_rate,
+                                     int cc_window, double cc_ecn_thresh,
+                                     std::vector<FaultEvent> faults,
+                                     enum FaultPolicy fault_policy,
+                                     int threads, enum LayoutOrder layout,
+                                     const char *comm_path,
+                                     const char *map_path, bool map_opt,
+                                     enum MapCost map_cost, long map_iters,
+                                     int map_chains)
+{
+    std::string c;
+    strappendf(&c, "topology=%d conc=%d dims=", desc->type,
+               desc->concentration);
+    for (int d = 0; d < desc->r; d++) {
+        strappendf(&c, "%s%d/%ld/%d", d ? "," : "", desc->k[d], desc->delay[d],
+                   desc->mult[d]);
+    }
+    strappendf(&c, " vc=%d routing=%d deadlock=%d buf=%ld", vc_count, routing,
+               deadlock, input_buf_size);
+    strappendf(&c, " cycles=%ld interval=%.17g seed=%ld", total_cycles,
+               mean_interval, seed);
+    if (hotspot >= 0) {
+        strappendf(&c, " hotspot=%d/%.17g", hotspot, hotspot_frac);
+    }
+    if (qos) {
+        double total = 0.0;
+        for (int i = 0; i < qos->class_count; i++) {
+            total += qos->frac[i];
+        }
+        strappendf(&c, " qos=%d:", qos->arb);
+        for (int i = 0; i < qos->class_count; i++) {
+            strappendf(&c, "%s%.17g/%d", i ? "," : "", qos->frac[i] / total,
+                       qos->weight[i]);
+        }
+    }
+    if (nic_msg_flits > 0) {
+        strappendf(&c, " nic=%ld/%ld/%d/%ld", nic_msg_flits, nic_mtu,
+                   nic_outstanding, nic_reasm_buf);
+    }
+    if (cc) {
+        strappendf(&c, " cc=%d/%.17g/%d/%.17g", cc_policy, cc_rate, cc_window,
+                   cc_ecn_thresh);
+    }
+    if (!faults.empty()) {
+        std::sort(faults.begin(), faults.end(),
+                  [](const FaultEvent &a, const FaultEvent &b) {
+                      return std::tie(a.time, a.type, a.router, a.port) <
+                             std::tie(b.time, b.type, b.router, b.port);
+                  });
+        strappendf(&c, " faults=%d:", fault_policy);
+        for (size_t i = 0; i < faults.size(); i++) {
+            strappendf(&c, "%s%d/%d/%d@%ld", i ? "," : "", faults[i].type,
+                       faults[i].router, faults[i].port, faults[i].time);
+        }
+    }
+    if (threads > 1) {
+        // Partitions follow the layout.
+        strappendf(&c, " threads=%d/%d", threads, layout);
+    }
+    if (comm_path) {
+        // By contents, so that editing a file gives a new key.  Unreadable
+        // files fail the run anyway.
+        uint64_t comm_hash = 0, map_hash = 0;
+        grid_file_hash(comm_path, &comm_hash);
+        if (map_path) {
+            grid_file_hash(map_path, &map_hash);
+        }
+        strappendf(&c, " comm=%016llx map=%016llx",
+                   static_cast<unsigned long long>(comm_hash),
+                   static_cast<unsigned long long>(map_hash));
+        if (map_opt) {
+            strappendf(&c, " mapopt=%d/%ld/%d", map_cost, map_iters,
+                       map_chains);
+        }
+    }
+    return c;
+}
+
+// Set up and run a simulation from a command line.  For a job of an
+// experiment grid ('res' is not NULL), the progress and the report are left
+// out and the results are returned in 'res'; with 'dry' set, the options are
+// only checked and the size of the network is returned.
+static void run_sim(int argc, char **argv, bool dry, GridResult *res)
+{
     int debug = 0;
+    long snapshot_interval = 1000;
+    long flight_len = FLIGHT_DEFAULT_LEN;
     bool verbose = false;
     double mean_interval = 0.0;
     long total_cycles = 10000;
+    long seed = -1;
     // Default is 4-ary 2-torus.
-    int k = 4, r = 2;
+    int r = -1;
+    long ks[TOPO_MAXDIM], delays[TOPO_MAXDIM], mults[TOPO_MAXDIM];
+    int k_count = 1, delay_count = 1, mult_count = 1;
+    ks[0] = 4;
+    delays[0] = DEFAULT_CHANNEL_DELAY;
+    mults[0] = 1;
+    enum TopoType topo_type = TOP_TORUS;
+    int concentration = 1;
+    enum RoutingMode routing = ROUTING_DOR;
+    enum DeadlockMode deadlock = DEADLOCK_DATELINE;
+    enum LayoutOrder layout = LAYOUT_ID;
+    bool huge_pages = false;
+    int threads = 1;
+    long input_buf_size = 10;
+    QosState *qos = NULL;
+    long nic_msg_flits = 0;
+    long nic_mtu = DEFAULT_PACKET_LEN;
+    int nic_outstanding = 0;
+    long nic_reasm_buf = 0;
+    bool cc = false;
+    enum CcPolicy cc_policy = CC_RATE;
+    double cc_rate = 0.0;
+    int cc_window = 8;
+    double cc_ecn_thresh = 0.5;
+    enum QosArb qos_arb = QOS_STRICT;
     int terminal_count;
     int router_count;
     int radix;
     int vc_count = -1;
+    bool model = false;
+    int model_sweep_points = 0;
+    const char *record_path = NULL;
+    bool trace = false;
+    long trace_every = 0;
+    int trace_src = -1, trace_dst = -1;
+    long trace_print = 10;
+    long congestion_period = 0;
+    int hotspot = -1;
+    double hotspot_frac = 0.0;
+    std::vector<FaultEvent> fault_events;
+    enum FaultPolicy fault_policy = FAULT_DROP;
+    const char *comm_path = NULL;
+    const char *map_path = NULL;
+    const char *map_out = NULL;
+    bool map_opt = false;
+    enum MapCost map_cost = MAP_HOPS;
+    long map_iters = 0;
+    int map_chains =
+        std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
 
     for (int i = 0; i < argc; i++) {
         if (!strcmp(argv[i], "-d")) {
             debug = 1;
+        } else if (!strcmp(argv[i], "-snapshot")) {
+            // Cycles between debugger snapshots; 0 disables them.
+            i++;
+            snapshot_interval = std::stol(std::string(argv[i]));
+            if (snapshot_interval < 0) {
+                fatal("invalid snapshot interval: %s\n", argv[i]);
+            }
+        } else if (!strcmp(argv[i], "-flight")) {
+            // Events kept per node for a crash dump; 0 keeps none.
+            i++;
+            flight_len = std::stol(std::string(argv[i]));
+            if (flight_len < 0) {
+                fatal("invalid flight recorder length: %s\n", argv[i]);
+            }
         } else if (!strcmp(argv[i], "-v")) {
             verbose = true;
         } else if (!strcmp(argv[i], "-k")) {
+            // Ring length, or one per dimension: -k 8,8,16.
+            i++;
+            k_count = parse_dims(argv[i], ks);
+            if (k_count < 0) {
+                fatal("invalid ring lengths: %s\n", argv[i]);
+            }
+        } else if (!strcmp(argv[i], "-link-delay")) {
+            // Link latency, or one per dimension: -link-delay 1,1,2.
+            i++;
+            delay_count = parse_dims(argv[i], delays);
+            if (delay_count < 0) {
+                fatal("invalid link delays: %s\n", argv[i]);
+            }
+        } else if (!strcmp(argv[i], "-topology")) {
+            i++;
+            if (!strcmp(argv[i], "torus")) {
+                topo_type = TOP_TORUS;
+            } else if (!strcmp(argv[i], "hyperx")) {
+                topo_type = TOP_HYPERX;
+            } else if (!strcmp(argv[i], "flatfly")) {
+                topo_type = TOP_FLATFLY;
+            } else {
+                fatal("invalid topology: %s\n", argv[i]);
+            }
+        } else if (!strcmp(argv[i], "-mult")) {
+            // HyperX links between each router pair, or one per dimension.
+            i++;
+            mult_count = parse_dims(argv[i], mults);
+            if (mult_count < 0) {
+                fatal("invalid link multiplicity: %s\n", argv[i]);
+            }
+        } else if (!strcmp(argv[i], "-conc")) {
+            // HyperX terminals per router.
+            i++;
+            concentration = std::stoi(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-routing")) {
+            i++;
+            if (!strcmp(argv[i], "dor")) {
+                routing = ROUTING_DOR;
+            } else if (!strcmp(argv[i], "adaptive")) {
+                routing = ROUTING_ADAPTIVE;
+            } else {
+                fatal("invalid routing: %s\n", argv[i]);
+            }
+        } else if (!strcmp(argv[i], "-deadlock")) {
+            // Torus deadlock avoidance.
+            i++;
+            if (!strcmp(argv[i], "dateline")) {
+                deadlock = DEADLOCK_DATELINE;
+            } else if (!strcmp(argv[i], "bubble")) {
+                deadlock = DEADLOCK_BUBBLE;
+            } else {
+                fatal("invalid deadlock avoidance: %s\n", argv[i]);
+            }
+        } else if (!strcmp(argv[i], "-layout")) {
+            // Memory layout of the routers and channels.
+            i++;
+            if (!strcmp(argv[i], "id")) {
+                layout = LAYOUT_ID;
+            } else if (!strcmp(argv[i], "morton")) {
+                layout = LAYOUT_MORTON;
+            } else if (!strcmp(argv[i], "hilbert")) {
+                layout = LAYOUT_HILBERT;
+            } else {
+                fatal("invalid layout: %s\n", argv[i]);
+            }
+        } else if (!strcmp(argv[i], "-hugepages")) {
+            // Back the simulation state with huge pages.
+            huge_pages = true;
+        } else if (!strcmp(argv[i], "-threads")) {
+            // Partitions of the parallel engine.
+            i++;
+            threads = std::stoi(std::string(argv[i]));
+            if (threads < 1) {
+                fatal("invalid thread count: %s\n", argv[i]);
+            }
+        } else if (!strcmp(argv[i], "-buf")) {
+            // Input buffer size of each VC in flits.
             i++;
-            k = std::stoi(std::string(argv[i]));
+            input_buf_size = std::stol(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-qos-class")) {
+            // Traffic class: FRAC[:WEIGHT], highest priority first.
+            i++;
+            double frac;
+            int weight;
+            if (qos_parse_class(argv[i], &frac, &weight) != 0) {
+                fatal("invalid traffic class: %s\n", argv[i]);
+            }
+            if (!qos) {
+                qos = qos_create(qos_arb);
+            }
+            qos_add_class(qos, frac, weight);
+        } else if (!strcmp(argv[i], "-qos-arb")) {
+            i++;
+            if (!strcmp(argv[i], "strict")) {
+                qos_arb = QOS_STRICT;
+            } else if (!strcmp(argv[i], "weighted")) {
+                qos_arb = QOS_WEIGHTED;
+            } else {
+                fatal("invalid traffic class arbitration: %s\n", argv[i]);
+            }
+            if (qos) {
+                qos->arb = qos_arb;
+            }
+        } else if (!strcmp(argv[i], "-msg")) {
+            // Message size in flits; enables the NIC model.
+            i++;
+            nic_msg_flits = std::stol(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-mtu")) {
+            i++;
+            nic_mtu = std::stol(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-nic-outstanding")) {
+            i++;
+            nic_outstanding = std::stoi(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-nic-reasm-buf")) {
+            i++;
+            nic_reasm_buf = std::stol(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-cc")) {
+            // Injection control policy.
+            i++;
+            cc = true;
+            if (!strcmp(argv[i], "rate")) {
+                cc_policy = CC_RATE;
+            } else if (!strcmp(argv[i], "window")) {
+                cc_policy = CC_WINDOW;
+            } else if (!strcmp(argv[i], "ecn")) {
+                cc_policy = CC_ECN;
+            } else {
+                fatal("invalid injection control: %s\n", argv[i]);
+            }
+        } else if (!strcmp(argv[i], "-cc-rate")) {
+            // Flits per cycle per source.
+            i++;
+            cc_rate = std::stod(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-cc-window")) {
+            // Packets in flight per source.
+            i++;
+            cc_window = std::stoi(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-cc-ecn-thresh")) {
+            // Input port buffer fill that marks packets.
+            i++;
+            cc_ecn_thresh = std::stod(std::string(argv[i]));
         } else if (!strcmp(argv[i], "-r")) {
             i++;
             r = std::stoi(std::string(argv[i]));
@@ -35,24 +368,325 @@ int main(int argc, char **argv) {
         } else if (!strcmp(argv[i], "-interval")) {
             i++;
             mean_interval = std::stod(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-seed")) {
+            // Seed of the traffic generator, for reproducible runs.
+            i++;
+            seed = std::stol(std::string(argv[i]));
+            if (seed < 0) {
+                fatal("invalid seed: %ld\n", seed);
+            }
+        } else if (!strcmp(argv[i], "-model")) {
+            // Analytic estimate only; does not run the simulation.
+            model = true;
+        } else if (!strcmp(argv[i], "-model-sweep")) {
+            i++;
+            model = true;
+            model_sweep_points = std::stoi(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-record")) {
+            // Columnar per-packet records; see record.h for the format.
+            i++;
+            record_path = argv[i];
+        } else if (!strcmp(argv[i], "-trace")) {
+            // Trace one in N packets; 0 traces every packet that matches
+            // -trace-src and -trace-dst.
+            i++;
+            trace = true;
+            trace_every = std::stol(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-trace-src")) {
+            i++;
+            trace = true;
+            trace_src = std::stoi(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-trace-dst")) {
+            i++;
+            trace = true;
+            trace_dst = std::stoi(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-trace-print")) {
+            i++;
+            trace_print = std::stol(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-congestion")) {
+            // Congestion tree detection period in cycles.
+            i++;
+            congestion_period = std::stol(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-comm")) {
+            // Communication matrix of the ranks; see mapping.h.
+            i++;
+            comm_path = argv[i];
+        } else if (!strcmp(argv[i], "-map")) {
+            // Terminal of each rank, one per line.
+            i++;
+            map_path = argv[i];
+        } else if (!strcmp(argv[i], "-map-opt")) {
+            // Optimize the placement of the ranks before running.
+            i++;
+            map_opt = true;
+            if (!strcmp(argv[i], "hops")) {
+                map_cost = MAP_HOPS;
+            } else if (!strcmp(argv[i], "load")) {
+                map_cost = MAP_LOAD;
+            } else {
+                fatal("invalid mapping cost: %s\n", argv[i]);
+            }
+        } else if (!strcmp(argv[i], "-map-iters")) {
+            // Annealing steps per chain.
+            i++;
+            map_iters = std::stol(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-map-chains")) {
+            i++;
+            map_chains = std::stoi(std::string(argv[i]));
+            if (map_chains < 1) {
+                fatal("invalid chain count: %s\n", argv[i]);
+            }
+        } else if (!strcmp(argv[i], "-map-out")) {
+            // Write the placement used.
+            i++;
+            map_out = argv[i];
+        } else if (!strcmp(argv[i], "-hotspot")) {
+            i++;
+            hotspot = std::stoi(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-hotspot-frac")) {
+            i++;
+            hotspot_frac = std::stod(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-fault-link") ||
+                   !strcmp(argv[i], "-fault-router")) {
+            // Link: ROUTER:PORT[@CYCLE], router: ROUTER[@CYCLE].
+            enum FaultType type =
+                !strcmp(argv[i], "-fault-link") ? FAULT_LINK : FAULT_ROUTER;
+            i++;
+            FaultEvent ev;
+            if (fault_parse(argv[i], type, &ev) != 0) {
+                fatal("invalid fault: %s\n", argv[i]);
+            }
+            fault_events.push_back(ev);
+        } else if (!strcmp(argv[i], "-fault-policy")) {
+            i++;
+            if (!strcmp(argv[i], "drop")) {
+                fault_policy = FAULT_DROP;
+            } else if (!strcmp(argv[i], "retry")) {
+                fault_policy = FAULT_RETRY;
+            } else {
+                fatal("invalid fault policy: %s\n", argv[i]);
+            }
         }
     }
 
-    router_count = 1;
-    for (int i = 0; i < r; i++) {
-        router_count *= k;
+    // A list of ring lengths sets the dimension; a single one is used for all
+    // dimensions.  A k-ary n-flat has n-1 dimensions, given by '-r n'.
+    if (r == -1) {
+        r = (k_count > 1) ? k_count : 2;
+    }
+    if (topo_type == TOP_FLATFLY) {
+        if (k_count > 1) {
+            fatal("flattened butterfly takes a single -k\n");
+        }
+        r--;
+    }
+    if (r <= 0 || r > TOPO_MAXDIM) {
+        fatal("invalid dimension: %d\n", r);
     }
-    terminal_count = router_count;
-    // 1: terminal node, 2: bidirectional in each ring
-    radix = 1 + 2 * r;
+    if ((k_count > 1 && k_count != r) || (delay_count > 1 && delay_count != r) ||
+        (mult_count > 1 && mult_count != r)) {
+        fatal("expected %d ring lengths, link delays and multiplicities\n", r);
+    }
+    int k[TOPO_MAXDIM], mult[TOPO_MAXDIM];
+    long delay[TOPO_MAXDIM];
+    for (int d = 0; d < r; d++) {
+        k[d] = static_cast<int>(ks[k_count > 1 ? d : 0]);
+        delay[d] = delays[delay_count > 1 ? d : 0];
+        mult[d] = static_cast<int>(mults[mult_count > 1 ? d : 0]);
+    }
+    if (concentration <= 0) {
+        fatal("invalid concentration: %d\n", concentration);
+    }
+    TopoDesc desc;
+    if (topo_type == TOP_HYPERX) {
+        desc = topo_desc_hyperx(r, k, mult, concentration, delay);
+    } else if (topo_type == TOP_FLATFLY) {
+        desc = topo_desc_flatfly(k[0], r + 1, delay);
+    } else {
+        desc = topo_desc_torus(r, k, delay);
+    }
+    if (routing == ROUTING_ADAPTIVE && !topo_is_hyperx(&desc)) {
+        fatal("adaptive routing needs a HyperX or flattened butterfly\n");
+    }
+
+    router_count = static_cast<int>(topo_router_count(&desc));
+    terminal_count = static_cast<int>(topo_terminal_count(&desc));
+    radix = topo_radix(&desc);
     if (vc_count == -1) {
         // 2 VCs in each dimension
         vc_count = 2 * r;
+        if (!fault_events.empty()) {
+            // Detours take a second set of VC classes: round up to a
+            // multiple of two of them.
+            int classes = 2 * (deadlock == DEADLOCK_BUBBLE ? 1 : 2);
+            vc_count = (vc_count + classes - 1) / classes * classes;
+        }
     } // else, overrided
+    if (deadlock == DEADLOCK_BUBBLE && desc.type != TOP_TORUS) {
+        fatal("bubble flow control needs a torus\n");
+    }
+    if (input_buf_size < (deadlock == DEADLOCK_BUBBLE ? 2 : 1) *
+                             DEFAULT_PACKET_LEN) {
+        fatal("input buffers too small: %ld flits\n", input_buf_size);
+    }
+    if (routing == ROUTING_ADAPTIVE && vc_count % r != 0) {
+        fatal("adaptive routing needs a multiple of %d VCs (have %d)\n", r,
+              vc_count);
+    }
+    if (comm_path && hotspot >= 0) {
+        fatal("-comm and -hotspot cannot be used together\n");
+    }
+    if (!comm_path && (map_path || map_opt || map_out)) {
+        fatal("a placement needs a communication matrix (-comm)\n");
+    }
+    if (comm_path && model) {
+        fatal("the analytic model only covers uniform traffic\n");
+    }
 
-    Topology top = topology_torus(k, r);
+    // Packets are cut to the MTU of the NIC, if any.
+    long packet_len = nic_msg_flits > 0 ? nic_mtu : DEFAULT_PACKET_LEN;
 
-    Sim sim{verbose, debug, top, terminal_count, router_count, radix, vc_count, mean_interval, 10};
+    if (res) {
+        if (debug || model) {
+            fatal("-d and -model cannot be used in a grid\n");
+        }
+        res->routers = router_count;
+        res->terminals = terminal_count;
+        res->radix = radix;
+        res->vc_count = vc_count;
+        res->input_buf_size = input_buf_size;
+        res->packet_len = packet_len;
+        res->cycles = total_cycles;
+        res->seeded = seed >= 0;
+        res->mean_interval = mean_interval;
+        res->config = normalized_config(
+            &desc, vc_count, routing, deadlock, input_buf_size, total_cycles,
+            mean_interval, seed, hotspot, hotspot_frac, qos, nic_msg_flits,
+            nic_mtu, nic_outstanding, nic_reasm_buf, cc, cc_policy, cc_rate,
+            cc_window, cc_ecn_thresh, fault_events, fault_policy, threads,
+            layout, comm_path, map_path, map_opt, map_cost, map_iters,
+            map_chains);
+        if (dry) {
+            if (qos) {
+                qos_destroy(qos);
+            }
+            return;
+        }
+    }
+
+    if (model) {
+        if (desc.type != TOP_TORUS) {
+            fatal("the analytic model only supports tori\n");
+        }
+        // The same parameters the simulation would be built with.
+        ModelParams mp = {desc, vc_count, packet_len, DEFAULT_CHANNEL_DELAY,
+                          ROUTER_PIPELINE_DEPTH, mean_interval};
+        if (model_sweep_points > 0) {
+            model_sweep(&mp, model_sweep_points);
+        } else {
+            model_report(&mp);
+        }
+        return;
+    }
+
+    Topology top = topology_build(&desc);
+    if (layout != LAYOUT_ID && !topology_layout(&top, layout)) {
+        fatal("layout: too many routers to order along a curve\n");
+    }
+
+    TrafficDesc traffic_desc{terminal_count};
+    if (hotspot >= 0) {
+        traffic_desc.type = TRF_HOTSPOT;
+        traffic_desc.hotspot = hotspot;
+        traffic_desc.hotspot_frac = hotspot_frac;
+    }
+    if (comm_path) {
+        CommMatrix cm;
+        if (comm_load(comm_path, &cm) != 0) {
+            fatal("cannot read communication matrix: %s\n", comm_path);
+        }
+        if (cm.rank_count > terminal_count) {
+            fatal("%d ranks do not fit on %d terminals\n", cm.rank_count,
+                  terminal_count);
+        }
+        std::vector<int> place(cm.rank_count);
+        for (int i = 0; i < cm.rank_count; i++) {
+            place[i] = i;
+        }
+        if (map_path) {
+            if (map_load(map_path, terminal_count, &place) != 0 ||
+                static_cast<int>(place.size()) != cm.rank_count) {
+                fatal("invalid placement of %d ranks: %s\n", cm.rank_count,
+                      map_path);
+            }
+        }
+        std::vector<int> initial = place;
+        if (map_opt) {
+            if (map_iters <= 0) {
+                map_iters = 1000L * terminal_count;
+            }
+            place = map_optimize(&top, &cm, place, map_cost, map_iters,
+                                 map_chains,
+                                 seed >= 0 ? seed : std::random_device{}());
+        }
+        if (!res) {
+            map_report(&top, &cm, initial, place);
+        }
+        if (map_out && map_save(map_out, place) != 0) {
+            fatal("cannot write placement: %s\n", map_out);
+        }
+        map_traffic(&traffic_desc, &cm, place, mean_interval, packet_len);
+    }
+
+    Sim sim{verbose, debug, top, traffic_desc, terminal_count, router_count,
+            radix, vc_count, mean_interval, input_buf_size, huge_pages};
+    sim.progress = !res;
+    if (seed >= 0) {
+        sim_seed(&sim, seed);
+    }
+    if (routing == ROUTING_ADAPTIVE) {
+        // One VC class per hop.
+        sim.config.routing = ROUTING_ADAPTIVE;
+        sim.config.vc_class_count = r;
+    }
+    if (deadlock == DEADLOCK_BUBBLE) {
+        // All VCs in one class.
+        sim.config.deadlock = DEADLOCK_BUBBLE;
+        sim.config.vc_class_count = 1;
+    }
+    if (record_path) {
+        sim.recorder = recorder_create(record_path);
+    }
+    if (trace) {
+        sim.tracer = tracer_create(trace_every, trace_src, trace_dst,
+                                   trace_print, sim.channel_delay);
+    }
+    if (congestion_period > 0) {
+        sim.congestion = congestion_create(congestion_period, router_count);
+    }
+    if (!fault_events.empty()) {
+        FaultState *fs = fault_create(fault_policy, router_count, radix,
+                                      terminal_count);
+        for (auto &ev : fault_events) {
+            fault_add(fs, ev);
+        }
+        fault_attach(&sim, fs);
+    }
+    if (nic_msg_flits > 0) {
+        nic_attach(&sim, nic_create(nic_msg_flits, nic_mtu, nic_outstanding,
+                                    nic_reasm_buf, terminal_count));
+    }
+    if (cc) {
+        sim.cc = cc_create(cc_policy, cc_rate, cc_window, cc_ecn_thresh,
+                           sim.config.packet_len, terminal_count);
+    }
+    if (qos) {
+        // After the VC classes for deadlock avoidance are settled.
+        qos_attach(&sim, qos);
+    }
+    if (flight_len > 0) {
+        flight_attach(&sim, flight_create(flight_len));
+    }
     // schedule(&sim.eventq, 0, tick_event_from_id(src_id(0)));
     // schedule(&sim.eventq, 0, tick_event_from_id(src_id(1)));
     // schedule(&sim.eventq, 0, tick_event_from_id(src_id(2)));
@@ -62,16 +696,89 @@ int main(int argc, char **argv) {
     // schedule(&sim.eventq, 0, tick_event_from_id(src_id(19)));
     // schedule(&sim.eventq, 0, tick_event_from_id(src_id(20)));
 
+    if (threads > 1) {
+        // After every module is attached.
+        sim.par = par_create(&sim, threads);
+    }
     for (int i = 0; i < terminal_count; i++) {
-        schedule(&sim.eventq, 0, tick_event_from_id(src_id(i)));
+        // Terminals without ranks, or whose ranks only receive, stay idle.
+        if (traffic_desc.type == TRF_MATRIX &&
+            traffic_desc.comm_begin[i] == traffic_desc.comm_begin[i + 1]) {
+            continue;
+        }
+        schedule(&sim.eventq, 0, tick_event(sim.src_nodes[i].get()));
+    }
+    if (debug && snapshot_interval > 0) {
+        sim.snapshots = snapshot_create(snapshot_interval);
     }
 
     sim_run(&sim, total_cycles);
 
-    sim_report(&sim);
+    if (res) {
+        long cycles = curr_time(&sim.eventq);
+        long flits = 0;
+        for (auto &dst : sim.dst_nodes) {
+            flits += dst->flit_arrive_count;
+        }
+        res->cycles = cycles;
+        res->packets_generated = sim.stat.packet_gen_count;
+        res->packets_arrived = sim.stat.packet_arrive_count;
+        res->latency = sim.stat.packet_arrive_count > 0
+                           ? static_cast<double>(sim.stat.latency_sum) /
+                                 sim.stat.packet_arrive_count
+                           : 0.0;
+        res->hops = sim.stat.packet_gen_count > 0
+                        ? static_cast<double>(sim.stat.hop_count_sum) /
+                              sim.stat.packet_gen_count
+                        : 0.0;
+        res->throughput =
+            cycles > 0 ? static_cast<double>(flits) / cycles / terminal_count
+                       : 0.0;
+        Fairness fair = sim_fairness(&sim);
+        res->throughput_min = fair.min;
+        res->fairness = fair.jain;
+    } else {
+        sim_report(&sim);
+    }
 
     sim_destroy(&sim);
     topology_destroy(&top);
+}
+
+int main(int argc, char **argv)
+{
+    // An experiment grid runs every job through run_sim(); the other options
+    // on the command line apply to all of its jobs.
+    GridOptions go;
+    std::vector<char *> base_args;
+    for (int i = 0; i < argc; i++) {
+        if (!strcmp(argv[i], "-grid")) {
+            i++;
+            go.spec_path = argv[i];
+        } else if (!strcmp(argv[i], "-grid-out")) {
+            i++;
+            go.out_path = argv[i];
+        } else if (!strcmp(argv[i], "-grid-jobs")) {
+            // Worker threads; one per core by default.
+            i++;
+            go.threads = std::stoi(std::string(argv[i]));
+        } else if (!strcmp(argv[i], "-grid-cache")) {
+            // Directory of cached job results.
+            i++;
+            go.cache_dir = argv[i];
+        } else if (!strcmp(argv[i], "-grid-mem")) {
+            // Memory budget of the running jobs in MiB.
+            i++;
+            go.mem_limit = std::stol(std::string(argv[i])) << 20;
+        } else {
+            base_args.push_back(argv[i]);
+        }
+    }
+    if (go.spec_path) {
+        return grid_run(&go, static_cast<int>(base_args.size()),
+                        base_args.data(), run_sim);
+    }
 
+    run_sim(argc, argv, false, NULL);
     return 0;
 }
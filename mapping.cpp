@@ -0,0 +1,471 @@
+#include "mapping.h"
+#include "record.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <map>
+#include <random>
+#include <thread>
+#include <utility>
+
+// Read the src and dst columns of a packet record file, positioned after the
+// magic, and count the packets of each pair.
+static int comm_load_records(FILE *f, std::map<std::pair<int, int>, double> *w)
+{
+    uint32_t hdr[2];
+    if (fread(hdr, sizeof(uint32_t), 2, f) != 2 || hdr[0] != RECORD_VERSION)
+        return -1;
+    std::vector<uint32_t> sizes(hdr[1]);
+    int src_col = -1, dst_col = -1;
+    for (uint32_t i = 0; i < hdr[1]; i++) {
+        char name[17] = {0};
+        if (fread(name, 1, 16, f) != 16 || fread(&sizes[i], 4, 1, f) != 1)
+            return -1;
+        if (!strcmp(name, "src") && sizes[i] == sizeof(int32_t))
+            src_col = static_cast<int>(i);
+        if (!strcmp(name, "dst") && sizes[i] == sizeof(int32_t))
+            dst_col = static_cast<int>(i);
+    }
+    if (src_col < 0 || dst_col < 0)
+        return -1;
+
+    uint32_t n;
+    std::vector<int32_t> src, dst;
+    while (fread(&n, sizeof(n), 1, f) == 1) {
+        src.resize(n);
+        dst.resize(n);
+        for (uint32_t i = 0; i < hdr[1]; i++) {
+            if (static_cast<int>(i) == src_col || static_cast<int>(i) == dst_col) {
+                int32_t *p = (static_cast<int>(i) == src_col) ? src.data()
+                                                              : dst.data();
+                if (fread(p, sizeof(int32_t), n, f) != n)
+                    return -1;
+            } else if (fseek(f, static_cast<long>(n) * sizes[i], SEEK_CUR)) {
+                return -1;
+            }
+        }
+        for (uint32_t i = 0; i < n; i++)
+            (*w)[{src[i], dst[i]}] += 1.0;
+    }
+    return 0;
+}
+
+// Read a communication matrix.  Returns 0 on success, -1 if the file cannot
+// be read or is malformed.
+int comm_load(const char *path, CommMatrix *cm)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return -1;
+
+    std::map<std::pair<int, int>, double> w;
+    char magic[8];
+    int ret = 0;
+    if (fread(magic, 1, 8, f) == 8 && !memcmp(magic, "NSPKTREC", 8)) {
+        ret = comm_load_records(f, &w);
+    } else {
+        rewind(f);
+        char line[256];
+        while (ret == 0 && fgets(line, sizeof(line), f)) {
+            char *hash = strchr(line, '#');
+            if (hash)
+                *hash = '\0';
+            int src, dst;
+            double weight;
+            char extra;
+            int n = sscanf(line, "%d %d %lf %c", &src, &dst, &weight, &extra);
+            if (n == EOF)
+                continue;
+            if (n != 3 || src < 0 || dst < 0 || weight < 0.0)
+                ret = -1;
+            else
+                w[{src, dst}] += weight;
+        }
+    }
+    fclose(f);
+    if (ret != 0)
+        return -1;
+
+    cm->rank_count = 0;
+    cm->entries.clear();
+    for (auto &kv : w) {
+        int src = kv.first.first, dst = kv.first.second;
+        if (src < 0 || dst < 0)
+            return -1;
+        cm->rank_count = std::max(cm->rank_count, std::max(src, dst) + 1);
+        if (src != dst && kv.second > 0.0)
+            cm->entries.push_back({src, dst, kv.second});
+    }
+    return 0;
+}
+
+// Read a placement, the terminal of each rank on its own line.  Returns 0 on
+// success, -1 if the file cannot be read or is not a placement.
+int map_load(const char *path, int terminal_count, std::vector<int> *place)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    std::vector<bool> used(terminal_count, false);
+    place->clear();
+    int t, ret = 0;
+    while (fscanf(f, "%d", &t) == 1) {
+        if (t < 0 || t >= terminal_count || used[t]) {
+            ret = -1;
+            break;
+        }
+        used[t] = true;
+        place->push_back(t);
+    }
+    if (ret == 0 && !feof(f))
+        ret = -1;
+    fclose(f);
+    return ret;
+}
+
+int map_save(const char *path, const std::vector<int> &place)
+{
+    FILE *f = fopen(path, "w");
+    if (!f)
+        return -1;
+    for (int t : place)
+        fprintf(f, "%d\n", t);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+// Inter-router hops of a minimal route between terminals 'a' and 'b'.
+static int map_distance(const Topology *top, int a, int b)
+{
+    int conc = top->desc.concentration;
+    return topo_distance(top, a / conc, b / conc);
+}
+
+// Add 'w' to the channels of 'steps' hops from router 'cur' along ring 'd'.
+static int ring_add(const Topology *top, int cur, int d, int to_larger,
+                    int steps, double w, double *load)
+{
+    const TopoDesc *td = &top->desc;
+    int port = get_output_port(d, to_larger);
+    for (int i = 0; i < steps; i++) {
+        load[cur * top->radix + port] += w;
+        int c = topo_coord(top, cur, d);
+        int next = to_larger ? (c + 1) % td->k[d] : (c + td->k[d] - 1) % td->k[d];
+        cur += (next - c) * td->stride[d];
+    }
+    return cur;
+}
+
+// Add 'w' to the load of the router channels on the dimension-order route
+// from terminal 'src' to 'dst'.  Loads are by router * radix + output port.
+static void route_add(const Topology *top, int src, int dst, double w,
+                      double *load)
+{
+    const TopoDesc *td = &top->desc;
+    int cur = src / td->concentration, to = dst / td->concentration;
+    for (int d = 0; d < td->r; d++) {
+        int a = topo_coord(top, cur, d), b = topo_coord(top, to, d);
+        if (a == b)
+            continue;
+        if (topo_is_hyperx(td)) {
+            int port = hyperx_port(td, a, d, b, (src + dst) % td->mult[d]);
+            load[cur * top->radix + port] += w;
+            cur += (b - a) * td->stride[d];
+            continue;
+        }
+        int k = td->k[d];
+        int cw = (b - a + k) % k;
+        if (k % 2 == 0 && cw == k / 2) {
+            ring_add(top, cur, d, 0, cw, w / 2, load);
+            cur = ring_add(top, cur, d, 1, cw, w / 2, load);
+        } else if (cw <= k / 2) {
+            cur = ring_add(top, cur, d, 1, cw, w, load);
+        } else {
+            cur = ring_add(top, cur, d, 0, k - cw, w, load);
+        }
+    }
+}
+
+double map_hops(const Topology *top, const CommMatrix *cm,
+                const std::vector<int> &place)
+{
+    double sum = 0.0;
+    for (const CommEntry &e : cm->entries)
+        sum += e.weight * map_distance(top, place[e.src], place[e.dst]);
+    return sum;
+}
+
+static std::vector<double> map_loads(const Topology *top, const CommMatrix *cm,
+                                     const std::vector<int> &place)
+{
+    std::vector<double> load(top->router_count * top->radix, 0.0);
+    for (const CommEntry &e : cm->entries)
+        route_add(top, place[e.src], place[e.dst], e.weight, load.data());
+    return load;
+}
+
+double map_max_load(const Topology *top, const CommMatrix *cm,
+                    const std::vector<int> &place)
+{
+    std::vector<double> load = map_loads(top, cm, place);
+    return *std::max_element(load.begin(), load.end());
+}
+
+// Objective of the annealing: lower is better.
+static double map_objective(const Topology *top, const CommMatrix *cm,
+                            const std::vector<int> &place, enum MapCost cost)
+{
+    if (cost == MAP_HOPS)
+        return map_hops(top, cm, place);
+    std::vector<double> load = map_loads(top, cm, place);
+    double sum = 0.0, max = 0.0;
+    for (double l : load) {
+        sum += l;
+        max = std::max(max, l);
+    }
+    return max + sum / load.size();
+}
+
+// One annealing chain.
+typedef struct MapChain {
+    const Topology *top;
+    const CommMatrix *cm;
+    enum MapCost cost;
+    const std::vector<std::vector<int>> *edges; // entries of each rank
+    std::vector<int> place;    // terminal of each rank
+    std::vector<int> rank_at;  // rank on each terminal, or -1
+    std::vector<double> load;  // MAP_LOAD only
+    std::vector<int> affected; // entries moved by the current swap
+    double value;              // objective of 'place'
+} MapChain;
+
+static double chain_load_value(const MapChain *c)
+{
+    double sum = 0.0, max = 0.0;
+    for (double l : c->load) {
+        sum += l;
+        max = std::max(max, l);
+    }
+    return max + sum / c->load.size();
+}
+
+// Contribution of the affected entries to the objective, or for the load,
+// add them to it with 'sign'.
+static double chain_affected(MapChain *c, double sign)
+{
+    double sum = 0.0;
+    for (int i : c->affected) {
+        const CommEntry &e = c->cm->entries[i];
+        int src = c->place[e.src], dst = c->place[e.dst];
+        if (c->cost == MAP_HOPS)
+            sum += e.weight * map_distance(c->top, src, dst);
+        else
+            route_add(c->top, src, dst, sign * e.weight, c->load.data());
+    }
+    return sum;
+}
+
+static void chain_swap(MapChain *c, int t1, int t2)
+{
+    int a = c->rank_at[t1], b = c->rank_at[t2];
+    std::swap(c->rank_at[t1], c->rank_at[t2]);
+    if (a >= 0)
+        c->place[a] = t2;
+    if (b >= 0)
+        c->place[b] = t1;
+}
+
+// Swap the ranks on terminals 't1' and 't2', and return the new objective.
+static double chain_move(MapChain *c, int t1, int t2)
+{
+    int a = c->rank_at[t1], b = c->rank_at[t2];
+    c->affected.clear();
+    if (a >= 0)
+        c->affected = (*c->edges)[a];
+    if (b >= 0) {
+        for (int i : (*c->edges)[b]) {
+            const CommEntry &e = c->cm->entries[i];
+            if (e.src != a && e.dst != a)
+                c->affected.push_back(i);
+        }
+    }
+    double before = chain_affected(c, -1.0);
+    chain_swap(c, t1, t2);
+    double after = chain_affected(c, 1.0);
+    if (c->cost == MAP_HOPS)
+        return c->value + after - before;
+    return chain_load_value(c);
+}
+
+// Undo the last chain_move(t1, t2).
+static void chain_undo(MapChain *c, int t1, int t2)
+{
+    chain_affected(c, -1.0);
+    chain_swap(c, t1, t2);
+    chain_affected(c, 1.0);
+}
+
+static void chain_run(MapChain *c, long iters, uint64_t seed, int chain,
+                      std::vector<int> *best)
+{
+    std::seed_seq seq{seed, static_cast<uint64_t>(chain)};
+    std::mt19937_64 rng(seq);
+    int terminals = static_cast<int>(c->rank_at.size());
+    int ranks = static_cast<int>(c->place.size());
+    std::uniform_int_distribution<int> pick_rank(0, ranks - 1);
+    std::uniform_int_distribution<int> pick_terminal(0, terminals - 2);
+    auto pick = [&](int *t1, int *t2) {
+        *t1 = c->place[pick_rank(rng)];
+        *t2 = pick_terminal(rng);
+        if (*t2 >= *t1)
+            (*t2)++;
+    };
+
+    // Start at the mean change of random swaps.
+    double t0 = 0.0;
+    const int samples = 100;
+    for (int i = 0; i < samples; i++) {
+        int t1, t2;
+        pick(&t1, &t2);
+        t0 += fabs(chain_move(c, t1, t2) - c->value);
+        chain_undo(c, t1, t2);
+    }
+    t0 /= samples;
+    if (t0 <= 0.0) {
+        *best = c->place;
+        return;
+    }
+    double temp = t0;
+    double alpha = pow(1e-4, 1.0 / iters);
+
+    double best_value = c->value;
+    *best = c->place;
+    for (long i = 0; i < iters; i++, temp *= alpha) {
+        int t1, t2;
+        pick(&t1, &t2);
+        double v = chain_move(c, t1, t2);
+        double delta = v - c->value;
+        if (delta <= 0.0 ||
+            std::generate_canonical<double, 53>(rng) < exp(-delta / temp)) {
+            c->value = v;
+            if (v < best_value - 1e-9) {
+                best_value = v;
+                *best = c->place;
+            }
+        } else {
+            chain_undo(c, t1, t2);
+        }
+    }
+}
+
+// Search for a placement better than 'place' for 'cost'.
+std::vector<int> map_optimize(const Topology *top, const CommMatrix *cm,
+                              const std::vector<int> &place,
+                              enum MapCost cost, long iters, int chains,
+                              uint64_t seed)
+{
+    int terminals = top->terminal_count;
+    if (cm->entries.empty() || terminals < 2 || iters <= 0)
+        return place;
+
+    std::vector<std::vector<int>> edges(cm->rank_count);
+    for (size_t i = 0; i < cm->entries.size(); i++) {
+        edges[cm->entries[i].src].push_back(static_cast<int>(i));
+        edges[cm->entries[i].dst].push_back(static_cast<int>(i));
+    }
+
+    std::vector<MapChain> cs(chains);
+    std::vector<std::vector<int>> results(chains);
+    for (MapChain &c : cs) {
+        c.top = top;
+        c.cm = cm;
+        c.cost = cost;
+        c.edges = &edges;
+        c.place = place;
+        c.rank_at.assign(terminals, -1);
+        for (int r = 0; r < cm->rank_count; r++)
+            c.rank_at[place[r]] = r;
+        if (cost == MAP_LOAD)
+            c.load = map_loads(top, cm, place);
+        c.value = map_objective(top, cm, place, cost);
+    }
+    std::vector<std::thread> threads;
+    for (int i = 1; i < chains; i++)
+        threads.emplace_back(chain_run, &cs[i], iters, seed, i, &results[i]);
+    chain_run(&cs[0], iters, seed, 0, &results[0]);
+    for (std::thread &t : threads)
+        t.join();
+
+    // The chains track their objective incrementally, so compare them afresh.
+    std::vector<int> best = place;
+    double best_value = map_objective(top, cm, place, cost);
+    for (const std::vector<int> &r : results) {
+        double v = map_objective(top, cm, r, cost);
+        if (v < best_value - 1e-9) {
+            best_value = v;
+            best = r;
+        }
+    }
+    return best;
+}
+
+void map_report(const Topology *top, const CommMatrix *cm,
+                const std::vector<int> &initial, const std::vector<int> &place)
+{
+    printf("==== MAPPING ====\n");
+    printf("# of ranks: %d on %d terminals\n", cm->rank_count,
+           top->terminal_count);
+    printf("# of communicating pairs: %zu\n", cm->entries.size());
+    printf("Weighted hop count: %lf -> %lf\n", map_hops(top, cm, initial),
+           map_hops(top, cm, place));
+    printf("Max channel load: %lf -> %lf\n", map_max_load(top, cm, initial),
+           map_max_load(top, cm, place));
+    printf("\n");
+}
+
+// Make 'td' send along the matrix, with ranks placed by 'place': the source
+// terminal of each rank picks destinations in proportion to its row, and
+// injects at a rate in proportion to the row's total.
+void map_traffic(TrafficDesc *td, const CommMatrix *cm,
+                 const std::vector<int> &place, double mean_interval,
+                 long packet_len)
+{
+    int terminals = static_cast<int>(td->dests.size());
+    std::vector<std::vector<const CommEntry *>> rows(terminals);
+    for (const CommEntry &e : cm->entries)
+        rows[place[e.src]].push_back(&e);
+
+    td->type = TRF_MATRIX;
+    td->comm_begin.assign(1, 0);
+    td->comm_cdf.clear();
+    td->comm_dest.clear();
+    for (int t = 0; t < terminals; t++) {
+        double sum = 0.0;
+        for (const CommEntry *e : rows[t]) {
+            sum += e->weight;
+            td->comm_cdf.push_back(sum);
+            td->comm_dest.push_back(place[e->dst]);
+        }
+        td->comm_begin.push_back(static_cast<int>(td->comm_dest.size()));
+    }
+
+    // A source starts a packet every packet_len cycles plus its interval, so
+    // the rate of a source with a 'share' of the busiest one's volume takes
+    // (packet_len + mean_interval) / share - packet_len.
+    double max_volume = 0.0;
+    for (int t = 0; t < terminals; t++) {
+        int end = td->comm_begin[t + 1];
+        if (end > td->comm_begin[t])
+            max_volume = std::max(max_volume, td->comm_cdf[end - 1]);
+    }
+    td->comm_interval.assign(terminals, 0.0);
+    for (int t = 0; t < terminals; t++) {
+        int end = td->comm_begin[t + 1];
+        if (end == td->comm_begin[t])
+            continue;
+        double share = td->comm_cdf[end - 1] / max_volume;
+        td->comm_interval[t] =
+            (packet_len + mean_interval) / share - packet_len;
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include "router.h"
+#include <vector>
+
+// Task-to-terminal mapping.
+//
+// An application is a set of ranks with a communication matrix: the relative
+// volume each rank sends to each other one.  It is read from a text file of
+// "SRC DST WEIGHT" lines (# starts a comment), or from a packet record file
+// (see record.h), where every recorded packet counts once and the terminals
+// of the recorded run are taken as the ranks.
+//
+// A placement puts rank i on terminal place[i]; unused terminals are idle.
+// Each rank sends to the others in proportion to its row of the matrix, at a
+// rate in proportion to the row's total: the busiest rank injects at the
+// mean interval of the run, and the others proportionally less often.
+// map_optimize() searches for one that minimizes the weighted hop count, or
+// the estimated load of the busiest channel, by simulated annealing: each
+// chain starts from the given placement and swaps the contents of two
+// terminals at a time, cooling geometrically from a temperature sampled from
+// random swaps.  Chains run on their own threads with their own random
+// streams, and the best placement of all wins.
+//
+// Channel loads follow dimension-order routes, with ties on even rings split
+// evenly between the two directions like the random tie-breaking of the
+// router.  Annealing on the load alone would wander over the many placements
+// with the same maximum, so it minimizes the maximum plus the mean.
+
+enum MapCost {
+    MAP_HOPS, // weighted hop count
+    MAP_LOAD, // estimated maximum channel load
+};
+
+typedef struct CommEntry {
+    int src;
+    int dst;
+    double weight;
+} CommEntry;
+
+typedef struct CommMatrix {
+    int rank_count = 0;
+    std::vector<CommEntry> entries; // nonzero, off-diagonal
+} CommMatrix;
+
+int comm_load(const char *path, CommMatrix *cm);
+int map_load(const char *path, int terminal_count, std::vector<int> *place);
+int map_save(const char *path, const std::vector<int> &place);
+double map_hops(const Topology *top, const CommMatrix *cm,
+                const std::vector<int> &place);
+double map_max_load(const Topology *top, const CommMatrix *cm,
+                    const std::vector<int> &place);
+std::vector<int> map_optimize(const Topology *top, const CommMatrix *cm,
+                              const std::vector<int> &place,
+                              enum MapCost cost, long iters, int chains,
+                              uint64_t seed);
+void map_report(const Topology *top, const CommMatrix *cm,
+                const std::vector<int> &initial, const std::vector<int> &place);
+void map_traffic(TrafficDesc *td, const CommMatrix *cm,
+                 const std::vector<int> &place, double mean_interval,
+                 long packet_len);
+
+#endif
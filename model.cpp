@@ -0,0 +1,242 @@
+#include "model.h"
+#include <stdio.h>
+#include <math.h>
+#include <assert.h>
+#include <vector>
+#include <algorithm>
+
+// Per-dimension traffic of a uniform random pattern under dimension-order
+// routing, averaged over all N - 1 possible destinations.
+struct DimLoad {
+    double plus;  // average hops taken in the clockwise direction
+    double minus; // average hops taken in the counterclockwise direction
+};
+
+// Mirrors source_route_compute_dimension(): ties on even rings are broken
+// randomly, so each direction takes half of them.
+static DimLoad ring_load(int k, long total_nodes)
+{
+    DimLoad dl = {0.0, 0.0};
+    double dests_per_offset = static_cast<double>(total_nodes) / k;
+    for (int offset = 1; offset < k; offset++) {
+        if ((k % 2) == 0 && offset == k / 2) {
+            dl.plus += 0.5 * offset * dests_per_offset;
+            dl.minus += 0.5 * offset * dests_per_offset;
+        } else if (offset <= k / 2) {
+            dl.plus += offset * dests_per_offset;
+        } else {
+            dl.minus += (k - offset) * dests_per_offset;
+        }
+    }
+    dl.plus /= static_cast<double>(total_nodes - 1);
+    dl.minus /= static_cast<double>(total_nodes - 1);
+    return dl;
+}
+
+// Hop count distribution over all N - 1 destinations, computed by convolving
+// the per-ring distance distributions.
+static std::vector<double> hop_count_dist(const TopoDesc *td, long total_nodes)
+{
+    std::vector<double> dist{1.0};
+    for (int d = 0; d < td->r; d++) {
+        int k = td->k[d];
+        std::vector<double> next(dist.size() + k / 2, 0.0);
+        for (size_t h = 0; h < dist.size(); h++) {
+            for (int offset = 0; offset < k; offset++) {
+                int hops = std::min(offset, k - offset);
+                next[h + hops] += dist[h];
+            }
+        }
+        dist = next;
+    }
+    // Exclude the source itself.
+    dist[0] -= 1.0;
+    for (auto &p : dist)
+        p /= static_cast<double>(total_nodes - 1);
+    return dist;
+}
+
+// Mean and variance of the waiting time of an M/D/1 queue with service time
+// 'service', by the Pollaczek-Khinchine formulas.
+struct Wait {
+    double mean;
+    double var;
+};
+
+static Wait md1_wait(double rho, double service)
+{
+    if (rho >= 1.0)
+        return (Wait){INFINITY, INFINITY};
+    double mean = rho * service / (2.0 * (1.0 - rho));
+    double second = 2.0 * mean * mean +
+                    rho * service * service / (3.0 * (1.0 - rho));
+    return (Wait){mean, second - mean * mean};
+}
+
+// Accumulate 'hops' independent waits at channels of utilization 'rho'.
+static void wait_add(Wait *total, double hops, double rho, double service)
+{
+    if (hops <= 0.0)
+        return;
+    Wait w = md1_wait(rho, service);
+    total->mean += hops * w.mean;
+    total->var += hops * w.var;
+}
+
+// Cycles for the destination to consume the head flit once it has arrived.
+#define MODEL_CONSUME_CYCLES 1.0
+
+// 'link_latency' is the total latency of the 'hops' ring links.
+static double zero_load_latency(const ModelParams *mp, double hops,
+                                double link_latency)
+{
+    // Injection channel, then a router pipeline for each of the (hops + 1)
+    // routers, the ring links and the ejection channel, then the consumption
+    // of the head flit.
+    return 2.0 * mp->channel_delay + (hops + 1.0) * mp->pipeline_depth +
+           link_latency + MODEL_CONSUME_CYCLES;
+}
+
+ModelResult model_evaluate(const ModelParams *mp)
+{
+    const TopoDesc *td = &mp->desc;
+    assert(td->type == TOP_TORUS);
+    ModelResult res = {};
+
+    long total_nodes = topo_router_count(td);
+    assert(total_nodes > 1);
+
+    // Source nodes start a new packet every (packet_len + Exp(mean_interval))
+    // cycles; see source_generate().
+    double len = static_cast<double>(mp->packet_len);
+    res.interval_avg = len + mp->mean_interval;
+    res.offered = len / res.interval_avg;
+
+    // Channel utilization.  Every node injects 'offered' flits per cycle and
+    // each of the N channels along a given dimension and direction carries an
+    // equal share of the traffic in that direction.
+    Wait wait = {0.0, 0.0};
+    double util_max = res.offered; // ejection channel
+    res.hop_count_avg = 0.0;
+    double link_latency = 0.0;
+    for (int d = 0; d < td->r; d++) {
+        DimLoad dl = ring_load(td->k[d], total_nodes);
+        link_latency += (dl.plus + dl.minus) * td->delay[d];
+        double rho_plus = res.offered * dl.plus;
+        double rho_minus = res.offered * dl.minus;
+        util_max = std::max(util_max, std::max(rho_plus, rho_minus));
+        wait_add(&wait, dl.plus, rho_plus, len);
+        wait_add(&wait, dl.minus, rho_minus, len);
+        res.hop_count_avg += dl.plus + dl.minus;
+    }
+    wait_add(&wait, 1.0, res.offered, len);
+    res.channel_util_max = util_max;
+    res.saturated = (util_max >= 1.0);
+
+    res.latency_zero =
+        zero_load_latency(mp, res.hop_count_avg, link_latency);
+    res.latency_avg = res.latency_zero + wait.mean;
+
+    // Tail estimate: take the 99th percentile path length, and approximate
+    // the total waiting time as exponential with an atom at zero, i.e.
+    // P(W > t) = p * exp(-t / b), with p and b fitted to the first two
+    // moments of the total waiting time.
+    std::vector<double> dist = hop_count_dist(td, total_nodes);
+    double cum = 0.0;
+    size_t hop_p99 = 0;
+    for (; hop_p99 < dist.size(); hop_p99++) {
+        cum += dist[hop_p99];
+        if (cum >= 0.99)
+            break;
+    }
+    double wait_p99 = 0.0;
+    if (res.saturated) {
+        wait_p99 = INFINITY;
+    } else if (wait.mean > 0.0) {
+        double second = wait.var + wait.mean * wait.mean;
+        double b = second / (2.0 * wait.mean);
+        double p = wait.mean / b;
+        if (100.0 * p > 1.0)
+            wait_p99 = b * log(100.0 * p);
+    }
+    // Links on the longer path are assumed to have the average latency.
+    double link_p99 = hop_p99 * (link_latency / res.hop_count_avg);
+    res.latency_p99 =
+        zero_load_latency(mp, static_cast<double>(hop_p99), link_p99) +
+        wait_p99;
+
+    return res;
+}
+
+// Print the model estimate in the same format as sim_report().
+void model_report(const ModelParams *mp)
+{
+    ModelResult res = model_evaluate(mp);
+
+    char topo[64];
+    printf("\n");
+    printf("==== MODEL RESULT ====\n");
+
+    printf("Topology: %s\n", topo_desc_str(&mp->desc, topo, sizeof(topo)));
+    printf("Radix: %d\n", topo_radix(&mp->desc));
+    printf("# of VCs per channel: %d\n", mp->vc_count);
+    printf("Router pipeline: %d cycles\n", mp->pipeline_depth);
+    printf("Packet length: %ld flits\n", mp->packet_len);
+    printf("Offered load: %lf flits/cycle/node\n", res.offered);
+    printf("Max channel utilization: %lf%s\n", res.channel_util_max,
+           res.saturated ? " (saturated)" : "");
+    printf("\n");
+
+    printf("Average interval: %lf cycles\n", res.interval_avg);
+    printf("Average hop count: %lf hops\n", res.hop_count_avg);
+    printf("Average latency: %lf\n", res.latency_avg);
+    printf("99th percentile latency: %lf\n", res.latency_p99);
+}
+
+// Evaluate the model at 'points' offered loads up to saturation, and locate
+// the knee of the latency curve.
+void model_sweep(const ModelParams *mp, int points)
+{
+    ModelParams p = *mp;
+    double len = static_cast<double>(p.packet_len);
+
+    // Offered load at which the most loaded channel saturates.
+    p.mean_interval = 0.0;
+    ModelResult full = model_evaluate(&p);
+    double sat_load = full.offered / full.channel_util_max;
+    if (sat_load > 1.0)
+        sat_load = 1.0;
+
+    char topo[64];
+    printf("\n");
+    printf("==== MODEL SWEEP ====\n");
+    printf("Topology: %s\n", topo_desc_str(&p.desc, topo, sizeof(topo)));
+    printf("Saturation load: %lf flits/cycle/node\n", sat_load);
+
+    // Knee: the load at which the average latency doubles the zero-load
+    // latency.
+    double lo = 0.0, hi = sat_load;
+    for (int i = 0; i < 50; i++) {
+        double mid = (lo + hi) / 2.0;
+        p.mean_interval = len / mid - len;
+        ModelResult res = model_evaluate(&p);
+        if (res.latency_avg < 2.0 * res.latency_zero)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    printf("Knee load: %lf flits/cycle/node (interval %lf)\n", lo,
+           len / lo - len);
+    printf("\n");
+
+    printf("%12s %12s %12s %12s %12s\n", "interval", "offered", "latency",
+           "p99", "max_util");
+    for (int i = 1; i <= points; i++) {
+        double load = sat_load * i / points;
+        p.mean_interval = len / load - len;
+        ModelResult res = model_evaluate(&p);
+        printf("%12.3lf %12.4lf %12.3lf %12.3lf %12.4lf\n", p.mean_interval,
+               res.offered, res.latency_avg, res.latency_p99,
+               res.channel_util_max);
+    }
+}
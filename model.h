@@ -0,0 +1,37 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include "router.h"
+
+// Analytic latency model for quick pre-screening of load sweeps.
+//
+// Channel loads are computed in closed form for uniform random traffic under
+// dimension-order routing, and each channel is treated as an M/D/1 queue
+// whose service time is one packet length (Ch23.2).  The result is an
+// estimate of the same quantities sim_report() prints, and takes only a few
+// microseconds to compute regardless of the network size.
+typedef struct ModelParams {
+    TopoDesc desc;
+    int vc_count;
+    long packet_len;    // length of a packet in flits
+    long channel_delay; // terminal channel latency; see desc.delay for links
+    int pipeline_depth; // router pipeline latency in cycles
+    double mean_interval;
+} ModelParams;
+
+typedef struct ModelResult {
+    double offered;        // offered load in flits/cycle/node
+    double interval_avg;   // average packet interval in cycles
+    double hop_count_avg;  // average hop count
+    double latency_zero;   // zero-load latency
+    double latency_avg;    // average latency
+    double latency_p99;    // 99th percentile latency (rough)
+    double channel_util_max; // utilization of the most loaded channel
+    int saturated;
+} ModelResult;
+
+ModelResult model_evaluate(const ModelParams *mp);
+void model_report(const ModelParams *mp);
+void model_sweep(const ModelParams *mp, int points);
+
+#endif
@@ -0,0 +1,199 @@
+#include "nic.h"
+#include "sim.h"
+#include "stats.h"
+#include <stdio.h>
+#include <assert.h>
+#include <algorithm>
+
+NicState *nic_create(long msg_flits, long mtu, int max_outstanding,
+                     long reasm_buf, int terminal_count)
+{
+    if (mtu < 2)
+        fatal("nic: MTU must be at least 2 flits\n");
+    if (reasm_buf > 0 && reasm_buf < msg_flits)
+        fatal("nic: a %ld-flit message does not fit in the %ld-flit "
+              "reassembly buffer\n", msg_flits, reasm_buf);
+
+    NicState *nic = new NicState;
+    nic->msg_flits = msg_flits;
+    nic->mtu = mtu;
+    nic->max_outstanding = max_outstanding;
+    nic->reasm_buf = reasm_buf;
+    nic->senders.resize(terminal_count);
+    nic->reasm_used.assign(terminal_count, 0);
+    nic->reasm_peak.assign(terminal_count, 0);
+    nic->waiters.resize(terminal_count);
+    return nic;
+}
+
+void nic_destroy(NicState *nic)
+{
+    delete nic;
+}
+
+// Packets are now up to one MTU long.
+void nic_attach(Sim *sim, NicState *nic)
+{
+    if (sim->faults)
+        fatal("nic: not supported with faults\n");
+    if (sim->config.deadlock == DEADLOCK_BUBBLE &&
+        sim->config.input_buf_size < 2 * nic->mtu)
+        fatal("nic: bubble flow control needs buffers of two MTUs\n");
+    sim->config.packet_len = nic->mtu;
+    sim->nic = nic;
+}
+
+void nic_message_arrive(NicState *nic, int src, int dst, long now)
+{
+    long id = nic->next_msg_id++;
+    Message m;
+    m.src = src;
+    m.dst = dst;
+    m.flits = nic->msg_flits;
+    m.gen = now;
+    nic->messages.insert({id, m});
+    nic->senders[src].queue.push_back(id);
+    nic->msg_gen_count++;
+}
+
+// Whether the front message of 'src' can send its next packet now.  If not,
+// 'src' waits on the destination until a packet or message completes there.
+bool nic_has_packet(NicState *nic, int src)
+{
+    NicSender &s = nic->senders[src];
+    if (s.queue.empty())
+        return false;
+    Message &m = nic->messages.at(s.queue.front());
+
+    bool blocked = false;
+    if (nic->max_outstanding > 0 &&
+        s.outstanding[m.dst] >= nic->max_outstanding) {
+        if (m.blocked_outstanding_at != m.packets) {
+            m.blocked_outstanding_at = m.packets;
+            nic->blocked_outstanding++;
+        }
+        blocked = true;
+    } else if (m.sent == 0 && nic->reasm_buf > 0 &&
+               nic->reasm_used[m.dst] + m.flits > nic->reasm_buf) {
+        if (m.blocked_reasm_at != m.packets) {
+            m.blocked_reasm_at = m.packets;
+            nic->blocked_reasm++;
+        }
+        blocked = true;
+    }
+    if (blocked) {
+        std::vector<int> &w = nic->waiters[m.dst];
+        if (std::find(w.begin(), w.end(), src) == w.end())
+            w.push_back(src);
+        return false;
+    }
+    return true;
+}
+
+// Segment the next packet of the front message of 'src'.  Only valid right
+// after nic_has_packet() returned true.
+void nic_next_packet(NicState *nic, int src, long now, NicPacket *p)
+{
+    NicSender &s = nic->senders[src];
+    long id = s.queue.front();
+    Message &m = nic->messages.at(id);
+
+    if (m.sent == 0) {
+        nic->reasm_used[m.dst] += m.flits;
+        nic->reasm_peak[m.dst] =
+            std::max(nic->reasm_peak[m.dst], nic->reasm_used[m.dst]);
+        m.first_inject = now;
+        nic->inject_delays.push_back(now - m.gen);
+    }
+    // A single-flit remainder is padded, as packets have a head and a tail.
+    long len = std::max(2L, std::min(nic->mtu, m.flits - m.sent));
+    m.sent = std::min(m.flits, m.sent + len);
+    m.packets++;
+    s.outstanding[m.dst]++;
+    nic->packet_count++;
+
+    p->dst = m.dst;
+    p->msg_id = id;
+    p->len = len;
+    if (m.sent == m.flits)
+        s.queue.pop_front();
+}
+
+static void nic_wake(Sim *sim, int dst)
+{
+    std::vector<int> &w = sim->nic->waiters[dst];
+    for (int src : w) {
+        schedule(&sim->eventq, curr_time(&sim->eventq) + 1,
+                 tick_event(sim->src_nodes[src].get()));
+    }
+    w.clear();
+}
+
+// Account a flit consumed by its destination terminal.
+void nic_flit_arrive(Sim *sim, const Flit *flit)
+{
+    NicState *nic = sim->nic;
+    auto it = nic->messages.find(flit->msg_id);
+    assert(it != nic->messages.end());
+    Message &m = it->second;
+    if (flit->type != FLIT_TAIL)
+        return;
+
+    int dst = m.dst;
+    nic->senders[m.src].outstanding[dst]--;
+    m.received++;
+    if (m.sent == m.flits && m.received == m.packets) {
+        long now = curr_time(&sim->eventq);
+        nic->latencies.push_back(now - m.gen);
+        nic->msg_done_count++;
+        nic->msg_flit_count += m.flits;
+        nic->reasm_used[dst] -= m.flits;
+        nic->messages.erase(it);
+    }
+    nic_wake(sim, dst);
+}
+
+static double mean(const std::vector<long> &v)
+{
+    if (v.empty())
+        return 0.0;
+    long sum = 0;
+    for (long x : v)
+        sum += x;
+    return static_cast<double>(sum) / v.size();
+}
+
+void nic_report(NicState *nic, long cycles, long nodes)
+{
+    std::sort(nic->latencies.begin(), nic->latencies.end());
+    long peak = 0;
+    for (long x : nic->reasm_peak)
+        peak = std::max(peak, x);
+
+    printf("\n");
+    printf("==== NETWORK INTERFACE ====\n");
+    printf("Message size: %ld flits (MTU %ld flits)\n", nic->msg_flits,
+           nic->mtu);
+    if (nic->max_outstanding > 0)
+        printf("Outstanding packets per destination: %d\n",
+               nic->max_outstanding);
+    if (nic->reasm_buf > 0)
+        printf("Reassembly buffer: %ld flits (peak use %ld)\n", nic->reasm_buf,
+               peak);
+    printf("# of messages generated: %ld\n", nic->msg_gen_count);
+    printf("# of messages completed: %ld\n", nic->msg_done_count);
+    printf("# of packets sent: %ld\n", nic->packet_count);
+    printf("# of packets blocked on outstanding limit: %ld\n",
+           nic->blocked_outstanding);
+    printf("# of packets blocked on reassembly buffer: %ld\n",
+           nic->blocked_reasm);
+    printf("Message throughput: %lf messages/cycle/node (%lf flits)\n",
+           nic->msg_done_count / static_cast<double>(cycles) / nodes,
+           nic->msg_flit_count / static_cast<double>(cycles) / nodes);
+    printf("Average message latency: %lf\n", mean(nic->latencies));
+    printf("Message latency p50/p99/max: %ld/%ld/%ld\n",
+           sorted_percentile(nic->latencies, 0.5),
+           sorted_percentile(nic->latencies, 0.99),
+           nic->latencies.empty() ? -1 : nic->latencies.back());
+    printf("Average send queue delay: %lf\n", mean(nic->inject_delays));
+}
@@ -0,0 +1,88 @@
+#ifndef NIC_H
+#define NIC_H
+
+#include <vector>
+#include <deque>
+#include <unordered_map>
+
+// Network interface model.
+//
+// With a NIC, the workload generates messages instead of packets.  Messages
+// wait in a per-terminal send queue and are split into packets of at most
+// 'mtu' flits.  The sender keeps at most 'max_outstanding' packets in flight
+// to each destination; a packet stops being outstanding once its tail is
+// consumed by the destination.
+//
+// Each destination has a reassembly buffer of 'reasm_buf' flits.  Before the
+// first packet of a message is sent, room for the whole message is reserved
+// in the receiver's buffer, and it is released when the last flit arrives.
+// Reserving at the sender means a message that is let into the network
+// always has room at the receiver, so a full buffer backs up into the send
+// queues instead of the network.  Reservations and completions are seen by
+// the sender immediately; the control traffic itself is not modeled.
+//
+// Messages are sent in order: a message blocked by either limit blocks the
+// ones behind it.
+
+typedef struct Message {
+    int src;
+    int dst;
+    long flits;         // size in flits
+    long sent = 0;      // flits segmented so far
+    int packets = 0;    // packets segmented so far
+    int received = 0;   // packets whose tail arrived at the destination
+    long gen;           // cycle the message was generated
+    long first_inject = -1; // cycle its first packet was segmented
+    // Last packet counted as blocked on each limit, so that a packet polled
+    // many times while blocked counts once.
+    int blocked_outstanding_at = -1;
+    int blocked_reasm_at = -1;
+} Message;
+
+typedef struct NicPacket {
+    int dst;
+    long msg_id;
+    long len; // in flits
+} NicPacket;
+
+typedef struct NicSender {
+    std::deque<long> queue; // message IDs, in order
+    std::unordered_map<int, int> outstanding; // packets in flight, by dst
+} NicSender;
+
+struct Sim;
+struct Flit;
+typedef struct NicState {
+    long msg_flits;       // message size in flits
+    long mtu;             // maximum packet length in flits
+    int max_outstanding;  // per destination, 0 for unlimited
+    long reasm_buf;       // reassembly buffer size in flits, 0 for unlimited
+
+    long next_msg_id = 0;
+    std::unordered_map<long, Message> messages; // in flight, by ID
+    std::vector<NicSender> senders;             // per source terminal
+    std::vector<long> reasm_used;       // reserved flits, per destination
+    std::vector<long> reasm_peak;       // maximum of reasm_used
+    std::vector<std::vector<int>> waiters; // blocked sources, per destination
+
+    long msg_gen_count = 0;
+    long msg_done_count = 0;
+    long msg_flit_count = 0;       // flits of completed messages
+    long packet_count = 0;
+    long blocked_outstanding = 0;  // packets blocked per limit
+    long blocked_reasm = 0;
+    std::vector<long> latencies;   // of completed messages
+    std::vector<long> inject_delays; // generation to first packet
+} NicState;
+
+NicState *nic_create(long msg_flits, long mtu, int max_outstanding,
+                     long reasm_buf, int terminal_count);
+void nic_destroy(NicState *nic);
+void nic_attach(Sim *sim, NicState *nic);
+void nic_message_arrive(NicState *nic, int src, int dst, long now);
+bool nic_has_packet(NicState *nic, int src);
+void nic_next_packet(NicState *nic, int src, long now, NicPacket *p);
+void nic_flit_arrive(Sim *sim, const Flit *flit);
+void nic_report(NicState *nic, long cycles, long nodes);
+
+#endif
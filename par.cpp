@@ -0,0 +1,238 @@
+#include "par.h"
+#include "sim.h"
+#include "queue.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <limits.h>
+#include <assert.h>
+#include <algorithm>
+#include <thread>
+
+ParState *par_create(Sim *sim, int threads)
+{
+    if (sim->debug_mode || sim->config.verbose)
+        fatal("-threads does not support -d or -v\n");
+    if (sim->recorder || sim->tracer || sim->congestion || sim->faults ||
+        sim->qos || sim->nic || sim->cc) {
+        fatal("-threads does not support records, traces, congestion trees, "
+              "faults, traffic classes, NICs or injection control\n");
+    }
+
+    const Topology *top = &sim->topology;
+    ParState *ps = new ParState;
+    ps->threads = std::min(threads, top->router_count);
+    ps->barrier.count = ps->threads;
+
+    // Cut the routers in layout order, each with its terminals.
+    int conc = top->desc.concentration;
+    ps->part_of.assign(sim->nodes.size(), 0);
+    for (int i = 0; i < top->router_count; i++) {
+        int rid = top->layout ? top->layout[i] : i;
+        int p = static_cast<int>(static_cast<long>(i) * ps->threads /
+                                 top->router_count);
+        ps->part_of[sim->routers[rid]->node] = p;
+        for (int id = rid * conc; id < (rid + 1) * conc; id++) {
+            ps->part_of[sim->src_nodes[id]->node] = p;
+            ps->part_of[sim->dst_nodes[id]->node] = p;
+        }
+    }
+
+    // The nodes draw from their own streams, so the partitions only need
+    // their own copies of the distributions.
+    for (int p = 0; p < ps->threads; p++) {
+        ParPartition *part = new ParPartition(sim->rand_gen);
+        eventq_init(&part->eventq);
+        part->config = sim->config;
+        part->config.eventq = &part->eventq;
+        part->config.stat = &part->stat;
+        part->config.rand_gen = &part->rand_gen;
+        // Packets cross partitions, so they cannot be looked up at the
+        // destination in the ledger of the source.
+        part->config.ledger = false;
+        ps->parts.push_back(part);
+    }
+    for (Router *node : sim->nodes)
+        node->cfg = &ps->parts[ps->part_of[node->node]]->config;
+
+    // Channels take the event queues of their ends, and the ones across a cut
+    // hold what is sent on them until the end of the window.
+    for (Channel &ch : sim->channels) {
+        if (ps->part_of[ch.src_tick.node] != ps->part_of[ch.dst_tick.node])
+            ps->cut_count++;
+    }
+    ps->links.resize(ps->cut_count);
+    ps->window = LONG_MAX;
+    long k = 0;
+    for (Channel &ch : sim->channels) {
+        ParPartition *src = ps->parts[ps->part_of[ch.src_tick.node]];
+        ParPartition *dst = ps->parts[ps->part_of[ch.dst_tick.node]];
+        ch.src_eventq = &src->eventq;
+        ch.dst_eventq = &dst->eventq;
+        if (src != dst) {
+            ch.remote = &ps->links[k++];
+            dst->flits_in.push_back(&ch);
+            src->credits_in.push_back(&ch);
+            ps->window = std::min(ps->window, ch.delay);
+        }
+    }
+    assert(ps->window >= 1);
+    return ps;
+}
+
+static void barrier_wait(ParBarrier *b)
+{
+    std::unique_lock<std::mutex> l(b->lock);
+    long generation = b->generation;
+    if (++b->waiting == b->count) {
+        b->waiting = 0;
+        b->generation++;
+        b->cv.notify_all();
+    } else {
+        b->cv.wait(l, [&] { return b->generation != generation; });
+    }
+}
+
+// Take in what was sent across the cuts into 'part' during the window.  None
+// of it arrives before the next window.
+static void part_receive(ParPartition *part)
+{
+    for (Channel *ch : part->flits_in) {
+        for (const TimedFlit &tf : ch->remote->flits) {
+            assert(!queue_full(ch->buf));
+            queue_put(ch->buf, tf);
+            schedule(&part->eventq, tf.time, ch->dst_tick);
+        }
+        ch->remote->flits.clear();
+    }
+    for (Channel *ch : part->credits_in) {
+        for (const TimedCredit &tc : ch->remote->credits) {
+            ch->buf_credit.push_back(tc);
+            schedule(&part->eventq, tc.time, ch->src_tick);
+        }
+        ch->remote->credits.clear();
+    }
+    part->next = eventq_empty(&part->eventq) ? -1 : next_time(&part->eventq);
+}
+
+static void part_run(Sim *sim, ParState *ps, int p, long until)
+{
+    ParPartition *part = ps->parts[p];
+    long last_print_cycle = 0;
+    flight_enter(sim->flight);
+
+    for (;;) {
+        // Every thread works out the same window.
+        long start = LONG_MAX;
+        for (const ParPartition *q : ps->parts) {
+            if (q->next >= 0)
+                start = std::min(start, q->next);
+        }
+        if (start == LONG_MAX || (0 <= until && until < start))
+            break;
+        long end = (ps->window < LONG_MAX - start) ? start + ps->window
+                                                   : LONG_MAX;
+        if (0 <= until)
+            end = std::min(end, until + 1);
+        if (p == 0) {
+            ps->window_count++;
+            if (sim->progress && start / 100 > last_print_cycle / 100) {
+                last_print_cycle = start / 100 * 100;
+                printf("[@%3ld/%3ld]\n", last_print_cycle, until);
+            }
+        }
+
+        while (!eventq_empty(&part->eventq) && next_time(&part->eventq) < end) {
+            Event e = eventq_pop(&part->eventq);
+            flight_node = e.node;
+            event_table[e.type](sim->nodes[e.node]);
+            part->event_count++;
+        }
+        barrier_wait(&ps->barrier);
+        part_receive(part);
+        barrier_wait(&ps->barrier);
+    }
+}
+
+void par_run(Sim *sim, long until)
+{
+    ParState *ps = sim->par;
+
+    // Move the initial events to the partitions of their nodes.
+    while (!eventq_empty(&sim->eventq)) {
+        long time = next_time(&sim->eventq);
+        Event e = eventq_pop(&sim->eventq);
+        schedule(&ps->parts[ps->part_of[e.node]]->eventq, time, e);
+    }
+    for (ParPartition *part : ps->parts) {
+        part->next =
+            eventq_empty(&part->eventq) ? -1 : next_time(&part->eventq);
+    }
+
+    std::vector<std::thread> threads;
+    for (int p = 1; p < ps->threads; p++)
+        threads.emplace_back(part_run, sim, ps, p, until);
+    part_run(sim, ps, 0, until);
+    for (std::thread &t : threads)
+        t.join();
+
+    // Gather the clock and the statistics.
+    for (ParPartition *part : ps->parts) {
+        sim->eventq.time_ = std::max(sim->eventq.time_, part->eventq.time_);
+        sim->stat.double_tick_count += part->stat.double_tick_count;
+        sim->stat.latency_sum += part->stat.latency_sum;
+        sim->stat.packet_gen_count += part->stat.packet_gen_count;
+        sim->stat.packet_arrive_count += part->stat.packet_arrive_count;
+        sim->stat.flit_arrive_count += part->stat.flit_arrive_count;
+        sim->stat.hop_count_sum += part->stat.hop_count_sum;
+        Stat &st = sim->stat;
+        const Stat &from = part->stat;
+        if (st.src_flit_arrive.size() < from.src_flit_arrive.size())
+            st.src_flit_arrive.resize(from.src_flit_arrive.size(), 0);
+        for (size_t i = 0; i < from.src_flit_arrive.size(); i++)
+            st.src_flit_arrive[i] += from.src_flit_arrive[i];
+        if (st.dist_latency_hist.size() < from.dist_latency_hist.size())
+            st.dist_latency_hist.resize(from.dist_latency_hist.size());
+        for (size_t d = 0; d < from.dist_latency_hist.size(); d++) {
+            std::vector<long> &h = st.dist_latency_hist[d];
+            if (h.size() < from.dist_latency_hist[d].size())
+                h.resize(from.dist_latency_hist[d].size(), 0);
+            for (size_t lat = 0; lat < from.dist_latency_hist[d].size(); lat++)
+                h[lat] += from.dist_latency_hist[d][lat];
+        }
+        part->stat = Stat();
+    }
+}
+
+void par_report(const ParState *ps)
+{
+    long events_min = LONG_MAX, events_max = 0;
+    for (const ParPartition *part : ps->parts) {
+        events_min = std::min(events_min, part->event_count);
+        events_max = std::max(events_max, part->event_count);
+    }
+
+    printf("\n");
+    printf("==== PARALLEL ENGINE ====\n");
+    printf("# of partitions: %d\n", ps->threads);
+    printf("# of channels across partitions: %ld\n", ps->cut_count);
+    printf("Window: %ld cycles\n", ps->window);
+    printf("# of windows: %ld\n", ps->window_count);
+    printf("Events per partition: %ld to %ld\n", events_min, events_max);
+}
+
+void par_destroy(Sim *sim)
+{
+    ParState *ps = sim->par;
+    for (Router *node : sim->nodes)
+        node->cfg = &sim->config;
+    for (Channel &ch : sim->channels) {
+        ch.src_eventq = &sim->eventq;
+        ch.dst_eventq = &sim->eventq;
+        ch.remote = NULL;
+    }
+    for (ParPartition *part : ps->parts) {
+        eventq_destroy(&part->eventq);
+        delete part;
+    }
+    delete ps;
+}
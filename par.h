@@ -0,0 +1,75 @@
+#ifndef PAR_H
+#define PAR_H
+
+#include "router.h"
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+// Conservative parallel engine.
+//
+// The routers are cut into 'threads' partitions of consecutive routers in the
+// layout order of the topology (so -layout hilbert gives compact ones), each
+// with the terminals of its routers.  Every partition has its own event
+// queue and statistics, and runs on its own thread.
+//
+// Partitions advance conservatively, in windows as long as the shortest link
+// between two of them (the lookahead): a flit or credit sent across a cut
+// during a window cannot arrive before the next one, so it is held on the
+// channel and handed over at the barrier that ends the window.  Each window
+// starts at the first pending event of any partition, so idle stretches are
+// skipped at once.  Nothing is ever executed speculatively or rolled back, so
+// with the default one-cycle links every busy cycle costs two barriers, and
+// only longer -link-delays leave the threads enough work between them.
+//
+// A node only reads what its channels delivered in earlier cycles and draws
+// from its own random stream, so runs give the same results as the
+// sequential engine's for any thread count.  The modules that keep global
+// state (records, traces, congestion trees, faults, traffic classes, NICs and
+// injection control) are not supported.
+
+// Flits and credits sent across a cut in the current window, by arrival.
+typedef struct ChannelLink {
+    std::vector<TimedFlit> flits;     // put by the upstream node
+    std::vector<TimedCredit> credits; // put by the downstream node
+} ChannelLink;
+
+typedef struct ParPartition {
+    ParPartition(const RandomGenerator &rg) : rand_gen(rg) {}
+
+    EventQueue eventq;
+    Stat stat;
+    RandomGenerator rand_gen;          // distributions of this thread
+    RouterConfig config;               // of the nodes in this partition
+    std::vector<Channel *> flits_in;   // cut channels into this partition
+    std::vector<Channel *> credits_in; // cut channels out of this partition
+    long event_count = 0;
+    long next = -1; // time of the next event after a window, or -1
+} ParPartition;
+
+typedef struct ParBarrier {
+    std::mutex lock;
+    std::condition_variable cv;
+    int count;
+    int waiting = 0;
+    long generation = 0;
+} ParBarrier;
+
+struct Sim;
+typedef struct ParState {
+    int threads;
+    long window;             // cycles between barriers
+    long cut_count = 0;      // channels between partitions
+    long window_count = 0;
+    std::vector<ParPartition *> parts;
+    std::vector<int> part_of; // partition of each node, by NodeIndex
+    std::vector<ChannelLink> links;
+    ParBarrier barrier;
+} ParState;
+
+ParState *par_create(Sim *sim, int threads);
+void par_run(Sim *sim, long until);
+void par_report(const ParState *ps);
+void par_destroy(Sim *sim);
+
+#endif
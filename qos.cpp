@@ -0,0 +1,165 @@
+#include "qos.h"
+#include "sim.h"
+#include "queue.h"
+#include "stats.h"
+#include <stdio.h>
+#include <assert.h>
+
+QosState *qos_create(enum QosArb arb)
+{
+    QosState *qs = new QosState;
+    qs->arb = arb;
+    return qs;
+}
+
+void qos_destroy(QosState *qs)
+{
+    delete qs;
+}
+
+// Parses "FRAC[:WEIGHT]".  The weight defaults to 1.  Returns 0 on success.
+int qos_parse_class(const char *spec, double *frac, int *weight)
+{
+    int n = 0;
+    *weight = 1;
+    if (sscanf(spec, "%lf%n", frac, &n) != 1)
+        return -1;
+    spec += n;
+    if (*spec == ':') {
+        if (sscanf(spec + 1, "%d%n", weight, &n) != 1)
+            return -1;
+        spec += 1 + n;
+    }
+    return (*spec == '\0' && *frac >= 0.0 && *weight > 0) ? 0 : -1;
+}
+
+void qos_add_class(QosState *qs, double frac, int weight)
+{
+    if (qs->class_count >= QOS_MAXCLASS)
+        fatal("qos: at most %d traffic classes\n", QOS_MAXCLASS);
+    qs->frac[qs->class_count] = frac;
+    qs->weight[qs->class_count] = weight;
+    qs->class_count++;
+}
+
+// Every traffic class needs a VC in each deadlock avoidance class, and a
+// source queue in each terminal.
+void qos_attach(Sim *sim, QosState *qs)
+{
+    const RouterConfig &cfg = sim->config;
+    int vc_per_class = cfg.vc_count / cfg.vc_class_count;
+    if (vc_per_class < qs->class_count)
+        fatal("qos: %d traffic classes need at least %d VCs (have %d)\n",
+              qs->class_count, qs->class_count * cfg.vc_class_count,
+              cfg.vc_count);
+
+    double total = 0.0;
+    for (int c = 0; c < qs->class_count; c++)
+        total += qs->frac[c];
+    if (total <= 0.0)
+        fatal("qos: no traffic in any class\n");
+    for (int c = 0; c < qs->class_count; c++)
+        qs->frac[c] /= total;
+    qs->stats.resize(qs->class_count);
+
+    for (auto &src : sim->src_nodes) {
+        while (static_cast<int>(src->source_queues.size()) < qs->class_count) {
+            Flit **q = NULL;
+            queue_init(q, SOURCE_QUEUE_LEN);
+            src->source_queues.push_back(q);
+            src->src_last_grant_output.push_back(0);
+        }
+    }
+    sim->qos = qs;
+}
+
+int qos_pick_class(const QosState *qs, NodeRng *rng)
+{
+    double u = std::generate_canonical<double, 32>(*rng);
+    for (int c = 0; c < qs->class_count - 1; c++) {
+        if (u < qs->frac[c])
+            return c;
+        u -= qs->frac[c];
+    }
+    return qs->class_count - 1;
+}
+
+// Pick the class that wins an arbitration among the classes set in
+// 'present'.  'tokens' holds the weighted round-robin state of the
+// arbitration point, QOS_MAXCLASS entries.
+int qos_select(const QosState *qs, unsigned present, int *tokens)
+{
+    assert(present != 0);
+    if (qs->arb == QOS_WEIGHTED) {
+        for (int round = 0; round < 2; round++) {
+            for (int c = 0; c < qs->class_count; c++) {
+                if ((present & (1u << c)) && tokens[c] > 0) {
+                    tokens[c]--;
+                    return c;
+                }
+            }
+            // Every requesting class used up its share: start a new round.
+            for (int c = 0; c < qs->class_count; c++)
+                tokens[c] = qs->weight[c];
+        }
+        assert(false);
+    }
+    return __builtin_ctz(present);
+}
+
+void qos_record(QosState *qs, int qclass, long latency)
+{
+    QosClassStat &st = qs->stats[qclass];
+    st.packet_arrive_count++;
+    st.latency_sum += latency;
+    hist_add(&st.latency_hist, latency);
+}
+
+static long percentile(const QosClassStat &st, double p)
+{
+    return hist_percentile(st.latency_hist, st.packet_arrive_count, p);
+}
+
+void qos_report(const QosState *qs, long cycles, long nodes)
+{
+    printf("\n");
+    printf("==== TRAFFIC CLASSES ====\n");
+    printf("Arbitration: %s\n", qs->arb == QOS_STRICT ? "strict" : "weighted");
+    printf("\n");
+
+    printf("%5s %6s %6s %10s %10s %12s %9s %6s %6s %6s %6s\n", "class",
+           "frac", "weight", "generated", "arrived", "throughput", "latency",
+           "p50", "p99", "p99.9", "max");
+    for (int c = 0; c < qs->class_count; c++) {
+        const QosClassStat &st = qs->stats[c];
+        double latency = st.packet_arrive_count > 0
+                             ? static_cast<double>(st.latency_sum) /
+                                   st.packet_arrive_count
+                             : 0.0;
+        printf("%5d %6.3lf %6d %10ld %10ld %12.4lf %9.3lf %6ld %6ld %6ld %6ld\n",
+               c, qs->frac[c], qs->weight[c], st.packet_gen_count,
+               st.packet_arrive_count,
+               st.flit_arrive_count / static_cast<double>(cycles) / nodes,
+               latency, percentile(st, 0.5), percentile(st, 0.99),
+               percentile(st, 0.999),
+               static_cast<long>(st.latency_hist.size()) - 1);
+    }
+
+    // Latency histograms, in power-of-two buckets.
+    for (int c = 0; c < qs->class_count; c++) {
+        const QosClassStat &st = qs->stats[c];
+        printf("\nClass %d latency histogram:\n", c);
+        size_t lo = 0, hi = 8;
+        while (lo < st.latency_hist.size()) {
+            long n = 0;
+            for (size_t lat = lo; lat < hi && lat < st.latency_hist.size(); lat++)
+                n += st.latency_hist[lat];
+            if (n > 0) {
+                printf("  [%6zu, %6zu) %10ld %6.2lf%%\n", lo, hi, n,
+                       100.0 * n / st.packet_arrive_count);
+            }
+            lo = hi;
+            hi *= 2;
+        }
+    }
+}
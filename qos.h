@@ -0,0 +1,72 @@
+#ifndef QOS_H
+#define QOS_H
+
+#include <vector>
+
+// Quality-of-service traffic classes.
+//
+// Each packet is assigned a traffic class at generation, with a fixed fraction
+// of the packets going to each class.  Within every deadlock avoidance VC
+// class, the VCs are split evenly among the traffic classes, so packets of
+// different traffic classes never share a buffer or compete in VC allocation.
+// They do compete for the crossbar and the links in switch allocation, and
+// for the injection channel at the source, where each class has its own
+// source queue.  There, the class is chosen first, and round-robin among the
+// requests of that class after:
+//
+// - strict: the lowest numbered class with a request always wins.
+// - weighted: weighted round-robin; in each round, class c wins up to
+//   weight[c] times before the classes with requests left are refilled.
+
+#define QOS_MAXCLASS 8
+
+enum QosArb {
+    QOS_STRICT,
+    QOS_WEIGHTED,
+};
+
+typedef struct QosClassStat {
+    long packet_gen_count = 0;
+    long packet_arrive_count = 0;
+    long flit_arrive_count = 0;
+    long latency_sum = 0;
+    std::vector<long> latency_hist; // packets by latency in cycles
+} QosClassStat;
+
+struct Sim;
+struct NodeRng;
+typedef struct QosState {
+    enum QosArb arb;
+    int class_count = 0;
+    double frac[QOS_MAXCLASS]; // fraction of generated packets
+    int weight[QOS_MAXCLASS];  // share of switch and link bandwidth
+    std::vector<QosClassStat> stats;
+} QosState;
+
+QosState *qos_create(enum QosArb arb);
+void qos_destroy(QosState *qs);
+int qos_parse_class(const char *spec, double *frac, int *weight);
+void qos_add_class(QosState *qs, double frac, int weight);
+void qos_attach(Sim *sim, QosState *qs);
+int qos_pick_class(const QosState *qs, NodeRng *rng);
+int qos_select(const QosState *qs, unsigned present, int *tokens);
+void qos_record(QosState *qs, int qclass, long latency);
+void qos_report(const QosState *qs, long cycles, long nodes);
+
+// VCs [*first, *first + *count) of each deadlock avoidance class, which has
+// 'vc_per_class' VCs, belong to traffic class 'qclass'.
+static inline void qos_vc_range(const QosState *qs, int vc_per_class,
+                                int qclass, int *first, int *count)
+{
+    if (!qs) {
+        *first = 0;
+        *count = vc_per_class;
+        return;
+    }
+    int n = vc_per_class / qs->class_count;
+    *first = qclass * n;
+    // The last class takes the remainder.
+    *count = (qclass == qs->class_count - 1) ? vc_per_class - *first : n;
+}
+
+#endif
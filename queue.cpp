@@ -5,8 +5,14 @@
 void *queue_initf(void *a, size_t elemsize, size_t len)
 {
     a = NULL; // Squelch error.
-    void *b = malloc((len + 1) * elemsize + sizeof(Queue));
-    b = (char *)b + sizeof(Queue);
+    return queue_placef(malloc(queue_bytes(elemsize, len)), len);
+}
+
+// Initialize a circular queue of 'len' elements in 'mem', which holds
+// queue_bytes() bytes.  It is not to be passed to queue_free().
+void *queue_placef(void *mem, size_t len)
+{
+    void *b = (char *)mem + sizeof(Queue);
     queue_header(b)->cap = len + 1;
     queue_header(b)->front = 0;
     queue_header(b)->back = 0;
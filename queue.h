@@ -4,6 +4,7 @@
 #include <stdlib.h>
 
 void *queue_initf(void *a, size_t elemsize, size_t len);
+void *queue_placef(void *mem, size_t len);
 #ifdef __cplusplus
 template <class T> static T *queue_init_wrapper(T *a, size_t elemsize, size_t len) {
   return (T*)queue_initf(a, elemsize, len);
@@ -35,6 +36,9 @@ typedef struct Queue {
   long back;
 } Queue;
 
+// Bytes of storage taken by a queue of 'len' elements, for queue_placef().
+#define queue_bytes(elemsize, len) (((len) + 1) * (elemsize) + sizeof(Queue))
+
 void queue_free(void *a);
 long queue_len(const void *a);
 void queue_popf(void *a);
@@ -0,0 +1,93 @@
+#include "record.h"
+#include "sim.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct RecordColumn {
+    const char *name;
+    uint32_t elem_size;
+};
+
+// Must match the order of the arrays written in recorder_flush().
+static const RecordColumn record_columns[] = {
+    {"src", sizeof(int32_t)},     {"dst", sizeof(int32_t)},
+    {"gen", sizeof(int64_t)},     {"inject", sizeof(int64_t)},
+    {"arrive", sizeof(int64_t)},  {"hops", sizeof(int16_t)},
+    {"route", sizeof(uint32_t)},  {"vc_class", sizeof(uint8_t)},
+};
+
+static void write_or_die(const void *p, size_t size, size_t n, FILE *f)
+{
+    if (fwrite(p, size, n, f) != n)
+        fatal("record: write failed\n");
+}
+
+PacketRecorder *recorder_create(const char *path)
+{
+    PacketRecorder *rec = (PacketRecorder *)calloc(1, sizeof(PacketRecorder));
+    rec->file = fopen(path, "wb");
+    if (!rec->file)
+        fatal("record: cannot open %s\n", path);
+    // Blocks are written in one go anyway; a large stdio buffer only costs
+    // an extra copy.
+    setvbuf(rec->file, NULL, _IONBF, 0);
+
+    rec->src = (int32_t *)malloc(RECORD_BLOCK_LEN * sizeof(int32_t));
+    rec->dst = (int32_t *)malloc(RECORD_BLOCK_LEN * sizeof(int32_t));
+    rec->gen = (int64_t *)malloc(RECORD_BLOCK_LEN * sizeof(int64_t));
+    rec->inject = (int64_t *)malloc(RECORD_BLOCK_LEN * sizeof(int64_t));
+    rec->arrive = (int64_t *)malloc(RECORD_BLOCK_LEN * sizeof(int64_t));
+    rec->hops = (int16_t *)malloc(RECORD_BLOCK_LEN * sizeof(int16_t));
+    rec->route = (uint32_t *)malloc(RECORD_BLOCK_LEN * sizeof(uint32_t));
+    rec->vc_class = (uint8_t *)malloc(RECORD_BLOCK_LEN * sizeof(uint8_t));
+
+    // Header.
+    uint32_t version = RECORD_VERSION;
+    uint32_t column_count = sizeof(record_columns) / sizeof(record_columns[0]);
+    write_or_die("NSPKTREC", 1, 8, rec->file);
+    write_or_die(&version, sizeof(version), 1, rec->file);
+    write_or_die(&column_count, sizeof(column_count), 1, rec->file);
+    for (uint32_t i = 0; i < column_count; i++) {
+        char name[16] = {0};
+        strncpy(name, record_columns[i].name, sizeof(name) - 1);
+        write_or_die(name, 1, sizeof(name), rec->file);
+        write_or_die(&record_columns[i].elem_size, sizeof(uint32_t), 1,
+                     rec->file);
+    }
+
+    return rec;
+}
+
+// Write out the current block.
+void recorder_flush(PacketRecorder *rec)
+{
+    if (rec->len == 0)
+        return;
+    uint32_t n = static_cast<uint32_t>(rec->len);
+    write_or_die(&n, sizeof(n), 1, rec->file);
+    write_or_die(rec->src, sizeof(int32_t), n, rec->file);
+    write_or_die(rec->dst, sizeof(int32_t), n, rec->file);
+    write_or_die(rec->gen, sizeof(int64_t), n, rec->file);
+    write_or_die(rec->inject, sizeof(int64_t), n, rec->file);
+    write_or_die(rec->arrive, sizeof(int64_t), n, rec->file);
+    write_or_die(rec->hops, sizeof(int16_t), n, rec->file);
+    write_or_die(rec->route, sizeof(uint32_t), n, rec->file);
+    write_or_die(rec->vc_class, sizeof(uint8_t), n, rec->file);
+    rec->total += rec->len;
+    rec->len = 0;
+}
+
+void recorder_destroy(PacketRecorder *rec)
+{
+    recorder_flush(rec);
+    fclose(rec->file);
+    free(rec->src);
+    free(rec->dst);
+    free(rec->gen);
+    free(rec->inject);
+    free(rec->arrive);
+    free(rec->hops);
+    free(rec->route);
+    free(rec->vc_class);
+    free(rec);
+}
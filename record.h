@@ -0,0 +1,75 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Columnar per-packet record file.
+//
+// Records are buffered one array per column and written out in blocks, so
+// that the hot path is a handful of stores and the file is written in large
+// sequential chunks.  All integers are little-endian.
+//
+//   Header:
+//     char     magic[8]       "NSPKTREC"
+//     uint32_t version        RECORD_VERSION
+//     uint32_t column_count
+//     column_count x {
+//         char     name[16]   NUL-padded column name
+//         uint32_t elem_size  size of each element in bytes
+//     }
+//   Blocks, repeated until EOF:
+//     uint32_t record_count
+//     for each column in header order:
+//         record_count x elem_size bytes
+//
+// Columns:
+//   src      int32   source terminal ID
+//   dst      int32   destination terminal ID
+//   gen      int64   cycle the head flit was generated
+//   inject   int64   cycle the head flit left the source queue
+//   arrive   int64   cycle the head flit was consumed at the destination
+//   hops     int16   number of inter-router hops
+//   route    uint32  bitmask of dimensions routed counterclockwise
+//   vc_class uint8   VC class the packet arrived on (dateline crossings)
+
+#define RECORD_VERSION 1
+// Number of records buffered before a block is written out.
+#define RECORD_BLOCK_LEN 65536
+
+typedef struct PacketRecorder {
+    FILE *file;
+    long len;   // number of records in the current block
+    long total; // number of records written so far
+    int32_t *src;
+    int32_t *dst;
+    int64_t *gen;
+    int64_t *inject;
+    int64_t *arrive;
+    int16_t *hops;
+    uint32_t *route;
+    uint8_t *vc_class;
+} PacketRecorder;
+
+PacketRecorder *recorder_create(const char *path);
+void recorder_flush(PacketRecorder *rec);
+void recorder_destroy(PacketRecorder *rec);
+
+static inline void recorder_put(PacketRecorder *rec, int src, int dst,
+                                long gen, long inject, long arrive, int hops,
+                                unsigned route, int vc_class)
+{
+    long i = rec->len;
+    rec->src[i] = src;
+    rec->dst[i] = dst;
+    rec->gen[i] = gen;
+    rec->inject[i] = inject;
+    rec->arrive[i] = arrive;
+    rec->hops[i] = static_cast<int16_t>(hops);
+    rec->route[i] = route;
+    rec->vc_class[i] = static_cast<uint8_t>(vc_class);
+    if (++rec->len == RECORD_BLOCK_LEN)
+        recorder_flush(rec);
+}
+
+#endif
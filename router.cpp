@@ -1,11 +1,16 @@
 #include "router.h"
 #include "sim.h"
 #include "queue.h"
+#include "trace.h"
+#include "fault.h"
+#include "flight.h"
+#include "stats.h"
 #include "stb_ds.h"
 #include <stdarg.h>
 #include <stdio.h>
 #include <assert.h>
 #include <random>
+#include <algorithm>
 #include <climits>
 
 TrafficDesc::TrafficDesc(int terminal_count)
@@ -14,26 +19,25 @@ TrafficDesc::TrafficDesc(int terminal_count)
 }
 
 RandomGenerator::RandomGenerator(int terminal_count, double mean_interval)
-    : def(), rd(), uni_dist(0, terminal_count - 1),
+    : def(), rng(std::random_device{}()), uni_dist(0, terminal_count - 1),
       exp_dist(1.0 / mean_interval)
 {
-    // TODO: seed?
 }
 
 template <typename T> T &Router::get_device() const
 {
     if (deterministic) {
-        return rand_gen.def;
+        return cfg->rand_gen->def;
     } else {
-        return rand_gen.rd;
+        return cfg->rand_gen->rng;
     }
 }
 
 void debugf(Router *r, const char *fmt, ...)
 {
-    if (r->verbose) {
+    if (r->cfg->verbose) {
         char s[IDSTRLEN];
-        printf("[@%3ld] [%s] ", curr_time(r->eventq), id_str(r->id, s));
+        printf("[@%3ld] [%s] ", curr_time(r->cfg->eventq), id_str(r->id, s));
         va_list args;
         va_start(args, fmt);
         vprintf(fmt, args);
@@ -44,22 +48,33 @@ void debugf(Router *r, const char *fmt, ...)
 void warnf(Router *r, const char *fmt, ...)
 {
     char s[IDSTRLEN];
-    printf("[@%3ld] [%s] ", curr_time(r->eventq), id_str(r->id, s));
+    printf("[@%3ld] [%s] ", curr_time(r->cfg->eventq), id_str(r->id, s));
     va_list args;
     va_start(args, fmt);
     vprintf(fmt, args);
     va_end(args);
 }
 
-Event tick_event_from_id(Id id)
+// The tick event type of each node type follows the order of IdType.
+Event tick_event(const Router *r)
 {
-    return (Event){id, router_tick};
+    assert(r->node >= 0);
+    return (Event){r->node, static_cast<int32_t>(EVENT_SRC_TICK + r->id.type)};
 }
 
-Channel::Channel(EventQueue *eq, long dl, const Connection conn)
-    : conn(conn), eventq(eq), delay(dl), buf_credit()
+void (*const event_table[EVENT_TYPE_COUNT])(Router *) = {
+    source_tick,
+    destination_tick,
+    router_tick,
+};
+
+Channel::Channel(EventQueue *eq, long dl, const Connection conn,
+                 Arena *arena)
+    : conn(conn), src_eventq(eq), dst_eventq(eq), delay(dl), buf_credit()
 {
-    queue_init(buf, dl + CHANNEL_SLACK);
+    // Flits leaving a router spend the extra cycles of a multi-cycle ST stage
+    // on the channel as well.
+    buf = arena_queue<TimedFlit>(arena, dl + ROUTER_ST_CYCLES + CHANNEL_SLACK);
 }
 
 Channel::~Channel()
@@ -74,30 +89,45 @@ Channel::~Channel()
         delete front.credit;
         buf_credit.pop_front();
     }
-    queue_free(buf);
 }
 
 void channel_put(Channel *ch, Flit *flit)
 {
-    TimedFlit tf = {curr_time(ch->eventq) + ch->delay, flit};
+    channel_put_delayed(ch, flit, 0);
+}
+
+// Put a flit that only enters the channel 'extra' cycles from now.
+void channel_put_delayed(Channel *ch, Flit *flit, long extra)
+{
+    TimedFlit tf = {curr_time(ch->src_eventq) + extra + ch->delay, flit};
+    if (ch->remote) {
+        // Handed over at the end of the window; see par_run().
+        ch->remote->flits.push_back(tf);
+        ch->load_count += ch->remote->flits.size();
+        return;
+    }
     assert(!queue_full(ch->buf));
     queue_put(ch->buf, tf);
-    reschedule(ch->eventq, ch->delay, tick_event_from_id(ch->conn.dst.id));
+    reschedule(ch->dst_eventq, extra + ch->delay, ch->dst_tick);
     ch->load_count += queue_len(ch->buf);
 }
 
 void channel_put_credit(Channel *ch, Credit *credit)
 {
-    TimedCredit tc = {curr_time(ch->eventq) + ch->delay, credit};
+    TimedCredit tc = {curr_time(ch->dst_eventq) + ch->delay, credit};
+    if (ch->remote) {
+        ch->remote->credits.push_back(tc);
+        return;
+    }
     ch->buf_credit.push_back(tc);
-    reschedule(ch->eventq, ch->delay, tick_event_from_id(ch->conn.src.id));
+    reschedule(ch->src_eventq, ch->delay, ch->src_tick);
 }
 
 Flit *channel_get(Channel *ch)
 {
     TimedFlit front = queue_front(ch->buf);
-    if (!queue_empty(ch->buf) && curr_time(ch->eventq) >= front.time) {
-        assert(curr_time(ch->eventq) == front.time && "stale flit!");
+    if (!queue_empty(ch->buf) && curr_time(ch->dst_eventq) >= front.time) {
+        assert(curr_time(ch->dst_eventq) == front.time && "stale flit!");
         Flit *flit = front.flit;
         queue_pop(ch->buf);
         return flit;
@@ -109,8 +139,8 @@ Flit *channel_get(Channel *ch)
 Credit *channel_get_credit(Channel *ch)
 {
     TimedCredit front = ch->buf_credit.front();
-    if (!ch->buf_credit.empty() && curr_time(ch->eventq) >= front.time) {
-        assert(curr_time(ch->eventq) == front.time && "stale flit!");
+    if (!ch->buf_credit.empty() && curr_time(ch->src_eventq) >= front.time) {
+        assert(curr_time(ch->src_eventq) == front.time && "stale flit!");
         Credit *credit = front.credit;
         ch->buf_credit.pop_front();
         return credit;
@@ -126,24 +156,6 @@ void print_conn(const char *name, Connection conn)
            conn.dst.id.value, conn.dst.port);
 }
 
-Connection conn_find_forward(Topology *t, RouterPortPair out_port)
-{
-    ptrdiff_t idx = hmgeti(t->forward_hash, out_port);
-    if (idx == -1)
-        return not_connected;
-    else
-        return t->forward_hash[idx].value;
-}
-
-Connection conn_find_reverse(Topology *t, RouterPortPair in_port)
-{
-    ptrdiff_t idx = hmgeti(t->reverse_hash, in_port);
-    if (idx == -1)
-        return not_connected;
-    else
-        return t->reverse_hash[idx].value;
-}
-
 Flit::Flit(enum FlitType t, int vc, int src, int dst, PacketId pid, long flitnum)
     : type(t), vc_num(vc), packet_id(pid), flitnum(flitnum)
 {
@@ -151,6 +163,12 @@ Flit::Flit(enum FlitType t, int vc, int src, int dst, PacketId pid, long flitnum
     route_info.dst = dst;
 }
 
+Flit::~Flit()
+{
+    // Traces of packets that never made it to the destination.
+    delete trace;
+}
+
 void flit_destroy(Flit *flit)
 {
     free(flit);
@@ -191,122 +209,105 @@ char *globalstate_str(enum GlobalState state, char *s)
     return s;
 }
 
-InputUnit::InputUnit(int vc_count, int bufsize)
+InputVC::InputVC(int bufsize, Arena *arena)
 {
-    vcs.reserve(vc_count);
-    for (int i = 0; i < vc_count; i++) {
-        vcs.emplace_back(bufsize);
-    }
+    buf = arena_queue<Flit *>(arena, bufsize * 2);
 }
 
-InputUnit::VC::VC(int bufsize)
-{
-    buf = NULL;
-    queue_init(buf, bufsize * 2);
-}
-
-InputUnit::VC::~VC()
+InputVC::~InputVC()
 {
     while (!queue_empty(buf)) {
         Flit *flit = queue_front(buf);
         delete flit;
         queue_pop(buf);
     }
-    queue_free(buf);
     if (st_ready) {
         delete st_ready;
     }
 }
 
-OutputUnit::OutputUnit(int vc_count, int bufsize)
+OutputVC::OutputVC(int bufsize) : credit_count(bufsize)
 {
-    vcs.reserve(vc_count);
-    for (int i = 0; i < vc_count; i++) {
-        vcs.emplace_back(bufsize);
-    }
 }
 
-OutputUnit::VC::VC(int bufsize) : credit_count(bufsize)
+Router::Router(const RouterConfig *cfg, Id id, int radix, Channel **in_chs,
+               Channel **out_chs)
+    : cfg(cfg), id(id), radix(radix), vc_count(cfg->vc_count),
+      ivcs(ArenaAllocator<InputVC>(cfg->arena)),
+      ovcs(ArenaAllocator<OutputVC>(cfg->arena)),
+      last_grant(3 * radix * cfg->vc_count + radix, 0,
+                 ArenaAllocator<int>(cfg->arena)),
+      qos_tokens(ArenaAllocator<int>(cfg->arena)),
+      source_queues(ArenaAllocator<Flit **>(cfg->arena)),
+      src_last_grant_output(ArenaAllocator<int>(cfg->arena))
 {
-    // buf_credit = NULL;
-    // queue_init(buf_credit, bufsize * 2); // FIXME: unnecessarily big.
-}
-
-OutputUnit::VC::~VC()
-{
-    // queue_free(buf_credit);
-}
-
-Router::Router(Sim &sim, EventQueue *eq, Stat *st, bool verbose, Id id,
-               int radix, int vc_count, TopoDesc td, TrafficDesc trd,
-               RandomGenerator &rg, long packet_len, Channel **in_chs,
-               Channel **out_chs, long input_buf_size)
-    : sim(sim), eventq(eq), stat(st), verbose(verbose), id(id), radix(radix),
-      vc_count(vc_count), top_desc(td), traffic_desc(trd), rand_gen(rg),
-      packet_len(packet_len), input_buf_size(input_buf_size),
-      src_last_grant_output(0), dst_last_grant_input(0),
-      va_last_grant_input(radix * vc_count, 0),
-      va_last_grant_output(radix * vc_count, 0),
-      sa_last_grant_input(radix * vc_count, 0), sa_last_grant_output(radix, 0)
-{
-    // Can only segregate VCs into classes if we do have multiple VCs.
-    vc_class_count = (vc_count > 1) ? 2 : 1;
+    int total_vc = radix * vc_count;
+    va_last_grant_input = &last_grant[0];
+    va_last_grant_output = &last_grant[total_vc];
+    sa_last_grant_input = &last_grant[2 * total_vc];
+    sa_last_grant_output = &last_grant[3 * total_vc];
 
     // Copy channel list
-    input_channels = NULL;
-    output_channels = NULL;
-    for (long i = 0; i < arrlen(in_chs); i++)
-        arrput(input_channels, in_chs[i]);
-    for (long i = 0; i < arrlen(out_chs); i++)
-        arrput(output_channels, out_chs[i]);
+    input_count = static_cast<int>(arrlen(in_chs));
+    output_count = static_cast<int>(arrlen(out_chs));
+    input_channels = static_cast<Channel **>(arena_alloc(
+        cfg->arena, input_count * sizeof(Channel *), alignof(Channel *)));
+    output_channels = static_cast<Channel **>(arena_alloc(
+        cfg->arena, output_count * sizeof(Channel *), alignof(Channel *)));
+    std::copy(in_chs, in_chs + input_count, input_channels);
+    std::copy(out_chs, out_chs + output_count, output_channels);
 
     // Source queues are supposed to be infinite in size, but since our
     // queue implementation does not support dynamic extension, let's just
     // assume a fixed, arbitrary massive size for its queue. Nonurgent TODO.
-    source_queue = NULL;
+    // Traffic classes beyond the first are added by qos_attach().  They stay
+    // out of the arena: they are large and mostly untouched, and would only
+    // spread the state that is.
     if (is_src(id)) {
-        queue_init(source_queue, 10000);
+        Flit **q = NULL;
+        queue_init(q, SOURCE_QUEUE_LEN);
+        source_queues.push_back(q);
+        src_last_grant_output.push_back(0);
     }
-
-    input_units.reserve(radix);
-    output_units.reserve(radix);
-    for (int port = 0; port < radix; port++) {
-        input_units.emplace_back(vc_count, input_buf_size);
-        output_units.emplace_back(vc_count, input_buf_size);
+    qos_tokens.assign(radix * QOS_MAXCLASS, 0);
+
+    // Reserve first: the VCs own their buffers and must not be copied.
+    ivcs.reserve(total_vc);
+    ovcs.reserve(total_vc);
+    for (int i = 0; i < total_vc; i++) {
+        ivcs.emplace_back(cfg->input_buf_size, cfg->arena);
+        ovcs.emplace_back(cfg->input_buf_size);
     }
 
     if (is_src(id) || is_dst(id)) {
-        assert(input_units.size() == 1);
-        assert(output_units.size() == 1);
+        assert(radix == 1);
         // There are no route computation stages for terminal nodes, so set the
         // routed ports and allocated VCs for each IU/OU statically here.
         for (int i = 0; i < vc_count; i++) {
-            input_units[0].vcs[i].route_port = TERMINAL_PORT;
-            input_units[0].vcs[i].output_vc = 0; // unnecessary?
-            output_units[0].vcs[i].input_port = TERMINAL_PORT;
-            output_units[0].vcs[i].input_vc = 0; // unnnecessary
+            ivc(TERMINAL_PORT, i).route_port = TERMINAL_PORT;
+            ivc(TERMINAL_PORT, i).output_vc = 0; // unnecessary?
+            ovc(TERMINAL_PORT, i).input_port = TERMINAL_PORT;
+            ovc(TERMINAL_PORT, i).input_vc = 0; // unnnecessary
         }
     }
 }
 
 Router::~Router()
 {
-    if (source_queue) {
-        while (!queue_empty(source_queue)) {
-            Flit *flit = queue_front(source_queue);
+    for (Flit **q : source_queues) {
+        while (!queue_empty(q)) {
+            Flit *flit = queue_front(q);
             delete flit;
-            queue_pop(source_queue);
+            queue_pop(q);
         }
-        queue_free(source_queue);
+        queue_free(q);
     }
-    arrfree(input_channels);
-    arrfree(output_channels);
 }
 
 void router_reschedule(Router *r)
 {
     if (r->reschedule_next_tick) {
-        reschedule(r->eventq, 1, tick_event_from_id(r->id));
+        reschedule(r->cfg->eventq, 1, tick_event(r));
     }
 }
 
@@ -314,24 +315,28 @@ void router_reschedule(Router *r)
 // Expects that src_id and dst_id is on the same ring.
 // Appends computed route after 'path'. Does NOT put the final routing to the
 // terminal node.
-static void source_route_compute_dimension(Router *r, TopoDesc td,
+static void source_route_compute_dimension(Router *r, const Topology *top,
                                            int src_id, int dst_id,
                                            int direction,
-                                           std::vector<int> &path)
+                                           std::vector<int> &path,
+                                           unsigned *ccw_dims)
 {
-    int total = td.k;
-    int src_id_xyz = torus_id_xyz_get(src_id, td.k, direction);
-    int dst_id_xyz = torus_id_xyz_get(dst_id, td.k, direction);
+    int total = top->desc.k[direction];
+    int src_id_xyz = topo_coord(top, src_id, direction);
+    int dst_id_xyz = topo_coord(top, dst_id, direction);
     int cw_dist = (dst_id_xyz - src_id_xyz + total) % total;
 
     if ((total % 2) == 0 && cw_dist == (total / 2)) {
-        int dice = r->rand_gen.uni_dist(r->rand_gen.rd);
-        int to_larger = (dice % 2 == 0) ? 1 : 0;
+        int to_larger = 1;
+        if (r) {
+            int dice = r->cfg->rand_gen->uni_dist(r->rng);
+            to_larger = (dice % 2 == 0) ? 1 : 0;
+        }
 
         // Adaptive routing
 
         // int first_hop_id = r->output_channels[TERMINAL_PORT]->conn.dst.id.value;
-        // Router *first_hop = r->sim.routers[first_hop_id].get();
+        // Router *first_hop = r->cfg->sim->routers[first_hop_id].get();
         // int credit_for_larger =
         //     first_hop->output_units[get_output_port(direction, 1)].credit_count;
         // int credit_for_smaller =
@@ -349,6 +354,9 @@ static void source_route_compute_dimension(Router *r, TopoDesc td,
         // FIXME VC vs. Wormhole
         // to_larger = 1;
 
+        if (!to_larger) {
+            *ccw_dims |= (1u << direction);
+        }
         for (int i = 0; i < cw_dist; i++) {
             path.push_back(get_output_port(direction, to_larger));
         }
@@ -360,6 +368,7 @@ static void source_route_compute_dimension(Router *r, TopoDesc td,
     } else {
         // Counterclockwise
         // TODO: if CW == CCW, pick random
+        *ccw_dims |= (1u << direction);
         for (int i = 0; i < total - cw_dist; i++) {
             path.push_back(get_output_port(direction, 0));
         }
@@ -367,273 +376,538 @@ static void source_route_compute_dimension(Router *r, TopoDesc td,
 }
 
 // Source-side all-in-one route computation.
-// Returns an stb array containing the series of routed output ports.
-std::vector<int> source_route_compute(Router *r, TopoDesc td, int src_id, int dst_id)
+// Returns the series of routed output ports, and marks the dimensions that
+// were routed counterclockwise in 'ccw_dims'.  Ties on even rings are broken
+// randomly with the generator of 'r', or clockwise if 'r' is NULL.
+std::vector<int> source_route_compute(Router *r, const Topology *top,
+                                      int src_id, int dst_id,
+                                      unsigned *ccw_dims)
 {
     std::vector<int> path{};
+    *ccw_dims = 0;
+    const TopoDesc *td = &top->desc;
+    int dst_rtr = dst_id / td->concentration;
 
     // Dimension-order routing. Order is XYZ.
-    int last_src_id = src_id;
-    for (int dir = 0; dir < td.r; dir++) {
-        int interim_id = torus_align_id(td.k, last_src_id, dst_id, dir);
+    int last_src_id = src_id / td->concentration;
+    for (int dir = 0; dir < td->r; dir++) {
+        int interim_id = torus_align_id(top, last_src_id, dst_rtr, dir);
         // printf("%s: from %d to %d\n", __func__, last_src_id, interim_id);
-        source_route_compute_dimension(r, td, last_src_id, interim_id, dir, path);
+        if (!topo_is_hyperx(td)) {
+            source_route_compute_dimension(r, top, last_src_id, interim_id,
+                                           dir, path, ccw_dims);
+        } else if (interim_id != last_src_id) {
+            // A single hop.  Parallel links are spread over the
+            // source-destination pairs.
+            path.push_back(hyperx_port(td, topo_coord(top, last_src_id, dir),
+                                       dir, topo_coord(top, dst_rtr, dir),
+                                       (src_id + dst_id) % td->mult[dir]));
+        }
         last_src_id = interim_id;
     }
     // Enter the final destination node.
-    path.push_back(TERMINAL_PORT);
+    path.push_back(dst_id % td->concentration);
 
     return path;
 }
 
-// Tick a router. This function does all of the work that a router has to
-// process in a single cycle, i.e. all pipeline stages and statistics update.
-// This simplifies the event system by streamlining event types into a single
-// one, the 'tick event', and letting us to only have to consider the
-// chronological order between them.
-void router_tick(Router *r)
+// Stage functions, by PipelineStage.  The buffer write comes first.
+typedef void (*StageFn)(Router *);
+static constexpr StageFn pipeline_fns[PIPELINE_STAGE_COUNT] = {
+    fetch_flit, route_compute, vc_alloc, switch_alloc, switch_traverse,
+};
+
+// First stage of the group of merged stages that ends with 'last': a
+// zero-cycle stage belongs to the group of the stage before it.
+static constexpr int pipeline_group_begin(int last)
 {
-    // Make sure this router has not been already ticked in this cycle.
-    if (curr_time(r->eventq) == r->last_tick) {
-        // debugf(r, "WARN: double tick! curr_time=%ld, last_tick=%ld\n",
-        //        curr_time(r->eventq), r->last_tick);
-        r->stat->double_tick_count++;
-        return;
+    while (last > 0 && pipeline_cycles[last] == 0)
+        last--;
+    return last;
+}
+
+// Process stages [Begin, End) in pipeline order.
+template <int Begin, int End> struct PipelineRun {
+    static void run(Router *r)
+    {
+        pipeline_fns[Begin](r);
+        PipelineRun<Begin + 1, End>::run(r);
     }
+};
+template <int End> struct PipelineRun<End, End> {
+    static void run(Router *r) {}
+};
+
+// Process the stages [0, End), one group of merged stages at a time, from
+// the last group to the first.  Within a group the stages go in pipeline
+// order, so that a flit can pass through all of them in the same cycle.
+// Everything is resolved at compile time.
+template <int End> struct PipelineGroups {
+    static constexpr int begin = pipeline_group_begin(End - 1);
+    static void run(Router *r)
+    {
+        PipelineRun<begin, End>::run(r);
+        PipelineGroups<begin>::run(r);
+    }
+};
+template <> struct PipelineGroups<0> {
+    static void run(Router *r) {}
+};
+
+// Move an input VC into 'stage', in 'state'.  The stage normally starts
+// processing on the next tick, but a zero-cycle stage runs later in this same
+// tick, so its state takes effect right away.
+static void ivc_enter(Router *r, InputVC &ivc, enum PipelineStage stage,
+                      enum GlobalState state)
+{
+    ivc.next_global = state;
+    ivc.stage = stage;
+    if (pipeline_cycles[stage] == 0)
+        ivc.global = state;
+    if (pipeline_multicycle)
+        ivc.ready = curr_time(r->cfg->eventq) + pipeline_cycles[stage];
+}
 
-    r->reschedule_next_tick = false;
+// Whether an input VC is still busy in a multi-cycle stage.
+static bool ivc_busy(Router *r, const InputVC &ivc)
+{
+    if (!pipeline_multicycle || curr_time(r->cfg->eventq) >= ivc.ready)
+        return false;
+    r->reschedule_next_tick = true;
+    return true;
+}
 
-    // Different tick actions for different types of node.
-    if (is_src(r->id)) {
-        source_generate(r);
-        // Source nodes also needs to manage credit in order to send flits at
-        // the right time.
-        credit_update(r);
-        fetch_credit(r);
-    } else if (is_dst(r->id)) {
-        destination_consume(r);
-        fetch_flit(r);
-    } else {
-        // Process each pipeline stage.
-        // Stages are processed in reverse dependency order to prevent coherence
-        // bug.  E.g., if a flit succeeds in route_compute() and advances to the
-        // VA stage, and then vc_alloc() is called, it would then get processed
-        // again in the same cycle.
-        switch_traverse(r);
-        switch_alloc(r);
-        vc_alloc(r);
-        route_compute(r);
-        credit_update(r);
-        fetch_credit(r);
-        fetch_flit(r);
-
-        // Self-tick autonomously unless all input ports are empty.
-        // FIXME: redundant?
-        // int empty = 1;
-        // for (int i = 0; i < radix; i++) {
-        //     if (!input_units[i].buf.empty()) {
-        //         empty = 0;
-        //         break;
-        //     }
-        // }
-        // if (!empty) {
-        //     reschedule_next_tick = 1;
-        // }
+// Common start of a tick.  Returns false if the node has already been ticked
+// in this cycle.
+static bool tick_begin(Router *r)
+{
+    // Make sure this router has not been already ticked in this cycle.
+    if (curr_time(r->cfg->eventq) == r->last_tick) {
+        // debugf(r, "WARN: double tick! curr_time=%ld, last_tick=%ld\n",
+        //        curr_time(r->cfg->eventq), r->last_tick);
+        r->cfg->stat->double_tick_count++;
+        return false;
     }
+    r->reschedule_next_tick = false;
+    return true;
+}
 
+static void tick_end(Router *r)
+{
     // Update the global state of each input/output unit.
     update_states(r);
 
     // Do the rescheduling at here once to prevent flooding the event queue.
     router_reschedule(r);
 
-    r->last_tick = curr_time(r->eventq);
+    r->last_tick = curr_time(r->cfg->eventq);
+}
+
+// Tick a node. These functions do all of the work that a node has to process
+// in a single cycle, i.e. all pipeline stages and statistics update.  This
+// simplifies the event system by streamlining event types into a single one
+// per node type, the 'tick event', and letting us to only have to consider
+// the chronological order between them.
+void source_tick(Router *r)
+{
+    if (!tick_begin(r))
+        return;
+    source_generate(r);
+    // Source nodes also needs to manage credit in order to send flits at the
+    // right time.
+    credit_update(r);
+    fetch_credit(r);
+    tick_end(r);
+}
+
+void destination_tick(Router *r)
+{
+    if (!tick_begin(r))
+        return;
+    destination_consume(r);
+    fetch_flit(r);
+    tick_end(r);
+}
+
+void router_tick(Router *r)
+{
+    if (!tick_begin(r))
+        return;
+
+    // Process each pipeline stage.
+    // Stages are processed in reverse dependency order to prevent coherence
+    // bug.  E.g., if a flit succeeds in route_compute() and advances to the VA
+    // stage, and then vc_alloc() is called, it would then get processed again
+    // in the same cycle.  Zero-cycle stages are the exception, see
+    // PipelineGroups.
+    PipelineGroups<PIPELINE_STAGE_COUNT>::run(r);
+    credit_update(r);
+    fetch_credit(r);
+
+    tick_end(r);
 }
 
 ///
 /// Pipeline stages
 ///
 
+// Pick the destination of a new packet according to the traffic pattern.
+static int source_pick_dest(Router *r)
+{
+    FaultState *faults = r->cfg->sim->faults;
+    int dest = -1;
+    if (r->cfg->traffic_desc.type == TRF_HOTSPOT &&
+        r->id.value != r->cfg->traffic_desc.hotspot &&
+        std::generate_canonical<double, 32>(r->rng) <
+            r->cfg->traffic_desc.hotspot_frac) {
+        dest = r->cfg->traffic_desc.hotspot;
+        debugf(r, "Hotspot: dest=%d\n", dest);
+    } else if (r->cfg->traffic_desc.type == TRF_UNIFORM_RANDOM ||
+               r->cfg->traffic_desc.type == TRF_HOTSPOT) {
+        while (true) {
+            dest = r->cfg->rand_gen->uni_dist(r->rng);
+            // Retry until an ID different than mine, and not behind a failed
+            // router, comes up.
+            if (dest != r->id.value &&
+                !(faults && fault_router_down(faults, dest))) {
+                break;
+            }
+        }
+        debugf(r, "Uniform random: dest=%ld\n", dest);
+    } else if (r->cfg->traffic_desc.type == TRF_DESIGNATED) {
+        dest = r->cfg->traffic_desc.dests[r->id.value];
+    } else if (r->cfg->traffic_desc.type == TRF_MATRIX) {
+        const TrafficDesc &td = r->cfg->traffic_desc;
+        const double *begin = td.comm_cdf.data() + td.comm_begin[r->id.value];
+        const double *end = td.comm_cdf.data() + td.comm_begin[r->id.value + 1];
+        assert(begin < end && "Source without destinations!");
+        double u = std::generate_canonical<double, 32>(r->rng) *
+                   end[-1];
+        const double *pos = std::min(std::upper_bound(begin, end, u), end - 1);
+        dest = td.comm_dest[pos - td.comm_cdf.data()];
+        debugf(r, "Matrix: dest=%d\n", dest);
+    } else {
+        assert(false);
+    }
+    return dest;
+}
+
+// Output VC the front flit of the source queue of traffic class 'qclass' can
+// be sent on, or -1 if it has to wait for credits.
+static int source_ready_vc(Router *r, int qclass)
+{
+    Flit **q = r->source_queues[qclass];
+    if (queue_empty(q))
+        return -1;
+    int last = r->src_last_grant_output[qclass];
+    if (queue_front(q)->type != FLIT_HEAD) {
+        // Body flits follow their head.
+        return (r->ovc(TERMINAL_PORT, last).credit_count > 0) ? last : -1;
+    }
+
+    // Deadlock avoidance with datelines: always start at the VCs with class 0.
+    // Round-robin VC arbitration among the VCs of the traffic class, selecting
+    // the first one that has credits.
+    int vc_per_class = r->vc_count / r->cfg->vc_class_count;
+    int first, count;
+    qos_vc_range(r->cfg->sim->qos, vc_per_class, qclass, &first, &count);
+    // Without traffic classes, look at as many VCs as there are VC classes,
+    // as sources always have.
+    int tries = r->cfg->sim->qos ? count : r->cfg->vc_class_count;
+    for (int i = 1; i <= tries; i++) {
+        int ovc_num = first + ((last - first + i) % count + count) % count;
+        if (r->ovc(TERMINAL_PORT, ovc_num).credit_count > 0) {
+            // Injection control only holds back new packets.
+            CcState *cc = r->cfg->sim->cc;
+            if (cc && !cc_may_inject(cc, r->id.value, curr_time(r->cfg->eventq)))
+                return -1;
+            return ovc_num;
+        }
+    }
+    return -1;
+}
+
+// Set the time the next packet (or NIC message) is generated.
+static void source_schedule_next(Router *r)
+{
+    // Fixed interval:
+    // r->sg.next_packet_start = r->cfg->eventq->curr_time() + r->cfg->packet_len;
+    //
+    // Poisson process:
+    double gap;
+    if (r->cfg->traffic_desc.type == TRF_MATRIX) {
+        // Each source at its own rate.
+        double interval = r->cfg->traffic_desc.comm_interval[r->id.value];
+        gap = std::exponential_distribution<>(1.0 / interval)(r->rng);
+    } else {
+        gap = r->cfg->rand_gen->exp_dist(r->rng);
+    }
+    double next_packet_start_frac =
+        static_cast<double>(r->cfg->eventq->curr_time()) +
+        static_cast<double>(r->cfg->packet_len) + gap;
+    r->sg.next_packet_start = std::lround(next_packet_start_frac);
+    // debugf(r, "scheduling at %ld\n", r->sg.next_packet_start);
+    schedule(r->cfg->eventq, r->sg.next_packet_start, tick_event(r));
+}
+
 void source_generate(Router *r)
 {
+    FaultState *faults = r->cfg->sim->faults;
+    NicState *nic = r->cfg->sim->nic;
+    // The terminal of a failed router stops generating new packets.
+    bool new_packet = r->cfg->eventq->curr_time() >= r->sg.next_packet_start &&
+                      !(faults && fault_router_down(faults, r->id.value));
+    bool retry_pending = faults && !faults->retry[r->id.value].empty();
+
+    QosState *qos = r->cfg->sim->qos;
+    CcState *cc = r->cfg->sim->cc;
+    if (cc) {
+        cc_poll(cc, r->id.value, curr_time(r->cfg->eventq));
+    }
+
+    // With a NIC, the workload generates messages, and packets come from the
+    // NIC's send queue.
+    if (nic) {
+        if (new_packet) {
+            nic_message_arrive(nic, r->id.value, source_pick_dest(r),
+                               curr_time(r->cfg->eventq));
+            source_schedule_next(r);
+        }
+        new_packet = r->sg.packet_finished && nic_has_packet(nic, r->id.value);
+    }
+
     // Before entering the source queue.
-    if (!queue_full(r->source_queue) &&
-        (r->eventq->curr_time() >= r->sg.next_packet_start ||
-         !r->sg.packet_finished)) {
+    if (!queue_full(r->source_queues[r->sg.cur_qos_class]) &&
+        (new_packet || retry_pending || !r->sg.packet_finished)) {
 
         //
         // Flit generation.
         //
 
-        int dest = -1;
-        if (r->traffic_desc.type == TRF_UNIFORM_RANDOM) {
-            while (true) {
-                dest = r->rand_gen.uni_dist(r->rand_gen.rd);
-                // Retry until an ID different than mine comes up.
-                if (dest != r->id.value) {
-                    break;
-                }
-            }
-            debugf(r, "Uniform random: dest=%ld\n", dest);
-        } else if (r->traffic_desc.type == TRF_DESIGNATED) {
-            dest = r->traffic_desc.dests[r->id.value];
-        } else {
-            assert(false);
-        }
-
-        PacketId packet_id{r->id.value, r->sg.packet_counter};
-        Flit *flit = new Flit{FLIT_BODY, 0, r->id.value, dest,
-                        packet_id, r->sg.flitnum};
+        Flit *flit = NULL;
 
         if (r->sg.packet_finished) {
             // Head flit
             //
-            if (r->eventq->curr_time() != r->sg.next_packet_start) {
-                debugf(r,
-                       "WARN: Head flit not generated at the scheduled "
-                       "time=%ld!\n",
-                       r->sg.next_packet_start);
+            // Packets dropped in the network are retransmitted first, with
+            // their original ID.
+            RetryPacket rp;
+            r->sg.cur_retry = retry_pending &&
+                              fault_retry_pop(faults, r->id.value, &rp);
+            if (r->sg.cur_retry) {
+                r->sg.cur_dest = rp.dst;
+                r->sg.cur_packet_id = rp.packet_id;
+                r->sg.cur_qos_class = rp.qos_class;
+                r->sg.cur_len = r->cfg->packet_len;
+                debugf(r, "Retransmission: dest=%d\n", rp.dst);
+            } else if (nic) {
+                NicPacket p;
+                nic_next_packet(nic, r->id.value, curr_time(r->cfg->eventq), &p);
+                r->sg.cur_dest = p.dst;
+                r->sg.cur_len = p.len;
+                r->sg.cur_msg_id = p.msg_id;
+            } else {
+                if (r->cfg->eventq->curr_time() != r->sg.next_packet_start) {
+                    debugf(r,
+                           "WARN: Head flit not generated at the scheduled "
+                           "time=%ld!\n",
+                           r->sg.next_packet_start);
+                }
+                r->sg.cur_dest = source_pick_dest(r);
+                r->sg.cur_len = r->cfg->packet_len;
+                source_schedule_next(r);
             }
+            if (!r->sg.cur_retry) {
+                r->sg.cur_packet_id = PacketId{r->id.value, r->sg.packet_counter};
+                r->sg.packet_counter++;
+                r->cfg->stat->packet_gen_count++;
+                if (qos) {
+                    r->sg.cur_qos_class = qos_pick_class(qos, &r->rng);
+                    qos->stats[r->sg.cur_qos_class].packet_gen_count++;
+                }
+
+                // Record packet generation time.
+                PacketTimestamp ts{.gen = r->cfg->eventq->curr_time(), .arr = -1};
+                if (r->cfg->ledger) {
+                    auto result = r->cfg->stat->packet_ledger.insert(
+                        {r->sg.cur_packet_id, ts});
+                    assert(result.second);
+                }
+            }
+
+            flit = new Flit{FLIT_HEAD, 0, r->id.value, r->sg.cur_dest,
+                            r->sg.cur_packet_id, 0};
+            // Retransmissions keep the generation time in the ledger.
+            if (!r->sg.cur_retry)
+                flit->gen_time = r->cfg->eventq->curr_time();
+            flit->qos_class = r->sg.cur_qos_class;
+            flit->msg_id = r->sg.cur_msg_id;
 
             //
             // Source-side route computation.
             //
 
-            flit->type = FLIT_HEAD;
             flit->route_info.path = source_route_compute(
-                r, r->top_desc, flit->route_info.src, flit->route_info.dst);
+                r, r->cfg->topology, flit->route_info.src, flit->route_info.dst,
+                &flit->route_info.ccw_dims);
             assert(flit->route_info.path.size() > 0);
 
-            // Hop count: exclude the last hop to terminal.
-            r->stat->hop_count_sum += (flit->route_info.path.size() - 1);
-            r->stat->packet_gen_count++;
-
-            if (r->verbose) {
-                debugf(r, "Source route computation: %d -> %d : {",
-                       flit->route_info.src, flit->route_info.dst);
-                for (size_t i = 0; i < flit->route_info.path.size(); i++) {
-                    printf("%d,", flit->route_info.path[i]);
+            if (faults && !fault_route(r->cfg->sim, flit->route_info.src,
+                                       flit->route_info.dst, &flit->route_info)) {
+                debugf(r, "Unroutable: dest=%d\n", flit->route_info.dst);
+                faults->unroutable++;
+                r->cfg->stat->packet_ledger.erase(flit->packet_id);
+                delete flit;
+                flit = NULL;
+            } else {
+                if (!r->sg.cur_retry) {
+                    // Hop count: exclude the last hop to terminal.
+                    r->cfg->stat->hop_count_sum += (flit->route_info.path.size() - 1);
+
+                    if (r->cfg->sim->tracer) {
+                        flit->trace = tracer_sample(
+                            r->cfg->sim->tracer, flit->route_info.src,
+                            flit->route_info.dst, flit->packet_id.id,
+                            curr_time(r->cfg->eventq));
+                    }
                 }
-                printf("}\n");
-            }
 
-            r->sg.flitnum++;
+                if (r->cfg->verbose) {
+                    debugf(r, "Source route computation: %d -> %d : {",
+                           flit->route_info.src, flit->route_info.dst);
+                    for (size_t i = 0; i < flit->route_info.path.size(); i++) {
+                        printf("%d,", flit->route_info.path[i]);
+                    }
+                    printf("}\n");
+                }
 
-            // Set the time the next packet is generated.
-            //
-            // Fixed interval:
-            // r->sg.next_packet_start = r->eventq->curr_time() + r->packet_len;
-            //
-            // Poisson process:
-            double next_packet_start_frac =
-                static_cast<double>(r->eventq->curr_time()) +
-                static_cast<double>(r->packet_len) +
-                r->rand_gen.exp_dist(r->rand_gen.rd);
-            r->sg.next_packet_start = std::lround(next_packet_start_frac);
-            // if (r->sg.next_packet_start < r->eventq->curr_time() + r->packet_len) {
-            //     printf("nah\n");
-            //     r->sg.next_packet_start = r->eventq->curr_time() + r->packet_len;
-            // }
-            // debugf(r, "scheduling at %ld\n", r->sg.next_packet_start);
-            schedule(r->eventq, r->sg.next_packet_start,
-                     tick_event_from_id(r->id));
-
-            // Record packet generation time.
-            PacketTimestamp ts{.gen = r->eventq->curr_time(), .arr = -1};
-            auto result = r->stat->packet_ledger.insert({flit->packet_id, ts});
-            assert(result.second);
-
-            r->sg.packet_finished = false;
-        } else if (r->sg.flitnum == r->packet_len - 1) {
-            // Tail flit
-            flit->type = FLIT_TAIL;
-            r->sg.flitnum = 0;
-            r->sg.packet_finished = true;
-            r->sg.packet_counter++;
+                r->sg.flitnum = 1;
+                r->sg.packet_finished = false;
+            }
         } else {
-            // Body flit
-            r->sg.flitnum++;
+            flit = new Flit{FLIT_BODY, 0, r->id.value, r->sg.cur_dest,
+                            r->sg.cur_packet_id, r->sg.flitnum};
+            flit->qos_class = r->sg.cur_qos_class;
+            flit->msg_id = r->sg.cur_msg_id;
+            if (r->sg.flitnum == r->sg.cur_len - 1) {
+                // Tail flit
+                flit->type = FLIT_TAIL;
+                r->sg.flitnum = 0;
+                r->sg.packet_finished = true;
+            } else {
+                // Body flit
+                r->sg.flitnum++;
+            }
         }
 
-        if (!r->sg.packet_finished) {
+        if (!r->sg.packet_finished ||
+            (faults && !faults->retry[r->id.value].empty()) ||
+            (nic && nic_has_packet(nic, r->id.value))) {
             r->reschedule_next_tick = true;
         }
 
-        queue_put(r->source_queue, flit);
+        if (flit) {
+            Flit **q = r->source_queues[flit->qos_class];
+            queue_put(q, flit);
+            flight_record(r, FLIGHT_GEN, 0, 0, flit, flit->qos_class);
 
-        char s[IDSTRLEN];
-        debugf(r, "Flit generated: %s\n", flit_str(flit, s));
-        debugf(r, "Source queue len=%ld\n", queue_len(r->source_queue));
-    } else if (queue_full(r->source_queue)) {
+            char s[IDSTRLEN];
+            debugf(r, "Flit generated: %s\n", flit_str(flit, s));
+            debugf(r, "Source queue len=%ld\n", queue_len(q));
+        }
+    } else if (queue_full(r->source_queues[r->sg.cur_qos_class])) {
         debugf(r, "WARN: source queue full!\n");
     }
 
-    // After exiting the source queue.
-    if (!queue_empty(r->source_queue)) {
-        Flit *ready_flit = queue_front(r->source_queue);
-
-        int ovc_num = r->src_last_grant_output;
+    // After exiting the source queues.
+    int ready_vc[QOS_MAXCLASS];
+    unsigned ready = 0, waiting = 0;
+    for (size_t c = 0; c < r->source_queues.size(); c++) {
+        ready_vc[c] = source_ready_vc(r, static_cast<int>(c));
+        if (ready_vc[c] >= 0) {
+            ready |= (1u << c);
+        } else if (!queue_empty(r->source_queues[c])) {
+            waiting |= (1u << c);
+        }
+    }
+    if (ready) {
+        int qclass = qos ? qos_select(qos, ready, &r->qos_tokens[0]) : 0;
+        Flit **q = r->source_queues[qclass];
+        Flit *ready_flit = queue_front(q);
+        int ovc_num = ready_vc[qclass];
+        r->src_last_grant_output[qclass] = ovc_num;
+
+        OutputVC &ovc = r->ovc(TERMINAL_PORT, ovc_num);
+        queue_pop(q);
+        // Make sure to mark the VC number in the flit.
+        ready_flit->vc_num = ovc_num;
         if (ready_flit->type == FLIT_HEAD) {
-            // Deadlock avoidance with datelines: always start at the VCs with
-            // class 0.
-            const int ovc_class = 0; /* always */
-
-            // Round-robin VC arbitration
-            int vc_per_class = (r->vc_count / r->vc_class_count);
-            int ovc_in_class = (r->src_last_grant_output + 1) % vc_per_class;
-            for (int i = 0; i < r->vc_class_count; i++) {
-                ovc_num = ovc_class * vc_per_class + ovc_in_class;
-                OutputUnit::VC &ovc = r->output_units[TERMINAL_PORT].vcs[ovc_num];
-                // Select the first one that has credits.
-                if (ovc.credit_count > 0) {
-                    r->src_last_grant_output = ovc_num;
-                    break;
-                }
-                ovc_in_class = (ovc_in_class + 1) % vc_per_class;
+            if (cc) {
+                cc_inject(cc, r->id.value);
+            }
+            ready_flit->inject_time = curr_time(r->cfg->eventq);
+            if (ready_flit->trace) {
+                ready_flit->trace->inject = curr_time(r->cfg->eventq);
             }
         }
-
-        OutputUnit::VC &ovc = r->output_units[TERMINAL_PORT].vcs[ovc_num];
-        if (ovc.credit_count > 0) {
-            queue_pop(r->source_queue);
-            // Make sure to mark the VC number in the flit.
-            ready_flit->vc_num = ovc_num;
-            Channel *och = r->output_channels[TERMINAL_PORT];
-            channel_put(och, ready_flit);
-
-            debugf(r, "Source credit decrement, credit=%d->%d\n",
-                   ovc.credit_count, ovc.credit_count - 1);
-            ovc.credit_count--;
-            assert(ovc.credit_count >= 0);
-
-            r->flit_depart_count++;
-
-            char s[IDSTRLEN], s2[IDSTRLEN];
-            auto dst_pair = och->conn.dst;
-            debugf(r, "Flit sent via VC%d: %s, to {%s, %d}\n", ovc_num,
-                   flit_str(ready_flit, s), id_str(dst_pair.id, s2),
-                   dst_pair.port);
-
-            // Infinitely generate flits.
-            // TODO: Set and control generation rate.
-            r->reschedule_next_tick = 1;
-        } else {
-            debugf(r, "Credit stall!\n");
+        Channel *och = r->output_channels[TERMINAL_PORT];
+        channel_put(och, ready_flit);
+
+        debugf(r, "Source credit decrement, credit=%d->%d\n",
+               ovc.credit_count, ovc.credit_count - 1);
+        ovc.credit_count--;
+        flight_record(r, FLIGHT_INJECT, TERMINAL_PORT, ovc_num, ready_flit,
+                      ovc.credit_count);
+        assert(ovc.credit_count >= 0);
+
+        r->flit_depart_count++;
+
+        char s[IDSTRLEN], s2[IDSTRLEN];
+        auto dst_pair = och->conn.dst;
+        debugf(r, "Flit sent via VC%d: %s, to {%s, %d}\n", ovc_num,
+               flit_str(ready_flit, s), id_str(dst_pair.id, s2),
+               dst_pair.port);
+
+        // Infinitely generate flits.
+        // TODO: Set and control generation rate.
+        r->reschedule_next_tick = 1;
+    } else if (waiting) {
+        debugf(r, "Credit stall!\n");
+        if (cc) {
+            long t = cc_wake_time(cc, r->id.value, curr_time(r->cfg->eventq));
+            if (t >= 0) {
+                schedule(r->cfg->eventq, t, tick_event(r));
+            }
         }
     }
 }
 
+// Count a packet of 'latency' cycles that arrived at 'r' from terminal 'src',
+// by the distance between them.
+static void destination_record_latency(Router *r, int src, long latency)
+{
+    const Topology *top = r->cfg->topology;
+    int conc = top->desc.concentration;
+    int dist = topo_distance(top, src / conc,
+                             static_cast<int>(r->id.value) / conc);
+    std::vector<std::vector<long>> &hists = r->cfg->stat->dist_latency_hist;
+    if (dist >= static_cast<int>(hists.size())) {
+        hists.resize(dist + 1);
+    }
+    hist_add(&hists[dist], latency);
+}
+
 void destination_consume(Router *r)
 {
     // Round-robin input VC selection.  Destination node should never block, so
     // keep searching for a non-empty input VC in the single cycle.
-    InputUnit::VC *ivc = NULL;
+    InputVC *ivc = NULL;
     char s[IDSTRLEN], s2[IDSTRLEN];
 
     bool has_nonempty_ivc = false;
     int ivc_num = (r->dst_last_grant_input + 1) % r->vc_count;
     for (int i = 0; i < r->vc_count; i++) {
-        ivc = &r->input_units[TERMINAL_PORT].vcs[ivc_num];
+        ivc = &r->ivc(TERMINAL_PORT, ivc_num);
         if (!queue_empty(ivc->buf)) {
             has_nonempty_ivc = true;
             r->dst_last_grant_input = ivc_num;
@@ -649,43 +923,80 @@ void destination_consume(Router *r)
 
     assert(!queue_empty(ivc->buf));
     Flit *flit = queue_front(ivc->buf);
+    flight_record(r, FLIGHT_CONSUME, TERMINAL_PORT, ivc_num, flit);
 
     if (flit->type == FLIT_HEAD) {
         // First, check if this flit is correctly destined to this node.
         assert(flit->route_info.dst == r->id.value);
 
         // Record packet arrival time.
-        // debugf(r, "Finding packet ID=%ld,%ld\n", flit->packet_id.src,
-        // flit->packet_id.id);
-        auto f = r->stat->packet_ledger.find(flit->packet_id);
-        if (f == r->stat->packet_ledger.end()) {
-            printf("src=%ld, id=%ld not found\n", flit->packet_id.src,
-                   flit->packet_id.id);
+        long arr = r->cfg->eventq->curr_time();
+        long gen = flit->gen_time;
+        if (r->cfg->ledger) {
+            // debugf(r, "Finding packet ID=%ld,%ld\n", flit->packet_id.src,
+            // flit->packet_id.id);
+            auto f = r->cfg->stat->packet_ledger.find(flit->packet_id);
+            if (f == r->cfg->stat->packet_ledger.end()) {
+                printf("src=%ld, id=%ld not found\n", flit->packet_id.src,
+                       flit->packet_id.id);
+            }
+            assert(f != r->cfg->stat->packet_ledger.end() &&
+                   "Packet not recorded upon generation!");
+            f->second.arr = arr;
+            gen = f->second.gen;
+            // debugf(r, "Deleting packet ID=%ld,%ld\n",
+            // flit->packet_id.src, flit->packet_id.id);
+            r->cfg->stat->packet_ledger.erase(flit->packet_id);
         }
-        assert(f != r->stat->packet_ledger.end() &&
-               "Packet not recorded upon generation!");
-        f->second.arr = r->eventq->curr_time();
-        long arr = f->second.arr;
-        long gen = f->second.gen;
         long latency = arr - gen;
-        // debugf(r, "Deleting packet ID=%ld,%ld\n",
-        // flit->packet_id.src, flit->packet_id.id);
-        r->stat->packet_ledger.erase(flit->packet_id);
 
-        r->stat->latency_sum += latency;
-        r->stat->packet_arrive_count++;
+        r->cfg->stat->latency_sum += latency;
+        r->cfg->stat->packet_arrive_count++;
+        destination_record_latency(r, flit->route_info.src, latency);
+        if (r->cfg->sim->cc) {
+            cc_deliver(r->cfg->sim, flit);
+        }
+        if (r->cfg->sim->qos) {
+            qos_record(r->cfg->sim->qos, flit->qos_class, latency);
+        }
+
+        if (r->cfg->sim->recorder) {
+            int vc_per_class = r->vc_count / r->cfg->vc_class_count;
+            recorder_put(r->cfg->sim->recorder, flit->route_info.src,
+                         flit->route_info.dst, gen, flit->inject_time, arr,
+                         flit->route_info.path.size() - 1,
+                         flit->route_info.ccw_dims, ivc_num / vc_per_class);
+        }
+
+        if (flit->trace) {
+            flit->trace->consume = arr;
+            tracer_finish(r->cfg->sim->tracer, flit->trace);
+            flit->trace = NULL;
+        }
 
         debugf(r,
                "Packet arrived: %s, latency=%ld (arr=%ld, gen=%ld). "
                "mapsize=%ld\n",
                flit_str(flit, s), latency, arr, gen,
-               r->stat->packet_ledger.size());
+               r->cfg->stat->packet_ledger.size());
     }
 
     debugf(r, "Destination buf size=%zd\n", queue_len(ivc->buf));
     debugf(r, "Flit arrived via VC%d: %s\n", ivc_num, flit_str(flit, s));
 
     r->flit_arrive_count++;
+    r->cfg->stat->flit_arrive_count++;
+    std::vector<long> &src_arrive = r->cfg->stat->src_flit_arrive;
+    if (flit->route_info.src >= static_cast<int>(src_arrive.size())) {
+        src_arrive.resize(r->cfg->topology->terminal_count, 0);
+    }
+    src_arrive[flit->route_info.src]++;
+    if (r->cfg->sim->nic) {
+        nic_flit_arrive(r->cfg->sim, flit);
+    }
+    if (r->cfg->sim->qos) {
+        r->cfg->sim->qos->stats[flit->qos_class].flit_arrive_count++;
+    }
     queue_pop(ivc->buf);
     assert(queue_empty(ivc->buf));
 
@@ -696,6 +1007,7 @@ void destination_consume(Router *r)
     if (true || (r->id.value != 22)) {
         Credit *credit = new Credit{vc_nums};
         channel_put_credit(ich, credit);
+        flight_record(r, FLIGHT_CREDIT_OUT, TERMINAL_PORT, ivc_num, NULL);
         RouterPortPair src_pair = ich->conn.src;
         RouterPortPair dst_pair = ich->conn.dst;
         debugf(r, "Credit sent via VC%d from {%s, %d} to {%s, %d}\n", ivc_num,
@@ -718,7 +1030,7 @@ void fetch_flit(Router *r)
             continue;
         }
 
-        InputUnit::VC &ivc = r->input_units[iport].vcs[flit->vc_num];
+        InputVC &ivc = r->ivc(iport, flit->vc_num);
 
         char s[IDSTRLEN];
         debugf(r, "Fetched flit %s via VC%d, buf[%d][%d].size()=%zd\n",
@@ -733,17 +1045,28 @@ void fetch_flit(Router *r)
             // the stage to RC.
             if (ivc.next_global == STATE_IDLE) {
                 // Idle -> RC transition
-                ivc.next_global = STATE_ROUTING;
-                ivc.stage = PIPELINE_RC;
+                ivc_enter(r, ivc, PIPELINE_RC, STATE_ROUTING);
             }
 
             r->reschedule_next_tick = true;
         }
 
+        if (flit->trace) {
+            if (is_dst(r->id)) {
+                flit->trace->eject = curr_time(r->cfg->eventq);
+            } else {
+                HopTrace hop = {r->id.value, curr_time(r->cfg->eventq),
+                                -1, -1, -1, -1, -1};
+                flit->trace->hops.push_back(hop);
+            }
+        }
+
+        flight_record(r, FLIGHT_ARRIVE, iport, flit->vc_num, flit,
+                      static_cast<int>(queue_len(ivc.buf)) + 1);
         assert(!queue_full(ivc.buf));
         queue_put(ivc.buf, flit);
 
-        assert(queue_len(ivc.buf) <= r->input_buf_size &&
+        assert(queue_len(ivc.buf) <= r->cfg->input_buf_size &&
                "Input buffer overflow!");
     }
 }
@@ -756,7 +1079,10 @@ void fetch_credit(Router *r)
         if (credit) {
             debugf(r, "Fetched credit, oport=%d\n", oport);
             for (auto vc_num : credit->vc_nums) {
-                OutputUnit::VC &ovc = r->output_units[oport].vcs[vc_num];
+                OutputVC &ovc = r->ovc(oport, vc_num);
+                flight_record(r, FLIGHT_CREDIT_IN, oport,
+                              static_cast<int>(vc_num), NULL,
+                              ovc.credit_count);
                 // In any time, there should be at most 1 credit in the buffer.
                 assert(!ovc.buf_credit);
                 ovc.buf_credit = true;
@@ -771,7 +1097,7 @@ void credit_update(Router *r)
 {
     for (int oport = 0; oport < r->radix; oport++) {
         for (int ovc_num = 0; ovc_num < r->vc_count; ovc_num++) {
-            OutputUnit::VC &ovc = r->output_units[oport].vcs[ovc_num];
+            OutputVC &ovc = r->ovc(oport, ovc_num);
 
             if (ovc.buf_credit) {
                 debugf(r, "CU: credit=%d->%d (oport=%d)\n",
@@ -789,8 +1115,8 @@ void credit_update(Router *r)
                 // to the switch allocation.  However, this implementation seems
                 // to defeat the purpose of the CreditWait stage. This
                 // implementation is what I think of as a more natural one.
-                InputUnit::VC &ivc =
-                    r->input_units[ovc.input_port].vcs[ovc.input_vc];
+                InputVC &ivc =
+                    r->ivc(ovc.input_port, ovc.input_vc);
                 if (ovc.credit_count == 0) {
                     if (ovc.next_global == STATE_CREDWAIT) {
                         assert(ivc.next_global == STATE_CREDWAIT);
@@ -817,30 +1143,105 @@ void credit_update(Router *r)
     }
 }
 
+// Minimal adaptive routing on a HyperX.  The source route only fixes the hop
+// count; at each router the next hop is taken along whichever unaligned
+// dimension, and whichever of its parallel links, has the most credits left
+// in the VC class the packet would use.  Ties go to the lowest dimension.
+static int adaptive_route_port(Router *r, const RouteInfo &ri, int qos_class)
+{
+    const Topology *top = r->cfg->topology;
+    const TopoDesc *td = &top->desc;
+    int dst_rtr = ri.dst / td->concentration;
+    if (dst_rtr == r->id.value)
+        return ri.dst % td->concentration;
+
+    int vc_per_class = r->vc_count / r->cfg->vc_class_count;
+    int vc_class = std::min(static_cast<int>(ri.idx), r->cfg->vc_class_count - 1);
+    int qos_first, qos_count;
+    qos_vc_range(r->cfg->sim->qos, vc_per_class, qos_class, &qos_first,
+                 &qos_count);
+    int best_port = -1, best_credits = -1;
+    for (int dim = 0; dim < td->r; dim++) {
+        int coord = topo_coord(top, r->id.value, dim);
+        int dst_coord = topo_coord(top, dst_rtr, dim);
+        if (coord == dst_coord)
+            continue;
+        for (int m = 0; m < td->mult[dim]; m++) {
+            int port = hyperx_port(td, coord, dim, dst_coord, m);
+            int credits = 0;
+            for (int i = qos_first; i < qos_first + qos_count; i++)
+                credits += r->ovc(port, vc_class * vc_per_class + i).credit_count;
+            if (credits > best_credits) {
+                best_port = port;
+                best_credits = credits;
+            }
+        }
+    }
+    assert(best_port >= 0);
+    return best_port;
+}
+
 void route_compute(Router *r)
 {
     for (int iport = 0; iport < r->radix; iport++) {
         for (int ivc_num = 0; ivc_num < r->vc_count; ivc_num++) {
-            InputUnit::VC &ivc = r->input_units[iport].vcs[ivc_num];
+            InputVC &ivc = r->ivc(iport, ivc_num);
 
-            if (ivc.global == STATE_ROUTING) {
+            if (ivc.global == STATE_ROUTING && !ivc_busy(r, ivc)) {
                 assert(!queue_empty(ivc.buf));
                 Flit *flit = queue_front(ivc.buf);
 
                 assert(flit->type == FLIT_HEAD);
                 assert(flit->route_info.idx < flit->route_info.path.size());
+                if (r->cfg->routing == ROUTING_ADAPTIVE) {
+                    flit->route_info.path[flit->route_info.idx] =
+                        adaptive_route_port(r, flit->route_info,
+                                            flit->qos_class);
+                }
                 ivc.route_port = flit->route_info.path[flit->route_info.idx];
                 // ivc.output_vc will be set in the VA stage.
+                flight_record(r, FLIGHT_RC, iport, ivc_num, flit,
+                              ivc.route_port);
 
                 char s[IDSTRLEN];
                 debugf(r, "RC: success for %s (idx=%zu, oport=%d)\n",
                        flit_str(flit, s), flit->route_info.idx, ivc.route_port);
 
                 flit->route_info.idx++;
+                if (flit->trace) {
+                    flit->trace->hops.back().rc = curr_time(r->cfg->eventq);
+                }
+
+                // ECN: mark packets entering through a congested input port.
+                CcState *cc = r->cfg->sim->cc;
+                if (cc && cc->policy == CC_ECN && !flit->ecn) {
+                    long occupancy = 0;
+                    for (int i = 0; i < r->vc_count; i++)
+                        occupancy += queue_len(r->ivc(iport, i).buf);
+                    if (occupancy >= cc->ecn_thresh * r->vc_count *
+                                         r->cfg->input_buf_size) {
+                        flit->ecn = true;
+                        cc->marked++;
+                    }
+                }
+
+                FaultState *faults = r->cfg->sim->faults;
+                if (faults && (fault_router_down(faults, r->id.value) ||
+                               fault_link_down(faults, r->id.value,
+                                               ivc.route_port))) {
+                    // Routed onto a failed link: skip VA, and discard the
+                    // packet in the SA stage.
+                    debugf(r, "RC: dropping %s (oport=%d failed)\n",
+                           flit_str(flit, s), ivc.route_port);
+                    ivc.drop = true;
+                    ivc.output_vc = -1;
+                    ivc_enter(r, ivc, PIPELINE_SA, STATE_ACTIVE);
+                    r->reschedule_next_tick = true;
+                    continue;
+                }
 
                 // RC -> VA transition
-                ivc.next_global = STATE_VCWAIT;
-                ivc.stage = PIPELINE_VA;
+                ivc_enter(r, ivc, PIPELINE_VA, STATE_VCWAIT);
                 r->reschedule_next_tick = true;
             }
         }
@@ -857,7 +1258,7 @@ int vc_arbit_round_robin(Router *r, int out_port)
         std::vector<int> v;
         for (int i = 0; i < r->radix; i++) {
             InputUnit *iu = &r->input_units[i];
-            InputUnit::VC *ivc = &iu->vcs[0 /*FIXME*/];
+            InputVC *ivc = &iu->vcs[0 /*FIXME*/];
             if (ivc->global == STATE_VCWAIT && ivc->route_port == out_port)
                 v.push_back(i);
         }
@@ -872,7 +1273,7 @@ int vc_arbit_round_robin(Router *r, int out_port)
     int iport = (r->va_last_grant_output[out_port] + 1) % r->radix;
     for (int i = 0; i < r->radix; i++) {
         InputUnit *iu = &r->input_units[iport];
-        InputUnit::VC *ivc = &iu->vcs[0 /*FIXME*/];
+        InputVC *ivc = &iu->vcs[0 /*FIXME*/];
         if (ivc->global == STATE_VCWAIT && ivc->route_port == out_port) {
             // XXX: is VA stage and VCWait state the same?
             assert(ivc->stage == PIPELINE_VA);
@@ -891,7 +1292,7 @@ int sa_arbit_round_robin(Router *r, int out_port)
     int iport = (r->sa_last_grant_output[out_port] + 1) % r->radix;
     for (int i = 0; i < r->radix; i++) {
         InputUnit *iu = &r->input_units[iport];
-        InputUnit::VC *ivc = &iu->vcs[0 /*FIXME*/];
+        InputVC *ivc = &iu->vcs[0 /*FIXME*/];
         // We should check for queue non-emptiness, as it is possible for active
         // input units to have no flits in them because of contention in the
         // upstream router.
@@ -1041,9 +1442,9 @@ void vc_alloc(Router *r)
     // Step 0: Prepare request vectors.
     for (int iport = 0; iport < r->radix; iport++) {
         for (int ivc_num = 0; ivc_num < r->vc_count; ivc_num++) {
-            InputUnit::VC &ivc = r->input_units[iport].vcs[ivc_num];
+            InputVC &ivc = r->ivc(iport, ivc_num);
 
-            if (ivc.global == STATE_VCWAIT) {
+            if (ivc.global == STATE_VCWAIT && !ivc_busy(r, ivc)) {
                 assert(ivc.route_port >= 0);
                 size_t global_ivc = iport * r->vc_count + ivc_num;
                 size_t global_ovc_base = ivc.route_port * r->vc_count;
@@ -1063,24 +1464,57 @@ void vc_alloc(Router *r)
                 // If going to the same direction, only allocate VCs with the
                 // same number as IVC.  Whenever crossing the dateline,
                 // allocate VC with a higher number.
-                int vc_per_class = r->vc_count / r->vc_class_count;
+                //
+                // With detours, each routing phase has its own set of
+                // dateline classes, and a packet starts over at class 0 of
+                // the next set when entering the second phase.
+                int vc_per_class = r->vc_count / r->cfg->vc_class_count;
+                const RouteInfo &ri = queue_front(ivc.buf)->route_info;
+                // Traffic classes only use their own share of each class.
+                int qos_first, qos_count;
+                qos_vc_range(r->cfg->sim->qos, vc_per_class,
+                             queue_front(ivc.buf)->qos_class, &qos_first,
+                             &qos_count);
+                if (topo_is_hyperx(&r->cfg->topology->desc)) {
+                    // Dimension-order routes are deadlock-free as is.
+                    // Adaptive routes take the VC class of their hop count.
+                    int ovc_class = std::min(static_cast<int>(ri.idx) - 1,
+                                             r->cfg->vc_class_count - 1);
+                    for (int i = qos_first; i < qos_first + qos_count; i++) {
+                        int ovc_num = ovc_class * vc_per_class + i;
+                        request_vectors[alloc_vector_pos(
+                            total_vc, global_ivc,
+                            global_ovc_base + ovc_num)] = true;
+                    }
+                    continue;
+                }
+                int dl_class_count = r->cfg->vc_class_count / r->cfg->vc_phase_count;
                 int in_direction = (iport - 1) / 2;
                 int out_direction = (ivc.route_port - 1) / 2;
-                int ivc_class = ivc_num / vc_per_class;
-                int ovc_class =
-                    (iport != TERMINAL_PORT && in_direction == out_direction)
-                        ? ivc_class
-                        : 0;
-                int id_in_ring = torus_id_xyz_get(r->id.value, r->top_desc.k, out_direction);
-                if (r->vc_count > 1) {
-                    if ((id_in_ring == (r->top_desc.k - 1) &&
+                int in_phase = (ivc_num / vc_per_class) / dl_class_count;
+                int out_phase =
+                    (ri.detour_hop >= 0 &&
+                     static_cast<int>(ri.idx) - 1 >= ri.detour_hop) ? 1 : 0;
+                int ivc_class = (ivc_num / vc_per_class) % dl_class_count;
+                int ovc_class = (iport != TERMINAL_PORT &&
+                                 in_direction == out_direction &&
+                                 in_phase == out_phase)
+                                    ? ivc_class
+                                    : 0;
+                int id_in_ring =
+                    topo_coord(r->cfg->topology, r->id.value, out_direction);
+                int ring_len = r->cfg->topology->desc.k[out_direction];
+                if (r->vc_count > 1 &&
+                    r->cfg->deadlock == DEADLOCK_DATELINE) {
+                    if ((id_in_ring == (ring_len - 1) &&
                          ivc.route_port == get_output_port(out_direction, 1)) ||
                         (id_in_ring == 0 &&
                          ivc.route_port == get_output_port(out_direction, 0))) {
                         // If going out to the same direction as coming in,
                         // check that IVC was being maintained as 0.
                         if (iport != TERMINAL_PORT &&
-                            in_direction == out_direction) {
+                            in_direction == out_direction &&
+                            in_phase == out_phase) {
                             assert(ivc_class == 0);
                         }
                         ovc_class = 1;
@@ -1088,8 +1522,26 @@ void vc_alloc(Router *r)
                     }
                 }
 
-                for (int i = 0; i < vc_per_class; i++) {
+                // Bubble flow control: a packet continuing along its ring
+                // needs room for itself downstream, and one entering a ring
+                // (injected, turning, or starting a new phase) for two, so
+                // that each ring always keeps a free packet buffer.
+                long min_credit = 0;
+                if (r->cfg->deadlock == DEADLOCK_BUBBLE) {
+                    ovc_class = 0;
+                    if (ivc.route_port != TERMINAL_PORT) {
+                        bool enter = iport == TERMINAL_PORT ||
+                                     in_direction != out_direction ||
+                                     in_phase != out_phase;
+                        min_credit = (enter ? 2 : 1) * r->cfg->packet_len;
+                    }
+                }
+
+                ovc_class += out_phase * dl_class_count;
+                for (int i = qos_first; i < qos_first + qos_count; i++) {
                     int ovc_num = ovc_class * vc_per_class + i;
+                    if (r->ovc(ivc.route_port, ovc_num).credit_count < min_credit)
+                        continue;
                     request_vectors[alloc_vector_pos(
                         total_vc, global_ivc,
                         global_ovc_base + ovc_num)] = true;
@@ -1123,7 +1575,7 @@ void vc_alloc(Router *r)
     for (size_t global_ovc = 0; global_ovc < total_vc; global_ovc++) {
         int oport = global_ovc / r->vc_count;
         int ovc_num = global_ovc % r->vc_count;
-        OutputUnit::VC &ovc = r->output_units[oport].vcs[ovc_num];
+        OutputVC &ovc = r->ovc(oport, ovc_num);
 
         // Only do arbitration for available output VCs.
         if (ovc.global == STATE_IDLE) {
@@ -1150,8 +1602,8 @@ void vc_alloc(Router *r)
             int oport = global_ovc / r->vc_count;
             int ovc_num = global_ovc % r->vc_count;
 
-            InputUnit::VC &ivc = r->input_units[iport].vcs[ivc_num];
-            OutputUnit::VC &ovc = r->output_units[oport].vcs[ovc_num];
+            InputVC &ivc = r->ivc(iport, ivc_num);
+            OutputVC &ovc = r->ovc(oport, ovc_num);
 
             assert(ivc.global == STATE_VCWAIT);
             assert(ovc.global == STATE_IDLE);
@@ -1160,24 +1612,29 @@ void vc_alloc(Router *r)
             char s[IDSTRLEN];
             debugf(r, "VA: success for %s from (iport=%d,VC=%d) to (oport=%d,VC=%d)\n",
                    flit_str(queue_front(ivc.buf), s), iport, ivc_num, oport, ovc_num);
+            flight_record(r, FLIGHT_VA, iport, ivc_num, queue_front(ivc.buf),
+                          oport, ovc_num);
+            if (queue_front(ivc.buf)->trace) {
+                queue_front(ivc.buf)->trace->hops.back().va = curr_time(r->cfg->eventq);
+            }
 
             // We now have the VC, but we cannot proceed to the SA stage
             // if there is no credit.
+            enum GlobalState state = STATE_ACTIVE;
             if (ovc.credit_count == 0) {
                 debugf(r, "VA: no credit, switching to CreditWait\n");
-                ivc.next_global = STATE_CREDWAIT;
-                ovc.next_global = STATE_CREDWAIT;
-            } else {
-                ivc.next_global = STATE_ACTIVE;
-                ovc.next_global = STATE_ACTIVE;
+                state = STATE_CREDWAIT;
             }
+            ovc.next_global = state;
+            if (pipeline_cycles[PIPELINE_SA] == 0)
+                ovc.global = state;
 
             // Record the VA result into the input/output units.
             ivc.output_vc = ovc_num;
             ovc.input_port = iport;
             ovc.input_vc = ivc_num;
 
-            ivc.stage = PIPELINE_SA;
+            ivc_enter(r, ivc, PIPELINE_SA, state);
             r->reschedule_next_tick = true;
 
             num_grant++;
@@ -1187,47 +1644,113 @@ void vc_alloc(Router *r)
     // debugf(r, "VA: granted to %d input VCs.\n", num_grant);
 }
 
+// Grant the switch to input VC (iport, ivc_num) towards 'oport': the front flit
+// leaves the input buffer for the ST stage.
+static void sa_grant(Router *r, int iport, int ivc_num, int oport)
+{
+    InputVC &ivc = r->ivc(iport, ivc_num);
+    // ovc_num should be read from ivc.
+    OutputVC &ovc = r->ovc(oport, ivc.output_vc);
+
+    assert(ivc.global == STATE_ACTIVE);
+    assert(ovc.global == STATE_ACTIVE);
+    // Because only input units that have flits in them make requests, the
+    // input queue cannot be empty.
+    assert(!queue_empty(ivc.buf));
+
+    char s[IDSTRLEN];
+    debugf(r,
+           "SA: success for %s from (iport=%d,VC=%d) to (oport = % d, "
+           "VC = % d)\n",
+           flit_str(queue_front(ivc.buf), s), iport, ivc_num, oport,
+           ivc.output_vc);
+
+    // The flit leaves the input buffer here.
+    Flit *flit = queue_front(ivc.buf);
+    queue_pop(ivc.buf);
+    assert(!ivc.st_ready);
+    ivc.st_ready = flit;
+    // Latch the output for ST: with zero-cycle stages, the next
+    // packet may already be routed before this flit traverses.
+    ivc.st_port = ivc.route_port;
+    ivc.st_vc = ivc.output_vc;
+    if (flit->trace) {
+        flit->trace->hops.back().sa = curr_time(r->cfg->eventq);
+    }
+
+    // Credit decrement.
+    debugf(r, "Credit decrement, credit=%d->%d (oport=%d)\n",
+           ovc.credit_count, ovc.credit_count - 1, oport);
+    flight_record(r, FLIGHT_SA, iport, ivc_num, flit, oport,
+                  ovc.credit_count - 1);
+    assert(ovc.credit_count > 0);
+    ovc.credit_count--;
+
+    // SA -> ?? transition
+    //
+    // Set the next stage according to the flit type and credit
+    // count.
+    //
+    // Note that switching state to CreditWait does NOT prevent the
+    // subsequent ST to happen. The flit that has succeeded SA on
+    // this cycle is transferred to ivc.st_ready, and that is the
+    // only thing that is visible to the ST stage.
+    if (flit->type == FLIT_TAIL) {
+        ovc.next_global = STATE_IDLE;
+        if (queue_empty(ivc.buf)) {
+            ivc.next_global = STATE_IDLE;
+            ivc.stage = PIPELINE_IDLE;
+            // debugf(this, "SA: next state is Idle\n");
+        } else {
+            ivc_enter(r, ivc, PIPELINE_RC, STATE_ROUTING);
+            // debugf(this, "SA: next state is Routing\n");
+        }
+        r->reschedule_next_tick = true;
+    } else if (ovc.credit_count == 0) {
+        // debugf(r, "SA: switching to CW\n");
+        ivc.next_global = STATE_CREDWAIT;
+        ovc.next_global = STATE_CREDWAIT;
+        // debugf(this, "SA: next state is CreditWait\n");
+    } else {
+        ivc.next_global = STATE_ACTIVE;
+        ivc.stage = PIPELINE_SA;
+        // debugf(this, "SA: next state is Active\n");
+        r->reschedule_next_tick = true;
+    }
+    assert(ovc.credit_count >= 0);
+}
+
 // Switch allocation.
 // Performs a (# of total input VCs) X (# radix) allocation.
 // This is because the switch has no output speedup.
+//
+// Every input VC requests the single output port it was routed to, so an
+// output port requested by only one input VC needs no allocation: the VC
+// gets the switch if its output VC is active.  These are granted directly,
+// updating the arbiter state exactly as the allocator would, and only the
+// contended ports go through the allocator.  Streaming the body of a packet
+// through an otherwise idle port is the common case.
 void switch_alloc(Router *r)
 {
-    //
-    // Separable (input-first) allocator.
-    //
-
-    // FIXME: PERFORMANCE!
-
+    QosState *qos = r->cfg->sim->qos;
     size_t total_vc = r->radix * r->vc_count;
-    size_t vector_size = total_vc * r->radix;
-    // Request vectors for each input VC. Has 1 request bit for each output VC.
-    std::vector<bool> request_vectors(vector_size, false);
-    // Age vector, for age-based arbitration.
-    std::vector<long> age_vector(total_vc, LONG_MAX);
-    // Input arbitration result vector, i.e. the 'x' vector in Figure 19.4.
-    std::vector<bool> x_vectors(vector_size, false);
-    // Grant vectors.
-    std::vector<bool> grant_vectors(vector_size, false);
 
-    // Step 0: Prepare request vectors.
+    // Step 0: Collect the requests per output port.
+    std::vector<int> req_count(r->radix, 0);
+    std::vector<int> req_ivc(r->radix, -1); // the last requester
+    bool contended = false;
     for (int iport = 0; iport < r->radix; iport++) {
         for (int ivc_num = 0; ivc_num < r->vc_count; ivc_num++) {
-            InputUnit::VC &ivc = r->input_units[iport].vcs[ivc_num];
+            InputVC &ivc = r->ivc(iport, ivc_num);
 
             if (ivc.stage == PIPELINE_SA && ivc.global == STATE_ACTIVE &&
-                !queue_empty(ivc.buf)) {
+                !ivc.drop && !queue_empty(ivc.buf) && !ivc_busy(r, ivc)) {
                 assert(ivc.route_port >= 0);
-                size_t global_ivc = iport * r->vc_count + ivc_num;
-                size_t oport = ivc.route_port;
-                assert(global_ivc < total_vc);
-
-                // Record ages.
-                age_vector[global_ivc] = queue_front(ivc.buf)->packet_id.id;
-
-                // Assert request for the routed oport.
-                // NOTE: No output speedup.
-                request_vectors[alloc_vector_pos(r->radix, global_ivc, oport)] =
-                    true;
+                int oport = ivc.route_port;
+                req_count[oport]++;
+                req_ivc[oport] = iport * r->vc_count + ivc_num;
+                if (req_count[oport] > 1)
+                    contended = true;
             }
             // else if (ivc.stage == PIPELINE_SA &&
             //            ivc.route_port == out_port &&
@@ -1237,137 +1760,197 @@ void switch_alloc(Router *r)
         }
     }
 
-    // Step 1: Input arbitration from request vectors to x-vectors.
-    for (size_t global_ivc = 0; global_ivc < total_vc; global_ivc++) {
-        size_t winner = round_robin_arbitration(
-            total_vc, r->radix, global_ivc, true,
-            r->sa_last_grant_input[global_ivc], request_vectors, x_vectors);
-        if (winner != static_cast<size_t>(-1)) {
-            r->sa_last_grant_input[global_ivc] = (winner % r->radix);
+    // The input VC granted at each output port, if any.
+    std::vector<int> granted(r->radix, -1);
+
+    // Fast path for the uncontended output ports.
+    for (int oport = 0; oport < r->radix; oport++) {
+        if (req_count[oport] != 1)
+            continue;
+        int global_ivc = req_ivc[oport];
+        InputVC &ivc =
+            r->ivc(global_ivc / r->vc_count, global_ivc % r->vc_count);
+        assert(ivc.output_vc >= 0);
+        r->sa_last_grant_input[global_ivc] = oport;
+        if (r->ovc(oport, ivc.output_vc).global != STATE_ACTIVE) {
+            debugf(r, "SA: input arbitration picked a block OVC\n");
+            continue;
         }
+        // Keep the weighted round-robin state of the class arbitration.
+        if (qos && qos->class_count > 1) {
+            qos_select(qos, 1u << queue_front(ivc.buf)->qos_class,
+                       &r->qos_tokens[oport * QOS_MAXCLASS]);
+        }
+        r->sa_last_grant_output[oport] = global_ivc;
+        granted[oport] = global_ivc;
     }
 
-    // Step 2: Output arbitration from x-vectors to grant vectors.
-    for (int oport = 0; oport < r->radix; oport++) {
-        // Unless all VCs of this oport is non-active, attempt to allocate on
-        // this port.
-        bool oport_has_active_vc = false;
-        for (int ovc_num = 0; ovc_num < r->vc_count; ovc_num++) {
-            OutputUnit::VC &ovc = r->output_units[oport].vcs[ovc_num];
-            if (ovc.global == STATE_ACTIVE) {
-                oport_has_active_vc = true;
+    if (contended) {
+        //
+        // Separable (input-first) allocator, for the contended output ports.
+        //
+
+        size_t vector_size = total_vc * r->radix;
+        // Request vectors for each input VC. Has 1 request bit for each
+        // output VC.
+        std::vector<bool> request_vectors(vector_size, false);
+        // Age vector, for age-based arbitration.
+        std::vector<long> age_vector(total_vc, LONG_MAX);
+        // Input arbitration result vector, i.e. the 'x' vector in Figure 19.4.
+        std::vector<bool> x_vectors(vector_size, false);
+        // Grant vectors.
+        std::vector<bool> grant_vectors(vector_size, false);
+
+        // Prepare request vectors.
+        for (int iport = 0; iport < r->radix; iport++) {
+            for (int ivc_num = 0; ivc_num < r->vc_count; ivc_num++) {
+                InputVC &ivc = r->ivc(iport, ivc_num);
+
+                if (ivc.stage == PIPELINE_SA && ivc.global == STATE_ACTIVE &&
+                    !ivc.drop && !queue_empty(ivc.buf) &&
+                    req_count[ivc.route_port] > 1 && !ivc_busy(r, ivc)) {
+                    size_t global_ivc = iport * r->vc_count + ivc_num;
+                    size_t oport = ivc.route_port;
+                    assert(global_ivc < total_vc);
+
+                    // Record ages.
+                    age_vector[global_ivc] = queue_front(ivc.buf)->packet_id.id;
+
+                    // Assert request for the routed oport.
+                    // NOTE: No output speedup.
+                    request_vectors[alloc_vector_pos(r->radix, global_ivc,
+                                                     oport)] = true;
+                }
             }
         }
 
-        if (oport_has_active_vc) {
-            // First attempt the arbitration. Then, if the selected OVC is
-            // unfortunately the blocked one, disregard it.
-
+        // Step 1: Input arbitration from request vectors to x-vectors.
+        for (size_t global_ivc = 0; global_ivc < total_vc; global_ivc++) {
             size_t winner = round_robin_arbitration(
-                total_vc, r->radix, oport, false,
-                r->sa_last_grant_output[oport], x_vectors, grant_vectors);
-            // size_t winner = age_based_arbitration(
-            //     total_vc, r->radix, oport, false,
-            //     r->sa_last_grant_output[oport], x_vectors, grant_vectors, age_vector);
+                total_vc, r->radix, global_ivc, true,
+                r->sa_last_grant_input[global_ivc], request_vectors, x_vectors);
             if (winner != static_cast<size_t>(-1)) {
-                // Now check if the selected OVC is fortunate.
-                assert(winner < vector_size);
-                size_t global_ivc = winner / r->radix;
-                int iport = global_ivc / r->vc_count;
-                int ivc_num = global_ivc % r->vc_count;
-
-                InputUnit::VC &ivc = r->input_units[iport].vcs[ivc_num];
-                assert(ivc.global == STATE_ACTIVE);
-                assert(ivc.output_vc >= 0);
-                OutputUnit::VC &ovc = r->output_units[oport].vcs[ivc.output_vc];
-
-                // If unfortunate, the 'speculative' grant turned out to be
-                // a miss. Turn off the grant bit back to false.
-                if (ovc.global != STATE_ACTIVE) {
-                    grant_vectors[winner] = false;
-                    debugf(r, "SA: input arbitration picked a block OVC\n");
-                } else {
-                    // FIXME: Should this be outside of this else?
-                    r->sa_last_grant_output[oport] = (winner / r->radix);
+                r->sa_last_grant_input[global_ivc] = (winner % r->radix);
+            }
+        }
+
+        // Step 2: Output arbitration from x-vectors to grant vectors.
+        for (int oport = 0; oport < r->radix; oport++) {
+            if (req_count[oport] <= 1)
+                continue;
+
+            // Unless all VCs of this oport is non-active, attempt to allocate
+            // on this port.
+            bool oport_has_active_vc = false;
+            for (int ovc_num = 0; ovc_num < r->vc_count; ovc_num++) {
+                OutputVC &ovc = r->ovc(oport, ovc_num);
+                if (ovc.global == STATE_ACTIVE) {
+                    oport_has_active_vc = true;
+                }
+            }
+
+            if (oport_has_active_vc && qos && qos->class_count > 1) {
+                // Traffic classes: pick the class first, and leave only its
+                // requests that can actually go.
+                unsigned present = 0;
+                for (size_t global_ivc = 0; global_ivc < total_vc;
+                     global_ivc++) {
+                    size_t pos = alloc_vector_pos(r->radix, global_ivc, oport);
+                    if (!x_vectors[pos])
+                        continue;
+                    InputVC &ivc = r->ivc(global_ivc / r->vc_count,
+                                          global_ivc % r->vc_count);
+                    if (r->ovc(oport, ivc.output_vc).global == STATE_ACTIVE)
+                        present |= (1u << queue_front(ivc.buf)->qos_class);
+                }
+                if (present) {
+                    int qclass = qos_select(
+                        qos, present, &r->qos_tokens[oport * QOS_MAXCLASS]);
+                    for (size_t global_ivc = 0; global_ivc < total_vc;
+                         global_ivc++) {
+                        size_t pos =
+                            alloc_vector_pos(r->radix, global_ivc, oport);
+                        if (!x_vectors[pos])
+                            continue;
+                        InputVC &ivc = r->ivc(global_ivc / r->vc_count,
+                                              global_ivc % r->vc_count);
+                        if (queue_front(ivc.buf)->qos_class != qclass)
+                            x_vectors[pos] = false;
+                    }
+                }
+            }
+
+            if (oport_has_active_vc) {
+                // First attempt the arbitration. Then, if the selected OVC is
+                // unfortunately the blocked one, disregard it.
+
+                size_t winner = round_robin_arbitration(
+                    total_vc, r->radix, oport, false,
+                    r->sa_last_grant_output[oport], x_vectors, grant_vectors);
+                // size_t winner = age_based_arbitration(
+                //     total_vc, r->radix, oport, false,
+                //     r->sa_last_grant_output[oport], x_vectors, grant_vectors, age_vector);
+                if (winner != static_cast<size_t>(-1)) {
+                    // Now check if the selected OVC is fortunate.
+                    assert(winner < vector_size);
+                    size_t global_ivc = winner / r->radix;
+                    int iport = global_ivc / r->vc_count;
+                    int ivc_num = global_ivc % r->vc_count;
+
+                    InputVC &ivc = r->ivc(iport, ivc_num);
+                    assert(ivc.global == STATE_ACTIVE);
+                    assert(ivc.output_vc >= 0);
+                    OutputVC &ovc = r->ovc(oport, ivc.output_vc);
+
+                    // If unfortunate, the 'speculative' grant turned out to be
+                    // a miss. Turn off the grant bit back to false.
+                    if (ovc.global != STATE_ACTIVE) {
+                        grant_vectors[winner] = false;
+                        debugf(r, "SA: input arbitration picked a block OVC\n");
+                    } else {
+                        // FIXME: Should this be outside of this else?
+                        r->sa_last_grant_output[oport] = (winner / r->radix);
+                        granted[oport] = global_ivc;
+                    }
                 }
             }
         }
     }
 
     // Step 3: Update states for the granted SAs.
-    int num_grant = 0;
-    for (size_t i = 0; i < vector_size; i++) {
-        if (grant_vectors[i]) {
-            size_t global_ivc = i / r->radix;
-            int oport = i % r->radix;
-            int iport = global_ivc / r->vc_count;
-            int ivc_num = global_ivc % r->vc_count;
-
-            // SA success!
-            InputUnit::VC &ivc = r->input_units[iport].vcs[ivc_num];
-            // ovc_num should be read from ivc.
-            OutputUnit::VC &ovc = r->output_units[oport].vcs[ivc.output_vc];
-
-            assert(ivc.global == STATE_ACTIVE);
-            assert(ovc.global == STATE_ACTIVE);
-            // Because sa_arbit_round_robin only selects input units that
-            // has flits in them, the input queue cannot be empty.
-            assert(!queue_empty(ivc.buf));
+    for (int oport = 0; oport < r->radix; oport++) {
+        if (granted[oport] >= 0) {
+            sa_grant(r, granted[oport] / r->vc_count,
+                     granted[oport] % r->vc_count, oport);
+        }
+    }
 
-            char s[IDSTRLEN];
-            debugf(r,
-                   "SA: success for %s from (iport=%d,VC=%d) to (oport = % d, "
-                   "VC = % d)\n",
-                   flit_str(queue_front(ivc.buf), s), iport, ivc_num, oport,
-                   ivc.output_vc);
+    // Packets being dropped leave the input buffer one flit per cycle without
+    // using the switch, so that credits are still returned upstream.
+    for (int iport = 0; iport < r->radix; iport++) {
+        for (int ivc_num = 0; ivc_num < r->vc_count; ivc_num++) {
+            InputVC &ivc = r->ivc(iport, ivc_num);
+            if (!ivc.drop || ivc.global != STATE_ACTIVE ||
+                queue_empty(ivc.buf) || ivc_busy(r, ivc)) {
+                continue;
+            }
 
-            // The flit leaves the input buffer here.
             Flit *flit = queue_front(ivc.buf);
             queue_pop(ivc.buf);
             assert(!ivc.st_ready);
             ivc.st_ready = flit;
+            ivc.st_drop = true;
 
-            // Credit decrement.
-            debugf(r, "Credit decrement, credit=%d->%d (oport=%d)\n",
-                   ovc.credit_count, ovc.credit_count - 1, oport);
-            assert(ovc.credit_count > 0);
-            ovc.credit_count--;
-
-            // SA -> ?? transition
-            //
-            // Set the next stage according to the flit type and credit
-            // count.
-            //
-            // Note that switching state to CreditWait does NOT prevent the
-            // subsequent ST to happen. The flit that has succeeded SA on
-            // this cycle is transferred to ivc.st_ready, and that is the
-            // only thing that is visible to the ST stage.
             if (flit->type == FLIT_TAIL) {
-                ovc.next_global = STATE_IDLE;
+                ivc.drop = false;
                 if (queue_empty(ivc.buf)) {
                     ivc.next_global = STATE_IDLE;
                     ivc.stage = PIPELINE_IDLE;
-                    // debugf(this, "SA: next state is Idle\n");
                 } else {
-                    ivc.next_global = STATE_ROUTING;
-                    ivc.stage = PIPELINE_RC;
-                    // debugf(this, "SA: next state is Routing\n");
+                    ivc_enter(r, ivc, PIPELINE_RC, STATE_ROUTING);
                 }
-                r->reschedule_next_tick = true;
-            } else if (ovc.credit_count == 0) {
-                // debugf(r, "SA: switching to CW\n");
-                ivc.next_global = STATE_CREDWAIT;
-                ovc.next_global = STATE_CREDWAIT;
-                // debugf(this, "SA: next state is CreditWait\n");
-            } else {
-                ivc.next_global = STATE_ACTIVE;
-                ivc.stage = PIPELINE_SA;
-                // debugf(this, "SA: next state is Active\n");
-                r->reschedule_next_tick = true;
             }
-            assert(ovc.credit_count >= 0);
-
-            num_grant++;
+            r->reschedule_next_tick = true;
         }
     }
 }
@@ -1379,21 +1962,43 @@ void switch_traverse(Router *r)
     for (int iport = 0; iport < r->radix; iport++) {
         std::vector<long> vc_nums;
         for (int ivc_num = 0; ivc_num < r->vc_count; ivc_num++) {
-            InputUnit::VC &ivc = r->input_units[iport].vcs[ivc_num];
+            InputVC &ivc = r->ivc(iport, ivc_num);
 
             if (ivc.st_ready) {
                 Flit *flit = ivc.st_ready;
                 ivc.st_ready = NULL;
 
+                if (ivc.st_drop) {
+                    debugf(r, "ST: dropped %s\n", flit_str(flit, s));
+                    flight_record(r, FLIGHT_DROP, iport, ivc_num, flit);
+                    ivc.st_drop = false;
+                    if (flit->type == FLIT_HEAD) {
+                        fault_drop(r->cfg->sim, flit);
+                    }
+                    delete flit;
+                    vc_nums.push_back(ivc_num);
+                    continue;
+                }
+
                 // Caution: be sure to update the VC field in the flit.
                 assert(flit->vc_num == ivc_num);
-                flit->vc_num = ivc.output_vc;
+                flit->vc_num = ivc.st_vc;
 
                 // No output speedup: there is no need for an output buffer
                 // (Ch17.3).  Flits that exit the switch are directly placed on
                 // the channel.
-                Channel *och = r->output_channels[ivc.route_port];
-                channel_put(och, flit);
+                // A multi-cycle ST stage is pipelined: the flit leaves the
+                // switch after the remaining cycles, on the channel.
+                long st_extra = std::max(ROUTER_ST_CYCLES - 1, 0);
+                Channel *och = r->output_channels[ivc.st_port];
+                if (flit->trace) {
+                    flit->trace->hops.back().st =
+                        curr_time(r->cfg->eventq) + st_extra;
+                    flit->trace->hops.back().link_delay = och->delay;
+                }
+                flight_record(r, FLIGHT_ST, iport, ivc_num, flit, ivc.st_port,
+                              ivc.st_vc);
+                channel_put_delayed(och, flit, st_extra);
                 RouterPortPair src_pair = och->conn.src;
                 RouterPortPair dst_pair = och->conn.dst;
 
@@ -1401,7 +2006,7 @@ void switch_traverse(Router *r)
                     r,
                     "ST: %s sent via VC%d from {%s, %d} to {%s, "
                     "%d}\n",
-                    flit_str(flit, s), ivc.output_vc, id_str(src_pair.id, s2),
+                    flit_str(flit, s), ivc.st_vc, id_str(src_pair.id, s2),
                     src_pair.port, id_str(dst_pair.id, s3), dst_pair.port);
 
                 // With output speedup:
@@ -1422,6 +2027,8 @@ void switch_traverse(Router *r)
             RouterPortPair credit_src_pair = ich->conn.src;
             RouterPortPair credit_dst_pair = ich->conn.dst;
             for (auto vc_num : vc_nums) {
+                flight_record(r, FLIGHT_CREDIT_OUT, iport,
+                              static_cast<int>(vc_num), NULL);
                 debugf(r, "Credit sent via VC%d from {%s, %d} to {%s, %d}\n",
                        vc_num, id_str(credit_dst_pair.id, s),
                        credit_dst_pair.port, id_str(credit_src_pair.id, s2),
@@ -1436,8 +2043,8 @@ void update_states(Router *r)
     int changed = 0;
     for (int port = 0; port < r->radix; port++) {
         for (int vc_num = 0; vc_num < r->vc_count; vc_num++) {
-            InputUnit::VC &ivc = r->input_units[port].vcs[vc_num];
-            OutputUnit::VC &ovc = r->output_units[port].vcs[vc_num];
+            InputVC &ivc = r->ivc(port, vc_num);
+            OutputVC &ovc = r->ovc(port, vc_num);
             if (ivc.global != ivc.next_global) {
                 ivc.global = ivc.next_global;
                 changed = 1;
@@ -1461,7 +2068,7 @@ void router_print_state(Router *r)
 
     for (int i = 0; i < r->radix; i++) {
         for (int ivc_num = 0; ivc_num < r->vc_count; ivc_num++) {
-            InputUnit::VC &ivc = r->input_units[i].vcs[ivc_num];
+            InputVC &ivc = r->ivc(i, ivc_num);
             if (ivc.route_port == -1 && ivc.output_vc == -1) {
                 continue;
             }
@@ -1479,7 +2086,7 @@ void router_print_state(Router *r)
 
     for (int i = 0; i < r->radix; i++) {
         for (int ovc_num = 0; ovc_num < r->vc_count; ovc_num++) {
-            OutputUnit::VC &ovc = r->output_units[i].vcs[ovc_num];
+            OutputVC &ovc = r->ovc(i, ovc_num);
             if (ovc.input_port == -1 && ovc.input_vc == -1) {
                 continue;
             }
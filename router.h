@@ -2,11 +2,14 @@
 #define ROUTER_H
 
 #include "event.h"
+#include "qos.h"
+#include "arena.h"
 #include "stb_ds.h"
 #include <vector>
 #include <map>
 #include <random>
 #include <deque>
+#include <stdint.h>
 
 // Port that is always connected to a terminal.
 #define TERMINAL_PORT 0
@@ -14,10 +17,29 @@
 #define DESTINATION_VC 0
 // Single VC used in the terminal-router channel.
 #define TERMINAL_VC 0
-// Maximum supported torus dimension.
-#define NORMALLEN 128
 // Excess storage in channel to prevent overrun.
 #define CHANNEL_SLACK 4
+// Capacity of each source queue in flits.
+#define SOURCE_QUEUE_LEN 10000
+// Latency of each router pipeline stage in cycles, fixed at build time (see
+// the NETSIM_*_CYCLES cache variables in CMakeLists.txt).  A stage of zero
+// cycles is merged into the one before it; RC is measured from the buffer
+// write.
+#ifndef ROUTER_RC_CYCLES
+#define ROUTER_RC_CYCLES 1
+#endif
+#ifndef ROUTER_VA_CYCLES
+#define ROUTER_VA_CYCLES 1
+#endif
+#ifndef ROUTER_SA_CYCLES
+#define ROUTER_SA_CYCLES 1
+#endif
+#ifndef ROUTER_ST_CYCLES
+#define ROUTER_ST_CYCLES 1
+#endif
+// Zero-load latency of the router pipeline (RC, VA, SA, ST) in cycles.
+#define ROUTER_PIPELINE_DEPTH                                                  \
+    (ROUTER_RC_CYCLES + ROUTER_VA_CYCLES + ROUTER_SA_CYCLES + ROUTER_ST_CYCLES)
 
 // ID of the source node is encoded into PacketId.
 struct PacketId {
@@ -41,7 +63,13 @@ struct Stat {
     long latency_sum = 0;
     long packet_gen_count = 0;
     long packet_arrive_count = 0;
+    long flit_arrive_count = 0;
     long hop_count_sum = 0;
+    // For fairness: flits delivered from each source terminal, and packets
+    // delivered by the minimal hop distance between their terminals and by
+    // latency in cycles.  Grown as needed.
+    std::vector<long> src_flit_arrive;
+    std::vector<std::vector<long>> dist_latency_hist;
 };
 
 typedef struct RouterPortPair {
@@ -52,7 +80,7 @@ typedef struct RouterPortPair {
 typedef struct Connection {
     RouterPortPair src;
     RouterPortPair dst;
-    int uniq; // used as hash key
+    int uniq; // index of the channel
 } Connection;
 
 static const Connection not_connected = {
@@ -63,38 +91,83 @@ static const Connection not_connected = {
 
 void print_conn(const char *name, Connection conn);
 
-// Maps a RouterPortPair to a Connection.  Used for finding a connection with
-// either end of it as the key.
-typedef struct ConnectionMap {
-    RouterPortPair key;
-    Connection value;
-} ConnectionMap;
-
 enum TopoType {
     TOP_TORUS,
     TOP_FCLOS,
+    TOP_HYPERX,  // fully connected in every dimension
+    TOP_FLATFLY, // flattened butterfly: a HyperX with k terminals per router
 };
 
+// Maximum supported dimension.
+#define TOPO_MAXDIM 16
+
 typedef struct TopoDesc {
     enum TopoType type;
-    int k; // ring length of torus
-    int r; // dimension of torus
+    int r;                   // number of dimensions
+    int k[TOPO_MAXDIM];      // routers along each dimension
+    int stride[TOPO_MAXDIM]; // router ID difference along each dimension
+    long delay[TOPO_MAXDIM]; // link latency along each dimension
+    // HyperX only.
+    int mult[TOPO_MAXDIM];      // parallel links between each pair of routers
+    int port_base[TOPO_MAXDIM]; // first port of each dimension
+    int concentration;          // terminals per router
 } TopoDesc;
 
-// Encodes channel connectivity in a bidirectional map.
+// Order in which routers, and the channels into them, are laid out in memory.
+// Router IDs do not change; only storage does.
+enum LayoutOrder {
+    LAYOUT_ID,      // by router ID, i.e. row-major over the coordinates
+    LAYOUT_MORTON,  // along a Z-order curve over the coordinates
+    LAYOUT_HILBERT, // along a Hilbert curve over the coordinates
+};
+
+// Encodes channel connectivity in both directions.
 // Supports runtime checking for connectivity error.
+//
+// Every port of every node has a slot in 'forward' and 'reverse': source
+// nodes first, then destination nodes, then 'radix' ports for each router.
 typedef struct Topology {
     TopoDesc desc;
-    ConnectionMap *forward_hash;
-    ConnectionMap *reverse_hash;
+    int terminal_count;
+    int router_count;
+    int radix;
+    Connection *conns; // all channels, indexed by Connection::uniq
+    int *forward;      // uniq of the channel leaving each port slot, or -1
+    int *reverse;      // uniq of the channel entering each port slot, or -1
+    int *coords;       // coordinates of each router, desc.r per router
+    int *layout;       // router IDs in memory order, or NULL for ID order
 } Topology;
 
 int get_output_port(int direction, int to_larger);
-int torus_id_xyz_get(int id, int k, int direction);
-int torus_id_xyz_set(int id, int k, int direction, int component);
-int torus_align_id(int k, int src_id, int dst_id, int move_direction);
-Topology topology_torus(int k, int r);
+TopoDesc topo_desc_torus(int r, const int *k, const long *delay);
+TopoDesc topo_desc_hyperx(int r, const int *k, const int *mult,
+                          int concentration, const long *delay);
+TopoDesc topo_desc_flatfly(int k, int n, const long *delay);
+long topo_router_count(const TopoDesc *td);
+long topo_terminal_count(const TopoDesc *td);
+int topo_radix(const TopoDesc *td);
+int topo_port_dim(const TopoDesc *td, int port);
+int hyperx_port(const TopoDesc *td, int coord, int dim, int peer_coord, int m);
+char *topo_desc_str(const TopoDesc *td, char *s, size_t len);
+int torus_align_id(const Topology *t, int src_id, int dst_id,
+                   int move_direction);
+Topology topology_torus(const TopoDesc *desc);
+Topology topology_hyperx(const TopoDesc *desc);
+Topology topology_build(const TopoDesc *desc);
+int topology_layout(Topology *t, enum LayoutOrder order);
+
+static inline bool topo_is_hyperx(const TopoDesc *td)
+{
+    return td->type == TOP_HYPERX || td->type == TOP_FLATFLY;
+}
+
+// Coordinate of router 'id' along dimension 'dim'.
+static inline int topo_coord(const Topology *t, int id, int dim)
+{
+    return t->coords[id * t->desc.r + dim];
+}
 void topology_destroy(Topology *top);
+int topo_distance(const Topology *t, int a, int b);
 
 Connection conn_find_forward(Topology *t, RouterPortPair out_port);
 Connection conn_find_reverse(Topology *t, RouterPortPair in_port);
@@ -102,6 +175,8 @@ Connection conn_find_reverse(Topology *t, RouterPortPair in_port);
 enum TrafficType {
     TRF_UNIFORM_RANDOM,
     TRF_DESIGNATED,
+    TRF_HOTSPOT,
+    TRF_MATRIX, // communication matrix of placed ranks, see mapping.h
 };
 
 struct TrafficDesc {
@@ -111,6 +186,16 @@ struct TrafficDesc {
 
     TrafficType type; // traffic type
     std::vector<int> dests;       // destination table
+    int hotspot = -1;             // hotspot destination
+    double hotspot_frac = 0.0;    // fraction of packets sent to the hotspot
+    // Matrix only: the destinations of each source terminal and their
+    // cumulative weights, from comm_begin[src] to comm_begin[src + 1].
+    std::vector<int> comm_begin;
+    std::vector<double> comm_cdf;
+    std::vector<int> comm_dest;
+    // Mean interval of each source terminal, so that it injects in
+    // proportion to its total weight.
+    std::vector<double> comm_interval;
 };
 
 enum FlitType {
@@ -124,18 +209,31 @@ typedef struct RouteInfo {
     int dst;   // destination node ID
     std::vector<int> path; // series of output ports for this route
     size_t idx = 0;
+    unsigned ccw_dims = 0; // bitmask of dimensions routed counterclockwise
+    int detour_hop = -1;   // index in path of the second routing phase, if any
 } RouteInfo;
 
 /// Flit and credit encoding.
 /// Follows Fig. 16.13.
+struct PacketTrace;
 struct Flit {
     Flit(enum FlitType t, int vc, int src, int dst, PacketId pid, long flitnum);
+    ~Flit();
+    // A flit owns its trace, so copies would free it twice.
+    Flit(const Flit &) = delete;
+    Flit &operator=(const Flit &) = delete;
 
     enum FlitType type;
     long vc_num;
     RouteInfo route_info;
     PacketId packet_id;
     long flitnum;
+    long inject_time = -1; // cycle the head flit left the source queue
+    int qos_class = 0;     // traffic class
+    long msg_id = -1;      // NIC message the packet belongs to
+    bool ecn = false;      // congestion mark, on head flits
+    long gen_time = -1;    // cycle the packet was generated, on head flits
+    PacketTrace *trace = NULL; // per-hop trace, only on sampled head flits
 };
 
 char *flit_str(const Flit *flit, char *s);
@@ -160,12 +258,17 @@ typedef struct TimedCredit {
     Credit *credit;
 } TimedCredit;
 
+struct ChannelLink;
 struct Channel {
-    Channel(EventQueue *eq, long dl, const Connection conn);
+    Channel(EventQueue *eq, long dl, const Connection conn, Arena *arena);
     ~Channel();
 
     Connection conn;
-    EventQueue *eventq;
+    EventQueue *src_eventq; // of the upstream node
+    EventQueue *dst_eventq; // of the downstream node
+    ChannelLink *remote = NULL; // between partitions of the parallel engine
+    Event src_tick = {-1, -1}; // tick of the upstream node, for credits
+    Event dst_tick = {-1, -1}; // tick of the downstream node, for flits
     long delay;
     TimedFlit *buf = NULL;
     std::deque<TimedCredit> buf_credit;
@@ -174,22 +277,36 @@ struct Channel {
 
 Channel channel_create(EventQueue *eq, long dl, const Connection conn);
 void channel_put(Channel *ch, Flit *flit);
+void channel_put_delayed(Channel *ch, Flit *flit, long extra);
 void channel_put_credit(Channel *ch, Credit *credit);
 Flit *channel_get(Channel *ch);
 Credit *channel_get_credit(Channel *ch);
 void channel_destroy(Channel *ch);
 
 // Pipeline stages.
-enum PipelineStage {
+enum PipelineStage : uint8_t {
     PIPELINE_IDLE,
     PIPELINE_RC,
     PIPELINE_VA,
     PIPELINE_SA,
     PIPELINE_ST,
+    PIPELINE_STAGE_COUNT,
 };
 
+// Cycles spent in each stage, by PipelineStage.  PIPELINE_IDLE stands for the
+// buffer write, which always takes one cycle.
+constexpr int pipeline_cycles[PIPELINE_STAGE_COUNT] = {
+    1, ROUTER_RC_CYCLES, ROUTER_VA_CYCLES, ROUTER_SA_CYCLES, ROUTER_ST_CYCLES};
+static_assert(ROUTER_RC_CYCLES >= 0 && ROUTER_VA_CYCLES >= 0 &&
+                  ROUTER_SA_CYCLES >= 0 && ROUTER_ST_CYCLES >= 0,
+              "negative pipeline stage latency");
+// Whether any stage takes more than one cycle, so that input VCs have to
+// wait for 'ready'.
+constexpr bool pipeline_multicycle =
+    ROUTER_RC_CYCLES > 1 || ROUTER_VA_CYCLES > 1 || ROUTER_SA_CYCLES > 1;
+
 // Global states of each input/output unit.
-enum GlobalState {
+enum GlobalState : uint8_t {
     STATE_IDLE,
     STATE_ROUTING,
     STATE_VCWAIT,
@@ -199,84 +316,157 @@ enum GlobalState {
 
 char *globalstate_str(enum GlobalState state, char *s);
 
+// Input VCs and output VCs of all ports are stored in flat arrays in the
+// router, indexed by port * vc_count + vc.  Fields are ordered and sized to
+// keep each VC compact.
+//
 // credit_count is omitted in the input unit; it can be found in the output unit
 // instead.
-struct InputUnit {
-    InputUnit(int vc_count, int bufsize);
-
-    struct VC {
-        VC(int bufsize);
-        ~VC();
-
-        enum GlobalState global = STATE_IDLE;
-        enum GlobalState next_global = STATE_IDLE;
-        int route_port = -1;
-        int output_vc = -1;
-        enum PipelineStage stage = PIPELINE_IDLE;
-        Flit **buf = NULL;
-        Flit *st_ready = NULL;
-    };
-    std::vector<VC> vcs;
+struct InputVC {
+    InputVC(int bufsize, Arena *arena);
+    ~InputVC();
+
+    Flit **buf = NULL;
+    Flit *st_ready = NULL;
+    long ready = 0; // cycle the current stage completes at, if multi-cycle
+    int16_t route_port = -1;
+    int16_t output_vc = -1;
+    int16_t st_port = -1; // route_port and output_vc of st_ready
+    int16_t st_vc = -1;
+    enum GlobalState global = STATE_IDLE;
+    enum GlobalState next_global = STATE_IDLE;
+    enum PipelineStage stage = PIPELINE_IDLE;
+    bool drop = false;    // discarding a packet routed onto a failed link
+    bool st_drop = false; // st_ready is discarded instead of sent
 };
 
-struct OutputUnit {
-    OutputUnit(int vc_count, int bufsize);
-
-    struct VC {
-        VC(int bufsize);
-        ~VC();
-
-        enum GlobalState global = STATE_IDLE;
-        enum GlobalState next_global = STATE_IDLE;
-        int input_port = -1;
-        int input_vc = -1;
-        int credit_count;
-        bool buf_credit = false;
-    };
-    std::vector<VC> vcs;
+struct OutputVC {
+    OutputVC(int bufsize);
+
+    int credit_count;
+    int16_t input_port = -1;
+    int16_t input_vc = -1;
+    enum GlobalState global = STATE_IDLE;
+    enum GlobalState next_global = STATE_IDLE;
+    bool buf_credit = false;
 };
 
-Event tick_event_from_id(Id id);
+struct Router;
+struct FlightEvent;
+Event tick_event(const Router *r);
 
 struct RandomGenerator {
     RandomGenerator(int terminal_count, double mean_interval);
 
     std::default_random_engine def;
-    std::random_device rd;
+    // Seeded from std::random_device unless a seed is given with -seed, which
+    // makes runs reproducible.  The nodes draw from streams of their own
+    // derived from the same seed, see sim_seed().
+    std::mt19937_64 rng;
     std::uniform_int_distribution<int> uni_dist;
     std::exponential_distribution<> exp_dist;
 };
 
+// Random stream of a single node (SplitMix64).  Eight bytes, so that every
+// node can keep its own: the draws of a node then do not depend on the order
+// in which the nodes run.
+struct NodeRng {
+    typedef uint64_t result_type;
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+
+    result_type operator()()
+    {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t state = 0;
+};
+
+/// Configuration shared by all nodes of a simulation.
+struct Sim;
+enum RoutingMode {
+    ROUTING_DOR,      // dimension order, computed at the source
+    ROUTING_ADAPTIVE, // minimal, choosing among dimensions by local credits
+};
+
+enum DeadlockMode {
+    DEADLOCK_DATELINE, // two VC classes per ring, switched at the dateline
+    DEADLOCK_BUBBLE,   // one VC class; entering a ring needs two free packets
+};
+
+struct RouterConfig {
+    Sim *sim;
+    EventQueue *eventq; // simulator-global event queue
+    Stat *stat;
+    bool verbose;
+    int vc_count;           // number of VCs per channel
+    int vc_class_count;     // number of VC class for deadlock avoidance
+    int vc_phase_count = 1; // number of routing phases, each with its own
+                            // dateline classes
+    enum RoutingMode routing = ROUTING_DOR;
+    enum DeadlockMode deadlock = DEADLOCK_DATELINE; // torus only
+    long packet_len;        // length of a packet in flits
+    long input_buf_size;    // max size of each input flit queue
+    bool ledger = true;     // track packets in Stat::packet_ledger
+    Arena *arena;           // long-lived state of the simulation
+    const Topology *topology;
+    TrafficDesc traffic_desc{0};
+    RandomGenerator *rand_gen;
+};
+
 /// A router. It can represent any of a switch node, a source node and a
 /// destination node.
-struct Sim;
+///
+/// The state used by every tick comes first; the configuration is shared
+/// through 'cfg', and the state only used by terminal nodes comes last.
 struct Router {
-    Router(Sim &sim, EventQueue *eq, Stat *st, bool verbose, Id id, int radix,
-           int vc_count, TopoDesc td, TrafficDesc trd, RandomGenerator &rg,
-           long packet_len, Channel **in_chs, Channel **out_chs,
-           long input_buf_size);
+    Router(const RouterConfig *cfg, Id id, int radix, Channel **in_chs,
+           Channel **out_chs);
     ~Router();
 
     template <typename T> T &get_device() const;
 
-    Sim &sim;           // FIXME: not pretty
-    EventQueue *eventq; // reference to the simulator-global event queue
-    Stat *stat;
-    bool verbose;
-    bool deterministic = true;
-    Id id;                      // router ID
-    int radix;                  // radix
-    int vc_count;               // number of VCs per channel
-    int vc_class_count;         // number of VC class for deadlock avoidance
-    long flit_arrive_count = 0; // # of flits arrived for the destination node
-    long flit_depart_count = 0; // # of flits departed for the destination node
-    TopoDesc top_desc;
-    TrafficDesc traffic_desc;
-    RandomGenerator &rand_gen;
+    InputVC &ivc(int port, int vc) { return ivcs[port * vc_count + vc]; }
+    OutputVC &ovc(int port, int vc) { return ovcs[port * vc_count + vc]; }
+
+    const RouterConfig *cfg;
+    Id id;               // router ID
+    NodeIndex node = -1; // global node index, for events
+    int radix;           // radix
+    int vc_count;        // number of VCs per channel, same as cfg->vc_count
     long last_tick = -1; // prevents double-tick in a cycle
-    long packet_len;     // length of a packet in flits
     bool reschedule_next_tick =
         false; // marks whether to self-tick at the next cycle
+    Channel **input_channels;  // accessor to the input channels
+    Channel **output_channels; // accessor to the output channels
+    int input_count;           // length of input_channels
+    int output_count;          // length of output_channels
+    ArenaVector<InputVC> ivcs;  // input VCs, by port * vc_count + vc
+    ArenaVector<OutputVC> ovcs; // output VCs, by port * vc_count + vc
+    // Round-robin arbitration pointers, in a single block.
+    ArenaVector<int> last_grant;
+    int *va_last_grant_input;  // for each input VC
+    int *va_last_grant_output; // for each output VC
+    int *sa_last_grant_input;  // for each input VC
+    int *sa_last_grant_output; // for each output port
+    ArenaVector<int> qos_tokens; // per output port, QOS_MAXCLASS each
+    FlightEvent *flight = NULL;  // ring of recent events, see flight.h
+    long flight_pos = 0;         // events recorded so far
+    long flight_mask = 0;        // length of 'flight' minus one
+    NodeRng rng;                 // traffic generation and route ties
+
+    // Terminal nodes only.
+    bool deterministic = true;
+    long flit_arrive_count = 0; // # of flits arrived for the destination node
+    long flit_depart_count = 0; // # of flits departed for the destination node
+    // Source queues, and the current output VC of each, per traffic class.
+    ArenaVector<Flit **> source_queues;
+    ArenaVector<int> src_last_grant_output;
+    int dst_last_grant_input = 0; // for round-robin arbitration
     struct SourceGenInfo {
         double mean_interval = 1.0;
         bool packet_finished = true;
@@ -284,35 +474,27 @@ struct Router {
         double next_packet_start_frac = 0.0;
         long packet_counter = 0;
         long flitnum = 0; // n-th flit counter of a packet
+        int cur_dest = -1;  // destination of the packet being generated
+        PacketId cur_packet_id{-1, -1};
+        bool cur_retry = false; // the packet is a retransmission
+        int cur_qos_class = 0;  // traffic class of the packet
+        long cur_len = 0;       // length of the packet in flits
+        long cur_msg_id = -1;   // NIC message of the packet
     } sg;
-    Channel **input_channels;             // accessor to the input channels
-    Channel **output_channels;            // accessor to the output channels
-    long input_buf_size;                  // max size of each input flit queue
-    Flit **source_queue;                  // source queue
-    std::vector<InputUnit> input_units;   // input units
-    std::vector<OutputUnit> output_units; // output units
-    struct Allocator {
-    } alloc;
-    int src_last_grant_output; // for round-robin arbitration
-    int dst_last_grant_input; // for round-robin arbitration
-    std::vector<int>
-        va_last_grant_input; // for round-robin arbitration, for each input VC
-    std::vector<int>
-        va_last_grant_output; // for round-robin arbitration, for each output VC
-    std::vector<int>
-        sa_last_grant_input; // for round-robin arbitration, for each input VC
-    std::vector<int>
-        sa_last_grant_output; // for round-robin arbitration, for each output VC
 };
 
 void router_print_state(Router *r);
 
 // Events and scheduling.
+extern void (*const event_table[EVENT_TYPE_COUNT])(Router *);
+void source_tick(Router *r);
+void destination_tick(Router *r);
 void router_tick(Router *r);
 void router_reschedule(Router *r);
 
 // Routing.
-std::vector<int> source_route_compute(TopoDesc td, int src_id, int dst_id);
+std::vector<int> source_route_compute(Router *r, const Topology *top, int src_id,
+                                      int dst_id, unsigned *ccw_dims);
 
 // Pipeline stages.
 void source_generate(Router *r);
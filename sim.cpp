@@ -1,13 +1,30 @@
 #include "sim.h"
+#include "queue.h"
+#include "stats.h"
 #include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
+#include <algorithm>
 
 void print_conn(const char *name, Connection conn);
 
-Sim::Sim(bool verbose_mode, int debug_mode, Topology top, int terminal_count,
-         int router_count, int radix, int vc_count, double mean_interval, long input_buf_size)
-    : debug_mode(debug_mode), topology(top), traffic_desc(terminal_count),
-      rand_gen(terminal_count, mean_interval)
+void fatal(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    exit(EXIT_FAILURE);
+}
+
+Sim::Sim(bool verbose_mode, int debug_mode, Topology top, TrafficDesc traffic,
+         int terminal_count, int router_count, int radix, int vc_count,
+         double mean_interval, long input_buf_size, bool huge_pages)
+    : debug_mode(debug_mode), topology(top), traffic_desc(traffic),
+      rand_gen(terminal_count, mean_interval),
+      arena(arena_create(huge_pages)), channels(ArenaAllocator<Channel>(arena))
 {
     // Tornado pattern for 4-ring
     // traffic_desc = {TRF_DESIGNATED, std::vector<int>(terminal_count)};
@@ -21,97 +38,144 @@ Sim::Sim(bool verbose_mode, int debug_mode, Topology top, int terminal_count,
     // traffic_desc.dests[19] = 22;
     // traffic_desc.dests[20] = 15;
 
-    channel_delay = 1; /* FIXME hardcoded */
-    packet_len = 4; /* FIXME hardcoded */
+    // Terminal channels; ring links take the delays of the topology.  A NIC
+    // replaces the packet length with its MTU.
+    channel_delay = DEFAULT_CHANNEL_DELAY;
+    packet_len = DEFAULT_PACKET_LEN;
 
     // Initialize the event system
     eventq_init(&eventq);
 
+    config.sim = this;
+    config.eventq = &eventq;
+    config.stat = &stat;
+    config.verbose = verbose_mode;
+    config.vc_count = vc_count;
+    // Can only segregate VCs into classes if we do have multiple VCs.
+    // Dimension-order routes on a HyperX need no dateline classes.
+    config.vc_class_count =
+        (vc_count > 1 && !topo_is_hyperx(&top.desc)) ? 2 : 1;
+    config.packet_len = packet_len;
+    config.input_buf_size = input_buf_size;
+    config.arena = arena;
+    config.topology = &topology;
+    config.traffic_desc = traffic_desc;
+    config.rand_gen = &rand_gen;
+
     // Initialize channels
-    channels.reserve(hmlen(top.forward_hash));
-    for (ptrdiff_t i = 0; i < hmlen(top.forward_hash); i++) {
-        Connection conn = top.forward_hash[i].value;
-        // printf("Found connection: %d.%d.%d -> %d.%d.%d\n", conn.src.id.type, conn.src.id.value,
-        //        conn.src.port, conn.dst.id.type, conn.dst.id.value, conn.dst.port);
-        channels.emplace_back(&eventq, channel_delay, conn);
-        // channels.emplace_back(&eventq, channel_delay, conn);
-    }
-    channel_map = NULL;
-    for (size_t i = 0; i < channels.size(); i++) {
-        Channel *ch = &channels[i];
-        hmput(channel_map, ch->conn.uniq, ch);
-    }
-
-    // Initialize terminal nodes
-    for (int id = 0; id < terminal_count; id++) {
-        // Terminal nodes only have a single port.  Also, destination nodes
-        // doesn't have output ports!
-        Channel **src_in_chs = NULL; // empty
-        Channel **src_out_chs = NULL;
-        Channel **dst_in_chs = NULL;
-        Channel **dst_out_chs = NULL; // empty
-
-        RouterPortPair src_rpp = {src_id(id), 0};
-        RouterPortPair dst_rpp = {dst_id(id), 0};
-        Connection src_conn = conn_find_forward(&top, src_rpp);
-        Connection dst_conn = conn_find_reverse(&top, dst_rpp);
-        assert(src_conn.src.port != -1 && "Source is not connected!");
-        assert(dst_conn.src.port != -1 && "Destination is not connected!");
-        long src_idx = hmgeti(channel_map, src_conn.uniq);
-        long dst_idx = hmgeti(channel_map, dst_conn.uniq);
-        assert(src_idx >= 0);
-        assert(dst_idx >= 0);
-        Channel *src_out_ch = channel_map[src_idx].value;
-        Channel *dst_in_ch = channel_map[dst_idx].value;
-
-        arrput(src_out_chs, src_out_ch);
-        arrput(dst_in_chs, dst_in_ch);
-
-        src_nodes.push_back(std::make_unique<Router>(
-            *this, &eventq, &stat, verbose_mode, src_id(id), 1, vc_count, top.desc,
-            traffic_desc, rand_gen, packet_len, src_in_chs, src_out_chs,
-            input_buf_size));
-        dst_nodes.push_back(std::make_unique<Router>(
-            *this, &eventq, &stat, verbose_mode, dst_id(id), 1, vc_count, top.desc,
-            traffic_desc, rand_gen, packet_len, dst_in_chs, dst_out_chs,
-            input_buf_size));
-
-        arrfree(src_in_chs);
-        arrfree(src_out_chs);
-        arrfree(dst_in_chs);
-        arrfree(dst_out_chs);
-    }
-
-    // Initialize router nodes
-    for (int id = 0; id < router_count; id++) {
+    channels.reserve(arrlen(top.conns));
+    for (ptrdiff_t i = 0; i < arrlen(top.conns); i++) {
+        Connection conn = top.conns[i];
+        assert(conn.uniq == i);
+        // Router links take the latency of their dimension.
+        long delay = channel_delay;
+        if (is_rtr(conn.src.id) && is_rtr(conn.dst.id)) {
+            delay = top.desc.delay[topo_port_dim(&top.desc, conn.src.port)];
+        }
+        channels.emplace_back(&eventq, delay, conn, arena);
+    }
+
+    // Initialize the nodes.  Each router is allocated right after its
+    // terminals, in the layout order of the topology, so that the nodes that
+    // talk to each other are mostly near each other in memory.
+    int conc = top.desc.concentration;
+    assert(terminal_count == router_count * conc);
+    src_nodes.resize(terminal_count);
+    dst_nodes.resize(terminal_count);
+    routers.resize(router_count);
+    for (int i = 0; i < router_count; i++) {
+        int rid = top.layout ? top.layout[i] : i;
+
+        for (int id = rid * conc; id < (rid + 1) * conc; id++) {
+            // Terminal nodes only have a single port.  Also, destination
+            // nodes doesn't have output ports!
+            Channel **src_in_chs = NULL; // empty
+            Channel **src_out_chs = NULL;
+            Channel **dst_in_chs = NULL;
+            Channel **dst_out_chs = NULL; // empty
+
+            RouterPortPair src_rpp = {src_id(id), 0};
+            RouterPortPair dst_rpp = {dst_id(id), 0};
+            Connection src_conn = conn_find_forward(&top, src_rpp);
+            Connection dst_conn = conn_find_reverse(&top, dst_rpp);
+            assert(src_conn.src.port != -1 && "Source is not connected!");
+            assert(dst_conn.src.port != -1 && "Destination is not connected!");
+            Channel *src_out_ch = &channels[src_conn.uniq];
+            Channel *dst_in_ch = &channels[dst_conn.uniq];
+
+            arrput(src_out_chs, src_out_ch);
+            arrput(dst_in_chs, dst_in_ch);
+
+            src_nodes[id] = NodePtr(arena_new<Router>(
+                arena, &config, src_id(id), 1, src_in_chs, src_out_chs));
+            dst_nodes[id] = NodePtr(arena_new<Router>(
+                arena, &config, dst_id(id), 1, dst_in_chs, dst_out_chs));
+
+            arrfree(src_in_chs);
+            arrfree(src_out_chs);
+            arrfree(dst_in_chs);
+            arrfree(dst_out_chs);
+        }
+
         Channel **in_chs = NULL;
         Channel **out_chs = NULL;
 
         for (int port = 0; port < radix; port++) {
-            RouterPortPair rpp = {rtr_id(id), port};
+            RouterPortPair rpp = {rtr_id(rid), port};
             Connection output_conn = conn_find_forward(&top, rpp);
             Connection input_conn = conn_find_reverse(&top, rpp);
             assert(output_conn.src.port != -1);
             assert(input_conn.src.port != -1);
-            long out_idx = hmgeti(channel_map, output_conn.uniq);
-            long in_idx = hmgeti(channel_map, input_conn.uniq);
-            assert(out_idx >= 0);
-            assert(in_idx >= 0);
-            Channel *out_ch = channel_map[out_idx].value;
-            Channel *in_ch = channel_map[in_idx].value;
+            Channel *out_ch = &channels[output_conn.uniq];
+            Channel *in_ch = &channels[input_conn.uniq];
 
             arrput(out_chs, out_ch);
             arrput(in_chs, in_ch);
         }
 
-        routers.push_back(std::make_unique<Router>(
-            *this, &eventq, &stat, verbose_mode, rtr_id(id), radix, vc_count,
-            top.desc, traffic_desc, rand_gen, packet_len, in_chs, out_chs,
-            input_buf_size));
+        routers[rid] = NodePtr(arena_new<Router>(arena, &config, rtr_id(rid),
+                                                 radix, in_chs, out_chs));
 
         arrfree(in_chs);
         arrfree(out_chs);
     }
+
+    // Lay out the global node index: sources, destinations, then routers.
+    nodes.reserve(src_nodes.size() + dst_nodes.size() + routers.size());
+    for (auto *group : {&src_nodes, &dst_nodes, &routers}) {
+        for (auto &node : *group) {
+            node->node = static_cast<NodeIndex>(nodes.size());
+            nodes.push_back(node.get());
+        }
+    }
+    // Channels wake up their endpoints directly.
+    for (Router *node : nodes) {
+        Event tick = tick_event(node);
+        for (int port = 0; port < node->output_count; port++) {
+            node->output_channels[port]->src_tick = tick;
+        }
+        for (int port = 0; port < node->input_count; port++) {
+            node->input_channels[port]->dst_tick = tick;
+        }
+    }
+    sim_seed(this, rand_gen.rng());
+}
+
+// Seed the random streams: the simulation's, and that of every node from the
+// seed and the node's ID, so that runs do not depend on the order in which
+// the nodes run, on their layout or on the partitions of a parallel run.
+void sim_seed(Sim *sim, uint64_t seed)
+{
+    sim->rand_gen.rng.seed(seed);
+    for (Router *node : sim->nodes) {
+        std::seed_seq seq{static_cast<uint32_t>(seed),
+                          static_cast<uint32_t>(seed >> 32),
+                          static_cast<uint32_t>(node->id.type),
+                          static_cast<uint32_t>(node->id.value)};
+        uint32_t w[2];
+        seq.generate(w, w + 2);
+        node->rng.state = static_cast<uint64_t>(w[1]) << 32 | w[0];
+    }
 }
 
 void sim_run_until(Sim *sim, long until)
@@ -123,8 +187,17 @@ void sim_run_until(Sim *sim, long until)
         if (0 <= until && until < next_time(&sim->eventq)) {
             break;
         }
+        // Sample at cycle boundaries, before any event of the new cycle.
+        if (sim->congestion && next_time(&sim->eventq) >= sim->congestion->next_sample) {
+            congestion_sample(sim->congestion, sim);
+            while (sim->congestion->next_sample <= next_time(&sim->eventq))
+                sim->congestion->next_sample += sim->congestion->period;
+        }
+        if (sim->faults && next_time(&sim->eventq) >= fault_next_time(sim->faults)) {
+            fault_apply_due(sim, next_time(&sim->eventq));
+        }
         Event e = eventq_pop(&sim->eventq);
-        if (sim->eventq.curr_time() != last_print_cycle &&
+        if (sim->progress && sim->eventq.curr_time() != last_print_cycle &&
             sim->eventq.curr_time() % 100 == 0) {
             printf("[@%3ld/%3ld]\n", sim->eventq.curr_time(), until);
             last_print_cycle = sim->eventq.curr_time();
@@ -133,11 +206,187 @@ void sim_run_until(Sim *sim, long until)
     }
 }
 
+// Hash of where the flits of packet 'pid' are, which changes whenever one of
+// them moves.  With 'print' set, they are listed as well.
+static uint64_t packet_locate(Sim *sim, PacketId pid, bool print)
+{
+    char s[IDSTRLEN];
+    uint64_t h = 14695981039346656037ull;
+    auto found = [&](long place, long index, const Flit *flit) {
+        for (long v : {place, index, flit->flitnum}) {
+            h ^= static_cast<uint64_t>(v);
+            h *= 1099511628211ull;
+        }
+    };
+    auto match = [&](const Flit *flit) {
+        return flit && flit->packet_id.src == pid.src &&
+               flit->packet_id.id == pid.id;
+    };
+
+    for (Router *r : sim->nodes) {
+        for (size_t c = 0; c < r->source_queues.size(); c++) {
+            Flit **q = r->source_queues[c];
+            for (long i = queue_fronti(q); i != queue_backi(q);
+                 i = (i + 1) % queue_cap(q)) {
+                if (!match(q[i]))
+                    continue;
+                found(r->node, -1 - static_cast<long>(c), q[i]);
+                if (print)
+                    printf("  flit %ld: source queue %zu of %s\n",
+                           q[i]->flitnum, c, id_str(r->id, s));
+            }
+        }
+        for (size_t v = 0; v < r->ivcs.size(); v++) {
+            InputVC &ivc = r->ivcs[v];
+            int port = static_cast<int>(v) / r->vc_count;
+            int vc = static_cast<int>(v) % r->vc_count;
+            for (long i = queue_fronti(ivc.buf); i != queue_backi(ivc.buf);
+                 i = (i + 1) % queue_cap(ivc.buf)) {
+                if (!match(ivc.buf[i]))
+                    continue;
+                found(r->node, static_cast<long>(v), ivc.buf[i]);
+                if (print)
+                    printf("  flit %ld: %s input %d VC%d\n",
+                           ivc.buf[i]->flitnum, id_str(r->id, s), port, vc);
+            }
+            if (match(ivc.st_ready)) {
+                found(r->node, static_cast<long>(r->ivcs.size() + v),
+                      ivc.st_ready);
+                if (print)
+                    printf("  flit %ld: %s input %d VC%d, in switch traversal "
+                           "to output %d\n",
+                           ivc.st_ready->flitnum, id_str(r->id, s), port, vc,
+                           ivc.st_port);
+            }
+        }
+    }
+    for (Channel &ch : sim->channels) {
+        for (long i = queue_fronti(ch.buf); i != queue_backi(ch.buf);
+             i = (i + 1) % queue_cap(ch.buf)) {
+            if (!match(ch.buf[i].flit))
+                continue;
+            found(static_cast<long>(sim->nodes.size()) + ch.conn.uniq, 0,
+                  ch.buf[i].flit);
+            if (print) {
+                char t[IDSTRLEN];
+                printf("  flit %ld: channel %s:%d -> %s:%d, arriving at %ld\n",
+                       ch.buf[i].flit->flitnum, id_str(ch.conn.src.id, s),
+                       ch.conn.src.port, id_str(ch.conn.dst.id, t),
+                       ch.conn.dst.port, ch.buf[i].time);
+            }
+        }
+    }
+    return h;
+}
+
+// Parse "SRC ID" of a packet from the remaining tokens.
+static int parse_packet(PacketId *pid)
+{
+    char *src = strtok(NULL, " ");
+    char *id = strtok(NULL, " ");
+    if (!src || !id) {
+        printf("Expected a packet: SRC ID.\n");
+        return -1;
+    }
+    char *end1, *end2;
+    pid->src = strtol(src, &end1, 10);
+    pid->id = strtol(id, &end2, 10);
+    if (*end1 != '\0' || *end2 != '\0') {
+        printf("Invalid packet.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Run up to cycle 'until' in the debugger, taking snapshots on the way.
+// Returns false in a snapshot that was resumed instead; the command that was
+// running is then dropped, and the request the snapshot was resumed for is
+// served from the prompt.
+static bool debug_run(Sim *sim, long until)
+{
+    SnapshotState *ss = sim->snapshots;
+    if (!ss) {
+        sim_run_until(sim, until);
+        return true;
+    }
+    long end = (until < 0) ? LONG_MAX : until;
+    while (!eventq_empty(&sim->eventq) && next_time(&sim->eventq) <= end) {
+        if (next_time(&sim->eventq) >= ss->next &&
+            snapshot_take(ss, next_time(&sim->eventq))) {
+            return false;
+        }
+        sim_run_until(sim, std::min(end, ss->next - 1));
+    }
+    return true;
+}
+
+// Go back to the end of cycle 'target'.  Returns only if it cannot.
+static void debug_goto(Sim *sim, long target)
+{
+    SnapshotState *ss = sim->snapshots;
+    int k = snapshot_find(ss, target + 1);
+    if (k < 0) {
+        printf("No snapshot before cycle %ld.\n", target);
+        return;
+    }
+    SnapshotRequest req = {};
+    req.goal = SNAP_GOTO;
+    req.target = target;
+    snapshot_restore(ss, k, &req);
+}
+
+// Serve the request this process was resumed from a snapshot for.
+static void debug_serve(Sim *sim)
+{
+    SnapshotState *ss = sim->snapshots;
+    SnapshotRequest req = ss->request;
+    ss->pending = false;
+
+    if (req.goal == SNAP_GOTO) {
+        debug_run(sim, req.target);
+        return;
+    }
+
+    // Re-execute the cycles from this snapshot up to the target one by one,
+    // and go back to the last one that moved the packet.
+    int k = static_cast<int>(ss->snaps.size()) - 1;
+    long start = ss->snaps[k].time;
+    uint64_t prev = packet_locate(sim, req.pid, false);
+    long last = -1;
+    for (long c = start; c < req.target; c++) {
+        if (!debug_run(sim, c))
+            return;
+        uint64_t h = packet_locate(sim, req.pid, false);
+        if (h != prev)
+            last = c;
+        prev = h;
+    }
+    if (last >= 0) {
+        req.goal = SNAP_GOTO;
+        req.target = last;
+        snapshot_restore(ss, k, &req);
+    } else if (k > 0) {
+        req.target = start;
+        snapshot_restore(ss, k - 1, &req);
+    } else {
+        printf("Packet %ld,%ld did not move before cycle %ld.\n", req.pid.src,
+               req.pid.id, req.origin);
+        req.goal = SNAP_GOTO;
+        req.target = req.origin;
+        snapshot_restore(ss, k, &req);
+    }
+}
+
 // Returns 1 if the simulation is NOT terminated, 0 otherwise.
 int sim_debug_step(Sim *sim)
 {
     char line[1024] = {0};
 
+    if (sim->snapshots && sim->snapshots->pending) {
+        debug_serve(sim);
+        return 1;
+    }
+
     printf("(@%ld) > ", curr_time(&sim->eventq));
     if (fgets(line, 100, stdin) == NULL)
         return 0;
@@ -150,7 +399,7 @@ int sim_debug_step(Sim *sim)
         return 1;
     } else if (!strcmp(line, "n")) {
         long until = curr_time(&sim->eventq);
-        sim_run_until(sim, until + 1);
+        debug_run(sim, until + 1);
         return 1;
     } else if (!strcmp(line, "p")) {
         for (size_t i = 0; i < sim->routers.size(); i++) {
@@ -173,7 +422,57 @@ int sim_debug_step(Sim *sim)
             printf("Invalid command.\n");
             return 1;
         }
-        sim_run_until(sim, until);
+        debug_run(sim, until);
+        return 1;
+    } else if (!strcmp(tok, "w")) {
+        // Where the flits of a packet are.
+        PacketId pid;
+        if (parse_packet(&pid) == 0)
+            packet_locate(sim, pid, true);
+        return 1;
+    } else if (!strcmp(tok, "rn") || !strcmp(tok, "rc")) {
+        // Reverse step, and reverse continue to a cycle or to the last move
+        // of a packet.
+        long now = curr_time(&sim->eventq);
+        if (!sim->snapshots) {
+            printf("Snapshots are disabled.\n");
+            return 1;
+        }
+        if (!strcmp(tok, "rn")) {
+            if (now <= 0) {
+                printf("Already at the start.\n");
+                return 1;
+            }
+            debug_goto(sim, now - 1);
+            return 1;
+        }
+        tok = strtok(NULL, " ");
+        if (!tok) {
+            printf("No argument given.\n");
+            return 1;
+        }
+        if (!strcmp(tok, "pkt")) {
+            SnapshotRequest req = {};
+            req.goal = SNAP_SEARCH;
+            req.target = now;
+            req.origin = now;
+            if (parse_packet(&req.pid) != 0)
+                return 1;
+            int k = snapshot_find(sim->snapshots, now);
+            if (k < 0) {
+                printf("No snapshot before cycle %ld.\n", now);
+                return 1;
+            }
+            snapshot_restore(sim->snapshots, k, &req);
+            return 1;
+        }
+        char *endptr;
+        long target = strtol(tok, &endptr, 10);
+        if (*endptr != '\0' || target < 0 || target >= now) {
+            printf("Invalid cycle.\n");
+            return 1;
+        }
+        debug_goto(sim, target);
         return 1;
     }
 
@@ -185,8 +484,11 @@ int sim_debug_step(Sim *sim)
 // Run the simulator.
 void sim_run(Sim *sim, long until)
 {
+    flight_enter(sim->flight);
     if (sim->debug_mode) {
         while (sim_debug_step(sim));
+    } else if (sim->par) {
+        par_run(sim, until);
     } else {
         sim_run_until(sim, until);
     }
@@ -203,18 +505,118 @@ void channel_xy_load(Sim *sim) {
             continue;
         }
 
-        int dimension = 0;
-        for (; dimension < sim->topology.desc.r; dimension++) {
-            int src_id = torus_id_xyz_get(ch.conn.src.id.value, sim->topology.desc.k, dimension);
-            int dst_id = torus_id_xyz_get(ch.conn.dst.id.value, sim->topology.desc.k, dimension);
-            if (src_id == dst_id) {
-                break;
-            }
-        }
+        int dimension = topo_port_dim(&sim->topology.desc, ch.conn.src.port);
         printf("channel direction=%d, load=%ld\n", dimension, ch.load_count);
     }
 }
 
+// Whether source 'i' had packets to send: starved sources may never get to
+// send a flit, but then have some queued.
+static bool source_active(const Sim *sim, size_t i)
+{
+    const Router *src = sim->src_nodes[i].get();
+    if (src->flit_depart_count > 0) {
+        return true;
+    }
+    for (Flit **q : src->source_queues) {
+        if (!queue_empty(q)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Accepted throughput of source 'i' in flits/cycle.
+static double source_throughput(const Sim *sim, size_t i)
+{
+    long cycles = curr_time(&sim->eventq);
+    const std::vector<long> &arrive = sim->stat.src_flit_arrive;
+    if (cycles <= 0 || i >= arrive.size()) {
+        return 0.0;
+    }
+    return static_cast<double>(arrive[i]) / cycles;
+}
+
+Fairness sim_fairness(const Sim *sim)
+{
+    Fairness f;
+    double sum = 0.0, sum_sq = 0.0;
+    for (size_t i = 0; i < sim->src_nodes.size(); i++) {
+        if (!source_active(sim, i)) {
+            continue;
+        }
+        double t = source_throughput(sim, i);
+        f.min = f.sources == 0 ? t : std::min(f.min, t);
+        f.max = std::max(f.max, t);
+        sum += t;
+        sum_sq += t * t;
+        f.sources++;
+    }
+    if (f.sources > 0) {
+        f.mean = sum / f.sources;
+        f.jain = sum_sq > 0.0 ? sum * sum / (f.sources * sum_sq) : 1.0;
+    }
+    return f;
+}
+
+// Number of worst-served sources to list.
+#define FAIRNESS_WORST 5
+
+static void fairness_report(const Sim *sim)
+{
+    char s[IDSTRLEN];
+    Fairness f = sim_fairness(sim);
+
+    printf("\n");
+    printf("==== FAIRNESS ====\n");
+    printf("Active sources: %ld of %zu\n", f.sources, sim->src_nodes.size());
+    printf("Accepted throughput: min %lf, mean %lf, max %lf flits/cycle\n",
+           f.min, f.mean, f.max);
+    printf("Jain's fairness index: %lf\n", f.jain);
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < sim->src_nodes.size(); i++) {
+        if (source_active(sim, i)) {
+            order.push_back(i);
+        }
+    }
+    size_t worst = std::min(order.size(), static_cast<size_t>(FAIRNESS_WORST));
+    std::partial_sort(order.begin(), order.begin() + worst, order.end(),
+                      [sim](size_t a, size_t b) {
+                          return source_throughput(sim, a) <
+                                 source_throughput(sim, b);
+                      });
+    printf("Worst-served sources:");
+    for (size_t i = 0; i < worst; i++) {
+        printf(" [%s] %lf", id_str(sim->src_nodes[order[i]]->id, s),
+               source_throughput(sim, order[i]));
+    }
+    printf("\n");
+
+    // Latency of the flows grouped by how far apart their ends are, e.g. the
+    // sources along the chain of a parking lot.
+    printf("\n");
+    printf("%5s %10s %9s %6s %6s %6s %6s\n", "hops", "packets", "latency",
+           "p50", "p99", "p99.9", "max");
+    const std::vector<std::vector<long>> &hists = sim->stat.dist_latency_hist;
+    for (size_t d = 0; d < hists.size(); d++) {
+        long count = 0, sum = 0;
+        for (size_t lat = 0; lat < hists[d].size(); lat++) {
+            count += hists[d][lat];
+            sum += hists[d][lat] * static_cast<long>(lat);
+        }
+        if (count == 0) {
+            continue;
+        }
+        printf("%5zu %10ld %9.3lf %6ld %6ld %6ld %6ld\n", d, count,
+               static_cast<double>(sum) / count,
+               hist_percentile(hists[d], count, 0.5),
+               hist_percentile(hists[d], count, 0.99),
+               hist_percentile(hists[d], count, 0.999),
+               static_cast<long>(hists[d].size()) - 1);
+    }
+}
+
 void sim_report(Sim *sim) {
     char s[IDSTRLEN];
 
@@ -225,9 +627,20 @@ void sim_report(Sim *sim) {
     printf("\n");
     printf("==== SIMULATION RESULT ====\n");
 
-    printf("Topology: %d-ary %d-torus\n", sim->topology.desc.k, sim->topology.desc.r); 
+    char topo[64];
+    printf("Topology: %s\n",
+           topo_desc_str(&sim->topology.desc, topo, sizeof(topo)));
     printf("Radix: %d\n", r.radix); 
     printf("# of VCs per channel: %d\n", r.vc_count); 
+    printf("# of VC classes: %d\n", sim->config.vc_class_count);
+    printf("Input buffer: %ld flits per VC\n", sim->config.input_buf_size);
+    printf("Router pipeline: RC %d, VA %d, SA %d, ST %d cycles\n",
+           ROUTER_RC_CYCLES, ROUTER_VA_CYCLES, ROUTER_SA_CYCLES,
+           ROUTER_ST_CYCLES);
+    if (sim->topology.desc.type == TOP_TORUS) {
+        printf("Deadlock avoidance: %s\n",
+               sim->config.deadlock == DEADLOCK_BUBBLE ? "bubble" : "dateline");
+    }
     printf("# of total cycle: %ld\n", curr_time(&sim->eventq));
     printf("# of double ticks: %ld\n", sim->stat.double_tick_count);
     printf("\n");
@@ -256,28 +669,106 @@ void sim_report(Sim *sim) {
     float latency_avg = static_cast<float>(sim->stat.latency_sum) /
                         static_cast<float>(sim->stat.packet_arrive_count);
     printf("Average latency: %lf\n", latency_avg);
+    long queued = 0, queued_max = 0;
+    for (auto &src : sim->src_nodes) {
+        long n = 0;
+        for (Flit **q : src->source_queues)
+            n += queue_len(q);
+        queued += n;
+        queued_max = std::max(queued_max, n);
+    }
+    printf("Source queue length at end: %lf flits (max %ld)\n",
+           static_cast<double>(queued) / sim->src_nodes.size(), queued_max);
 
     // channel_xy_load(sim);
+
+    fairness_report(sim);
+
+    if (sim->tracer) {
+        tracer_report(sim->tracer);
+    }
+    if (sim->congestion) {
+        congestion_report(sim->congestion, curr_time(&sim->eventq));
+    }
+    if (sim->cc) {
+        cc_report(sim->cc);
+    }
+    if (sim->nic) {
+        nic_report(sim->nic, curr_time(&sim->eventq),
+                   static_cast<long>(sim->src_nodes.size()));
+    }
+    if (sim->qos) {
+        qos_report(sim->qos, curr_time(&sim->eventq),
+                   static_cast<long>(sim->src_nodes.size()));
+    }
+    if (sim->faults) {
+        fault_report(sim);
+    }
+    if (sim->par) {
+        par_report(sim->par);
+    }
 }
 
 // Process an event.
 void sim_process(Sim *sim, Event e)
 {
-    if (is_src(e.id)) {
-        e.f(sim->src_nodes[e.id.value].get());
-    } else if (is_dst(e.id)) {
-        e.f(sim->dst_nodes[e.id.value].get());
-    } else if (is_rtr(e.id)) {
-        e.f(sim->routers[e.id.value].get());
-    } else {
-        assert(0);
-    }
+    assert(e.node >= 0 && static_cast<size_t>(e.node) < sim->nodes.size());
+    flight_node = e.node;
+    event_table[e.type](sim->nodes[e.node]);
 }
 
 void sim_destroy(Sim *sim)
 {
-    hmfree(sim->channel_map);
+    if (sim->recorder) {
+        recorder_destroy(sim->recorder);
+        sim->recorder = NULL;
+    }
+    if (sim->tracer) {
+        tracer_destroy(sim->tracer);
+        sim->tracer = NULL;
+    }
+    if (sim->congestion) {
+        congestion_destroy(sim->congestion);
+        sim->congestion = NULL;
+    }
+    if (sim->cc) {
+        cc_destroy(sim->cc);
+        sim->cc = NULL;
+    }
+    if (sim->nic) {
+        nic_destroy(sim->nic);
+        sim->nic = NULL;
+    }
+    if (sim->qos) {
+        qos_destroy(sim->qos);
+        sim->qos = NULL;
+    }
+    if (sim->faults) {
+        fault_destroy(sim->faults);
+        sim->faults = NULL;
+    }
+    if (sim->par) {
+        par_destroy(sim);
+        sim->par = NULL;
+    }
+    if (sim->snapshots) {
+        snapshot_destroy(sim->snapshots);
+        sim->snapshots = NULL;
+    }
+    if (sim->flight) {
+        flight_destroy(sim->flight);
+        sim->flight = NULL;
+    }
 
     // Stat
     eventq_destroy(&sim->eventq);
+
+    // Destroy everything in the arena, then release it in one go.
+    sim->nodes.clear();
+    sim->routers.clear();
+    sim->src_nodes.clear();
+    sim->dst_nodes.clear();
+    sim->channels.clear();
+    arena_destroy(sim->arena);
+    sim->arena = NULL;
 }
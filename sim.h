@@ -3,20 +3,33 @@
 
 #include "event.h"
 #include "router.h"
+#include "record.h"
+#include "trace.h"
+#include "congestion.h"
+#include "fault.h"
+#include "nic.h"
+#include "cc.h"
+#include "arena.h"
+#include "par.h"
+#include "snapshot.h"
+#include "flight.h"
 #include <vector>
 #include <memory>
 
+// Length of a packet in flits.
+#define DEFAULT_PACKET_LEN 4
+// Link traversal latency in cycles.
+#define DEFAULT_CHANNEL_DELAY 1
+
 void fatal(const char *fmt, ...);
 
-typedef struct ChannelMap {
-    int key;
-    Channel *value;
-} ChannelMap;
+// Nodes are constructed in the arena of their simulation.
+typedef std::unique_ptr<Router, ArenaDelete> NodePtr;
 
 typedef struct Sim {
-    Sim(bool verbose_mode, int debug_mode, Topology top, int terminal_count,
-        int router_count, int radix, int vc_count, double mean_interval,
-        long input_buf_size);
+    Sim(bool verbose_mode, int debug_mode, Topology top, TrafficDesc traffic,
+        int terminal_count, int router_count, int radix, int vc_count,
+        double mean_interval, long input_buf_size, bool huge_pages);
 
     EventQueue eventq; // global event queue
     Stat stat;
@@ -27,15 +40,40 @@ typedef struct Sim {
     long input_buf_size; // router input buffer size
     long channel_delay;
     long packet_len;    // length of a packet in flits
-    ChannelMap *channel_map;
-    std::vector<Channel> channels;
-    std::vector<std::unique_ptr<Router>> routers;
-    std::vector<std::unique_ptr<Router>> src_nodes;
-    std::vector<std::unique_ptr<Router>> dst_nodes;
+    RouterConfig config; // shared by all nodes
+    Arena *arena;        // long-lived state: nodes, channels and their queues
+    ArenaVector<Channel> channels; // indexed by Connection::uniq
+    std::vector<NodePtr> routers;
+    std::vector<NodePtr> src_nodes;
+    std::vector<NodePtr> dst_nodes;
+    std::vector<Router *> nodes; // all of the above, by global node index
+    PacketRecorder *recorder = NULL; // per-packet records, if enabled
+    Tracer *tracer = NULL;           // sampled per-hop traces, if enabled
+    CongestionMonitor *congestion = NULL; // congestion tree detection
+    FaultState *faults = NULL;       // link/router faults, if any
+    QosState *qos = NULL;            // traffic classes, if any
+    NicState *nic = NULL;            // network interfaces, if any
+    CcState *cc = NULL;              // injection control, if any
+    ParState *par = NULL;            // parallel engine, if used
+    SnapshotState *snapshots = NULL; // reverse execution, under -d
+    FlightRecorder *flight = NULL;   // recent events of every node, if kept
+    bool progress = true;            // print the cycle count as it runs
 } Sim;
 
+// Spread of the accepted throughput, in flits/cycle, over the sources that
+// had packets to send during the run.
+typedef struct Fairness {
+    long sources = 0;
+    double min = 0.0;
+    double max = 0.0;
+    double mean = 0.0;
+    double jain = 0.0; // Jain's index: 1 if all equal, 1/sources if one only
+} Fairness;
+
+void sim_seed(Sim *sim, uint64_t seed);
 void sim_run(Sim *sim, long until);
 void sim_process(Sim *sim, Event e);
+Fairness sim_fairness(const Sim *sim);
 void sim_report(Sim *sim);
 void sim_destroy(Sim *sim);
 
@@ -0,0 +1,150 @@
+#include "snapshot.h"
+#include "sim.h"
+#include <stdio.h>
+#include <signal.h>
+#include <unistd.h>
+
+SnapshotState *snapshot_create(long interval)
+{
+    if (interval <= 0)
+        fatal("snapshot: invalid interval: %ld\n", interval);
+
+    SnapshotState *ss = new SnapshotState;
+    ss->interval = interval;
+    ss->next = 0;
+    ss->root = getpid();
+    if (pipe(ss->session) != 0)
+        fatal("snapshot: cannot create a pipe\n");
+    // Snapshots are killed without being waited for.
+    signal(SIGCHLD, SIG_IGN);
+    // Commands must not be read ahead into a buffer that a snapshot would
+    // replay when resumed.
+    setvbuf(stdin, NULL, _IONBF, 0);
+    return ss;
+}
+
+// Wait on 'fd' as a snapshot taken at 'time'.  Returns in a fork of it every
+// time it is resumed, with the request pending; exits when the session ends.
+static void snapshot_wait(SnapshotState *ss, long time, int fd)
+{
+    for (;;) {
+        SnapshotRequest req;
+        if (read(fd, &req, sizeof(req)) != sizeof(req))
+            _exit(0);
+
+        int p[2];
+        if (pipe(p) != 0)
+            fatal("snapshot: cannot create a pipe\n");
+        pid_t pid = fork();
+        if (pid < 0)
+            fatal("snapshot: cannot fork\n");
+        if (pid == 0) {
+            close(fd);
+            close(p[0]);
+            // Forget the snapshots that the requester has dropped since.
+            std::vector<Snapshot> kept;
+            for (const Snapshot &s : ss->snaps) {
+                if (s.time % req.interval == 0)
+                    kept.push_back(s);
+                else
+                    close(s.fd);
+            }
+            kept.push_back({time, getppid(), p[1]});
+            ss->snaps = kept;
+            ss->interval = req.interval;
+            ss->next = time + req.interval;
+            ss->pending = true;
+            ss->request = req;
+            return;
+        }
+        close(p[1]);
+        close(fd);
+        fd = p[0];
+    }
+}
+
+// Take a snapshot before the events at 'time' are run.  Returns true if this
+// is the snapshot, resumed later with ss->request pending.
+bool snapshot_take(SnapshotState *ss, long time)
+{
+    long at = time / ss->interval * ss->interval;
+
+    fflush(NULL);
+    int p[2];
+    if (pipe(p) != 0)
+        fatal("snapshot: cannot create a pipe\n");
+    pid_t pid = fork();
+    if (pid < 0)
+        fatal("snapshot: cannot fork\n");
+    if (pid == 0) {
+        close(p[1]);
+        snapshot_wait(ss, at, p[0]);
+        return true;
+    }
+    close(p[0]);
+    ss->snaps.push_back({at, pid, p[1]});
+    ss->next = at + ss->interval;
+
+    if (ss->snaps.size() >= SNAPSHOT_MAX) {
+        ss->interval *= 2;
+        std::vector<Snapshot> kept;
+        for (const Snapshot &s : ss->snaps) {
+            if (s.time % ss->interval == 0) {
+                kept.push_back(s);
+            } else {
+                kill(s.pid, SIGKILL);
+                close(s.fd);
+            }
+        }
+        ss->snaps = kept;
+        ss->next = (at / ss->interval + 1) * ss->interval;
+    }
+    return false;
+}
+
+// Index of the latest snapshot taken at or before 'time', or -1.
+int snapshot_find(const SnapshotState *ss, long time)
+{
+    int i = static_cast<int>(ss->snaps.size()) - 1;
+    while (i >= 0 && ss->snaps[i].time > time)
+        i--;
+    return i;
+}
+
+// Resume the snapshot at 'index' for 'req', and leave it the session.  Does
+// not return.
+void snapshot_restore(SnapshotState *ss, int index, const SnapshotRequest *req)
+{
+    SnapshotRequest r = *req;
+    r.interval = ss->interval;
+
+    fflush(NULL);
+    for (size_t i = index + 1; i < ss->snaps.size(); i++)
+        kill(ss->snaps[i].pid, SIGKILL);
+    if (write(ss->snaps[index].fd, &r, sizeof(r)) != sizeof(r))
+        fatal("snapshot: cannot resume the snapshot at cycle %ld\n",
+              ss->snaps[index].time);
+    if (getpid() != ss->root)
+        _exit(0);
+
+    // The shell waits for this process, so stay until every other one in the
+    // session has exited.
+    for (const Snapshot &s : ss->snaps)
+        close(s.fd);
+    close(ss->session[1]);
+    char c;
+    while (read(ss->session[0], &c, 1) > 0)
+        ;
+    _exit(0);
+}
+
+void snapshot_destroy(SnapshotState *ss)
+{
+    for (const Snapshot &s : ss->snaps) {
+        kill(s.pid, SIGKILL);
+        close(s.fd);
+    }
+    close(ss->session[0]);
+    close(ss->session[1]);
+    delete ss;
+}
@@ -0,0 +1,65 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "router.h"
+#include <sys/types.h>
+#include <vector>
+
+// Snapshots for reverse execution in the debugger (-d).
+//
+// A snapshot is a fork() of the simulator taken at a cycle boundary, stopped
+// on a pipe until it is needed, so taking one only costs the pages that are
+// written afterwards.  Going back to cycle T resumes the latest snapshot
+// before T with a request, and the simulation re-executes deterministically
+// from there; a resumed snapshot forks again first, so it can be resumed any
+// number of times.  The process that went back exits, along with all the
+// snapshots newer than the one resumed.
+//
+// Snapshots are taken every 'interval' cycles, at multiples of it.  When
+// SNAPSHOT_MAX of them are alive, the interval doubles and the ones that are
+// no longer on a multiple of it are dropped, so that going back never
+// re-executes more than 'interval' cycles however long the run.
+//
+// Output written during re-executed cycles, such as packet records, is
+// written again.
+
+#define SNAPSHOT_MAX 64
+
+enum SnapshotGoal {
+    SNAP_GOTO,   // run to 'target'
+    SNAP_SEARCH, // look for the last move of 'pid' before 'target'
+};
+
+// What a snapshot is resumed for.
+typedef struct SnapshotRequest {
+    enum SnapshotGoal goal;
+    long target;
+    long origin;   // SNAP_SEARCH: cycle the search started from
+    PacketId pid;  // SNAP_SEARCH: packet searched for
+    long interval; // snapshot interval of the requester
+} SnapshotRequest;
+
+typedef struct Snapshot {
+    long time; // cycles before this one have been run
+    pid_t pid;
+    int fd;    // write end of the pipe it waits on
+} Snapshot;
+
+typedef struct SnapshotState {
+    long interval;
+    long next;                   // cycle of the next snapshot
+    std::vector<Snapshot> snaps; // by time
+    pid_t root;                  // the process the user started
+    int session[2];              // pipe held open by every process
+    bool pending = false;        // resumed for 'request', not yet served
+    SnapshotRequest request;
+} SnapshotState;
+
+SnapshotState *snapshot_create(long interval);
+bool snapshot_take(SnapshotState *ss, long time);
+int snapshot_find(const SnapshotState *ss, long time);
+void snapshot_restore(SnapshotState *ss, int index,
+                      const SnapshotRequest *req);
+void snapshot_destroy(SnapshotState *ss);
+
+#endif
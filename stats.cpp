@@ -0,0 +1,40 @@
+#include "stats.h"
+#include <algorithm>
+
+// Number of samples, counted from the smallest, up to the p-th percentile of
+// 'count' of them.
+static long percentile_rank(long count, double p)
+{
+    return std::max(1L, static_cast<long>(p * count + 0.5));
+}
+
+void hist_add(std::vector<long> *hist, long value)
+{
+    if (value >= static_cast<long>(hist->size()))
+        hist->resize(value + 1, 0);
+    (*hist)[value]++;
+}
+
+// 'count' is the number of samples in 'hist'.
+long hist_percentile(const std::vector<long> &hist, long count, double p)
+{
+    if (count <= 0)
+        return -1;
+    long target = percentile_rank(count, p);
+    long cum = 0;
+    for (size_t v = 0; v < hist.size(); v++) {
+        cum += hist[v];
+        if (cum >= target)
+            return static_cast<long>(v);
+    }
+    return -1;
+}
+
+// 'v' must be sorted.
+long sorted_percentile(const std::vector<long> &v, double p)
+{
+    if (v.empty())
+        return -1;
+    long rank = percentile_rank(static_cast<long>(v.size()), p);
+    return v[std::min(rank, static_cast<long>(v.size())) - 1];
+}
@@ -0,0 +1,17 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <vector>
+
+// Percentiles for the reports.
+//
+// Latencies are kept either as a histogram, where hist[v] counts the samples
+// equal to v, or as a sorted vector of the samples.  Both use the nearest
+// rank: the p-th percentile is the smallest sample that at least a fraction p
+// of the samples do not exceed.  -1 if there are no samples.
+
+void hist_add(std::vector<long> *hist, long value);
+long hist_percentile(const std::vector<long> &hist, long count, double p);
+long sorted_percentile(const std::vector<long> &v, double p);
+
+#endif
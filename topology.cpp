@@ -1,83 +1,244 @@
 #include "router.h"
 #include <assert.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <numeric>
 
-// Get the component of id along 'direction' axis.
-int torus_id_xyz_get(int id, int k, int direction)
+// Describe a torus with ring length k[d] and link latency delay[d] along
+// dimension d.  Router IDs are mixed-radix numbers, dimension 0 varying
+// fastest.
+TopoDesc topo_desc_torus(int r, const int *k, const long *delay)
 {
-    int val = id;
-    for (int i = 0; i < direction; i++)
-        val /= k;
-    return val % k;
+    assert(r > 0 && r <= TOPO_MAXDIM);
+    TopoDesc td;
+    memset(&td, 0, sizeof(TopoDesc));
+    td.type = TOP_TORUS;
+    td.r = r;
+    int stride = 1;
+    for (int d = 0; d < r; d++) {
+        assert(k[d] > 0);
+        td.k[d] = k[d];
+        td.stride[d] = stride;
+        td.delay[d] = delay[d];
+        stride *= k[d];
+    }
+    td.concentration = 1;
+    return td;
 }
 
-// Set the component of id along 'direction' axis to 'component'.
-int torus_id_xyz_set(int id, int k, int direction, int component)
+// Describe a HyperX with k[d] routers along dimension d, each fully connected
+// to the others in the same dimension by mult[d] parallel links, and
+// 'concentration' terminals per router.
+TopoDesc topo_desc_hyperx(int r, const int *k, const int *mult,
+                          int concentration, const long *delay)
 {
-    int weight = 1;
-    for (int i = 0; i < direction; i++)
-        weight *= k;
-    int delta = component - torus_id_xyz_get(id, k, direction);
-    return id + delta * weight;
+    assert(concentration > 0);
+    TopoDesc td = topo_desc_torus(r, k, delay);
+    td.type = TOP_HYPERX;
+    td.concentration = concentration;
+    // Port usage: terminals first, then each dimension in order, one port per
+    // link to every other router in the dimension.
+    int port = concentration;
+    for (int d = 0; d < r; d++) {
+        assert(mult[d] > 0);
+        td.mult[d] = mult[d];
+        td.port_base[d] = port;
+        port += (k[d] - 1) * mult[d];
+    }
+    return td;
 }
 
-int torus_set_id_xyz(int id, int k, int direction)
+// A k-ary n-flat: the routers of a k-ary n-fly flattened along each row, which
+// is a HyperX of n-1 dimensions with k routers each and k terminals per
+// router.
+TopoDesc topo_desc_flatfly(int k, int n, const long *delay)
 {
-    int val = id;
-    for (int i = 0; i < direction; i++)
-        val /= k;
-    return val % k;
+    assert(n >= 2 && n - 1 <= TOPO_MAXDIM);
+    int ks[TOPO_MAXDIM], mult[TOPO_MAXDIM];
+    for (int d = 0; d < n - 1; d++) {
+        ks[d] = k;
+        mult[d] = 1;
+    }
+    TopoDesc td = topo_desc_hyperx(n - 1, ks, mult, k, delay);
+    td.type = TOP_FLATFLY;
+    return td;
 }
 
-Topology topology_create(void)
+long topo_router_count(const TopoDesc *td)
+{
+    long n = 1;
+    for (int d = 0; d < td->r; d++)
+        n *= td->k[d];
+    return n;
+}
+
+long topo_terminal_count(const TopoDesc *td)
+{
+    return topo_router_count(td) * td->concentration;
+}
+
+int topo_radix(const TopoDesc *td)
+{
+    if (td->type == TOP_TORUS)
+        // 1: terminal node, 2: bidirectional in each ring
+        return 1 + 2 * td->r;
+    int d = td->r - 1;
+    return td->port_base[d] + (td->k[d] - 1) * td->mult[d];
+}
+
+// Dimension that the inter-router link on 'port' runs along, or -1 for
+// terminal ports.
+int topo_port_dim(const TopoDesc *td, int port)
+{
+    if (td->type == TOP_TORUS)
+        return (port == TERMINAL_PORT) ? -1 : (port - 1) / 2;
+    for (int d = td->r - 1; d >= 0; d--) {
+        if (td->k[d] > 1 && port >= td->port_base[d])
+            return d;
+    }
+    return -1;
+}
+
+// Port of link 'm' from the router at 'coord' to the one at 'peer_coord' along
+// dimension 'dim' of a HyperX.
+int hyperx_port(const TopoDesc *td, int coord, int dim, int peer_coord, int m)
+{
+    assert(coord != peer_coord && m < td->mult[dim]);
+    int peer_idx = (peer_coord < coord) ? peer_coord : peer_coord - 1;
+    return td->port_base[dim] + peer_idx * td->mult[dim] + m;
+}
+
+// "4-ary 2-torus" if all rings have the same length, "8x8x16 torus"
+// otherwise.
+char *topo_desc_str(const TopoDesc *td, char *s, size_t len)
+{
+    if (td->type == TOP_FLATFLY) {
+        snprintf(s, len, "%d-ary %d-flat", td->k[0], td->r + 1);
+        return s;
+    }
+    bool uniform = true;
+    for (int d = 1; d < td->r; d++)
+        uniform &= (td->k[d] == td->k[0]);
+    if (uniform && td->type == TOP_TORUS) {
+        snprintf(s, len, "%d-ary %d-torus", td->k[0], td->r);
+        return s;
+    }
+    size_t w = 0;
+    for (int d = 0; d < td->r && w < len; d++)
+        w += snprintf(s + w, len - w, d ? "x%d" : "%d", td->k[d]);
+    if (w < len && td->type == TOP_TORUS)
+        snprintf(s + w, len - w, " torus");
+    if (td->type != TOP_HYPERX)
+        return s;
+    if (w < len)
+        w += snprintf(s + w, len - w, " HyperX, links");
+    for (int d = 0; d < td->r && w < len; d++)
+        w += snprintf(s + w, len - w, d ? ",%d" : " %d", td->mult[d]);
+    if (w < len)
+        snprintf(s + w, len - w, ", %d terminals/router", td->concentration);
+    return s;
+}
+
+// Channel storage is allocated up front for 'channel_count' channels.
+Topology topology_create(TopoDesc desc, int terminal_count, int router_count,
+                         int radix, long channel_count)
 {
     Topology top;
     memset(&top, 0, sizeof(Topology));
+    top.desc = desc;
+    top.terminal_count = terminal_count;
+    top.router_count = router_count;
+    top.radix = radix;
+    arrsetcap(top.conns, channel_count);
+    long slots = 2L * terminal_count + (long)router_count * radix;
+    arrsetlen(top.forward, (size_t)slots);
+    arrsetlen(top.reverse, (size_t)slots);
+    for (long i = 0; i < slots; i++) {
+        top.forward[i] = -1;
+        top.reverse[i] = -1;
+    }
     return top;
 }
 
 void topology_destroy(Topology *top)
 {
-    hmfree(top->forward_hash);
-    hmfree(top->reverse_hash);
+    arrfree(top->conns);
+    arrfree(top->forward);
+    arrfree(top->reverse);
+    arrfree(top->coords);
+    arrfree(top->layout);
 }
 
-int topology_connect(Topology *t, RouterPortPair input, RouterPortPair output)
+// Inter-router hops of a minimal route between routers 'a' and 'b'.
+int topo_distance(const Topology *t, int a, int b)
 {
-    int old_output_i = hmgeti(t->forward_hash, input);
-    int old_input_i = hmgeti(t->reverse_hash, output);
-    if (old_output_i >= 0 || old_input_i >= 0) {
-        // FIXME: When only one of _i's are >= 0, this results in buffer
-        // overflow.
-        RouterPortPair old_output = t->forward_hash[old_output_i].value.dst;
-        RouterPortPair old_input = t->reverse_hash[old_input_i].value.src;
-        if (input.id.type == old_input.id.type &&
-            input.id.value == old_input.id.value &&
-            input.port == old_input.port &&
-            output.id.type == old_output.id.type &&
-            output.id.value == old_output.id.value &&
-            output.port == old_output.port) {
-            // Already connected.
-            return 1;
+    const TopoDesc *td = &t->desc;
+    int hops = 0;
+    for (int d = 0; d < td->r; d++) {
+        int ca = topo_coord(t, a, d), cb = topo_coord(t, b, d);
+        if (topo_is_hyperx(td)) {
+            hops += (ca != cb);
         } else {
-            // Bad connectivity: source or destination port is already connected
-            return 0;
+            int dist = abs(ca - cb);
+            hops += std::min(dist, td->k[d] - dist);
         }
     }
-    int uniq = hmlen(t->forward_hash);
+    return hops;
+}
+
+static long port_slot(const Topology *t, RouterPortPair rpp)
+{
+    switch (rpp.id.type) {
+    case ID_SRC:
+        assert(rpp.port == 0);
+        return rpp.id.value;
+    case ID_DST:
+        assert(rpp.port == 0);
+        return t->terminal_count + rpp.id.value;
+    default:
+        assert(rpp.port >= 0 && rpp.port < t->radix);
+        return 2L * t->terminal_count + (long)rpp.id.value * t->radix + rpp.port;
+    }
+}
+
+Connection conn_find_forward(Topology *t, RouterPortPair out_port)
+{
+    int uniq = t->forward[port_slot(t, out_port)];
+    return (uniq < 0) ? not_connected : t->conns[uniq];
+}
+
+Connection conn_find_reverse(Topology *t, RouterPortPair in_port)
+{
+    int uniq = t->reverse[port_slot(t, in_port)];
+    return (uniq < 0) ? not_connected : t->conns[uniq];
+}
+
+int topology_connect(Topology *t, RouterPortPair input, RouterPortPair output)
+{
+    long in_slot = port_slot(t, input);
+    long out_slot = port_slot(t, output);
+    if (t->forward[in_slot] >= 0 || t->reverse[out_slot] >= 0) {
+        // Bad connectivity: source or destination port is already connected
+        return 0;
+    }
+    int uniq = static_cast<int>(arrlen(t->conns));
     Connection conn = (Connection){.src = input, .dst = output, .uniq = uniq};
-    hmput(t->forward_hash, input, conn);
-    hmput(t->reverse_hash, output, conn);
-    assert(hmgeti(t->forward_hash, input) >= 0);
+    arrput(t->conns, conn);
+    t->forward[in_slot] = uniq;
+    t->reverse[out_slot] = uniq;
     return 1;
 }
 
-int topology_connect_terminals(Topology *t, const int *ids)
+// Terminal 'id' is attached to port id % concentration of router
+// id / concentration.
+static int topology_connect_terminals(Topology *t)
 {
+    int conc = t->desc.concentration;
     int res = 1;
-    for (int i = 0; i < arrlen(ids); i++) {
-        RouterPortPair src_port = {src_id(ids[i]), 0};
-        RouterPortPair dst_port = {dst_id(ids[i]), 0};
-        RouterPortPair rtr_port = {rtr_id(ids[i]), 0};
+    for (int id = 0; id < t->terminal_count; id++) {
+        RouterPortPair src_port = {src_id(id), 0};
+        RouterPortPair dst_port = {dst_id(id), 0};
+        RouterPortPair rtr_port = {rtr_id(id / conc), id % conc};
 
         // Bidirectional channel
         res &= topology_connect(t, src_port, rtr_port);
@@ -95,100 +256,239 @@ int get_output_port(int direction, int to_larger)
     return direction * 2 + (to_larger ? 2 : 1);
 }
 
-// Port usage: 0:terminal, 1:counter-clockwise, 2:clockwise
-static int topology_connect_ring(Topology *t, long size, const int *ids, int direction)
+// Fill in the coordinates of every router, counting up in mixed radix.
+static void topology_coords(Topology *t)
 {
-    printf("%s: ids={", __func__);
-    for (long i = 0; i < size; i++)
-        printf("%d,", ids[i]);
-    printf("}\n");
+    int r = t->desc.r;
+    int coord[TOPO_MAXDIM] = {0};
+    arrsetlen(t->coords, (size_t)t->router_count * r);
+    for (int id = 0; id < t->router_count; id++) {
+        memcpy(&t->coords[(long)id * r], coord, r * sizeof(int));
+        for (int d = 0; d < r; d++) {
+            if (++coord[d] < t->desc.k[d])
+                break;
+            coord[d] = 0;
+        }
+    }
+}
 
-    int port_cw = get_output_port(direction, 1);
-    int port_ccw = get_output_port(direction, 0);
+// Connects every ring of the torus.  Each router is linked once per dimension
+// to its clockwise neighbor, so every channel is emitted exactly once.
+//
+// Port usage: 0:terminal, 1:counter-clockwise, 2:clockwise
+static int topology_connect_torus(Topology *t)
+{
+    const TopoDesc *td = &t->desc;
     int res = 1;
-    for (long i = 0; i < size; i++) {
-        int l = ids[i];
-        int r = ids[(i + 1) % size];
-        RouterPortPair lport = {rtr_id(l), port_cw};
-        RouterPortPair rport = {rtr_id(r), port_ccw};
+    for (int id = 0; id < t->router_count; id++) {
+        for (int dir = 0; dir < td->r; dir++) {
+            int coord = topo_coord(t, id, dir);
+            int next = id + (((coord + 1) % td->k[dir]) - coord) * td->stride[dir];
+            RouterPortPair lport = {rtr_id(id), get_output_port(dir, 1)};
+            RouterPortPair rport = {rtr_id(next), get_output_port(dir, 0)};
 
-        // Bidirectional channel
-        res &= topology_connect(t, lport, rport);
-        res &= topology_connect(t, rport, lport);
-        if (!res)
-            return 0;
+            // Bidirectional channel
+            res &= topology_connect(t, lport, rport);
+            res &= topology_connect(t, rport, lport);
+            if (!res)
+                return 0;
+        }
     }
     return 1;
 }
 
-// Connects part of the torus that corresponds to the the given parameters.
-// Calls itself recursively to form the desired connection.
-//
-// dimension: size of the 'normal' array.
-// offset: offset of the lowest index.
-int topology_connect_torus_dimension(Topology *t, int k, int r, int dimension,
-                                     int *normal, int offset)
+Topology topology_torus(const TopoDesc *desc)
 {
+    int total_nodes = static_cast<int>(topo_router_count(desc));
+    int radix = topo_radix(desc);
+    // Two channels per ring link, and two per terminal.
+    long channel_count = 2L * total_nodes * desc->r + 2L * total_nodes;
+    Topology top = topology_create(*desc, total_nodes, total_nodes, radix,
+                                   channel_count);
+    topology_coords(&top);
+
     int res = 1;
-    int zeros = 0;
-    for (int i = 0; i < dimension; i++)
-        if (normal[i] == 0)
-            zeros++;
-
-    if (zeros == 1) {
-        // Ring
-        int stride = 1;
-        for (int i = 0; i < dimension; i++, stride *= k) {
-            if (normal[i] == 0) {
-                int ids[NORMALLEN];
-                for (int j = 0; j < k; j++)
-                    ids[j] = offset + j * stride;
-                res &= topology_connect_ring(t, k, ids, i);
-                break; // only one 0 in normal
-            }
-        }
-    } else {
-        int stride = 1;
-        for (int i = 0; i < dimension; i++, stride *= k) {
-            if (normal[i] == 0) {
-                int subnormal[NORMALLEN];
-                memcpy(subnormal, normal, dimension * sizeof(int));
-                subnormal[i] = 1; // lock this dimension
-                for (int j = 0; j < k; j++) {
-                    int suboffset = offset + j * stride;
-                    res &= topology_connect_torus_dimension(
-                        t, k, r, dimension, subnormal, suboffset);
+    // Inter-switch channels
+    res &= topology_connect_torus(&top);
+    // Terminal channels
+    res &= topology_connect_terminals(&top);
+    assert(res);
+    assert(arrlen(top.conns) == channel_count);
+
+    return top;
+}
+
+// Connects every dimension of a HyperX as a complete graph.  Each pair of
+// routers is linked once, from the one with the lower coordinate.
+static int topology_connect_hyperx(Topology *t)
+{
+    const TopoDesc *td = &t->desc;
+    int res = 1;
+    for (int id = 0; id < t->router_count; id++) {
+        for (int dim = 0; dim < td->r; dim++) {
+            int coord = topo_coord(t, id, dim);
+            for (int peer_coord = coord + 1; peer_coord < td->k[dim];
+                 peer_coord++) {
+                int peer = id + (peer_coord - coord) * td->stride[dim];
+                for (int m = 0; m < td->mult[dim]; m++) {
+                    RouterPortPair lport = {
+                        rtr_id(id), hyperx_port(td, coord, dim, peer_coord, m)};
+                    RouterPortPair rport = {
+                        rtr_id(peer), hyperx_port(td, peer_coord, dim, coord, m)};
+
+                    // Bidirectional channel
+                    res &= topology_connect(t, lport, rport);
+                    res &= topology_connect(t, rport, lport);
+                    if (!res)
+                        return 0;
                 }
             }
         }
     }
-
-    return res;
+    return 1;
 }
 
-Topology topology_torus(int k, int r)
+Topology topology_hyperx(const TopoDesc *desc)
 {
-    Topology top = topology_create();
-    top.desc = (TopoDesc){TOP_TORUS, k, r};
+    int router_count = static_cast<int>(topo_router_count(desc));
+    int terminal_count = static_cast<int>(topo_terminal_count(desc));
+    int radix = topo_radix(desc);
+    // Every network port has one outgoing channel; two per terminal.
+    long channel_count = (long)router_count * (radix - desc->concentration) +
+                         2L * terminal_count;
+    Topology top = topology_create(*desc, terminal_count, router_count, radix,
+                                   channel_count);
+    topology_coords(&top);
 
-    int normal[NORMALLEN] = {0};
     int res = 1;
+    res &= topology_connect_hyperx(&top);
+    res &= topology_connect_terminals(&top);
+    assert(res);
+    assert(arrlen(top.conns) == channel_count);
 
-    // Inter-switch channels
-    res &= topology_connect_torus_dimension(&top, k, r, r, normal, 0);
+    return top;
+}
 
-    // Terminal channels
-    int total_nodes = 1;
-    int *ids = NULL;
-    for (int i = 0; i < r; i++) total_nodes *= k; // k ^ r
-    for (int id = 0; id < total_nodes; id++) {
-        arrput(ids, id);
+Topology topology_build(const TopoDesc *desc)
+{
+    if (topo_is_hyperx(desc))
+        return topology_hyperx(desc);
+    return topology_torus(desc);
+}
+
+// Interleave the low 'bits' bits of each of the 'r' coordinates, most
+// significant first.
+static uint64_t interleave_bits(const unsigned *x, int r, int bits)
+{
+    uint64_t key = 0;
+    for (int b = bits - 1; b >= 0; b--) {
+        for (int d = 0; d < r; d++)
+            key = (key << 1) | ((x[d] >> b) & 1);
     }
-    res &= topology_connect_terminals(&top, ids);
-    assert(res);
+    return key;
+}
 
-    arrfree(ids);
-    return top;
+// Index along a Hilbert curve through the 2^bits-ary r-cube.  The coordinates
+// are transformed in place into the transposed index, after J. Skilling,
+// "Programming the Hilbert curve" (2004).
+static uint64_t hilbert_index(unsigned *x, int r, int bits)
+{
+    unsigned m = 1u << (bits - 1);
+    // Inverse undo.
+    for (unsigned q = m; q > 1; q >>= 1) {
+        unsigned p = q - 1;
+        for (int d = 0; d < r; d++) {
+            if (x[d] & q) {
+                x[0] ^= p;
+            } else {
+                unsigned t = (x[0] ^ x[d]) & p;
+                x[0] ^= t;
+                x[d] ^= t;
+            }
+        }
+    }
+    // Gray encode.
+    for (int d = 1; d < r; d++)
+        x[d] ^= x[d - 1];
+    unsigned t = 0;
+    for (unsigned q = m; q > 1; q >>= 1) {
+        if (x[r - 1] & q)
+            t ^= q - 1;
+    }
+    for (int d = 0; d < r; d++)
+        x[d] ^= t;
+    return interleave_bits(x, r, bits);
+}
+
+// Lay the routers out along a space-filling curve over their coordinates, so
+// that neighbors are mostly near each other in memory, and renumber the
+// channels so that the ones entering each router are stored together, in the
+// same order.  Channels into destination terminals go with the router they
+// leave.  Returns 0 if the curve index of a router does not fit in 64 bits.
+int topology_layout(Topology *t, enum LayoutOrder order)
+{
+    int r = t->desc.r;
+    int bits = 1;
+    for (int d = 0; d < r; d++) {
+        while ((1 << bits) < t->desc.k[d])
+            bits++;
+    }
+    if (r * bits > 64)
+        return 0;
+
+    std::vector<uint64_t> key(t->router_count);
+    for (int id = 0; id < t->router_count; id++) {
+        unsigned x[TOPO_MAXDIM];
+        for (int d = 0; d < r; d++)
+            x[d] = static_cast<unsigned>(topo_coord(t, id, d));
+        switch (order) {
+        case LAYOUT_ID:
+            key[id] = id;
+            break;
+        case LAYOUT_MORTON:
+            key[id] = interleave_bits(x, r, bits);
+            break;
+        case LAYOUT_HILBERT:
+            key[id] = hilbert_index(x, r, bits);
+            break;
+        }
+    }
+    arrsetlen(t->layout, (size_t)t->router_count);
+    std::iota(t->layout, t->layout + t->router_count, 0);
+    std::stable_sort(t->layout, t->layout + t->router_count,
+                     [&](int a, int b) { return key[a] < key[b]; });
+    std::vector<int> rank(t->router_count);
+    for (int i = 0; i < t->router_count; i++)
+        rank[t->layout[i]] = i;
+
+    // Order the channels by the rank of the router they belong to.
+    long conn_count = arrlen(t->conns);
+    std::vector<int> owner(conn_count);
+    for (long u = 0; u < conn_count; u++) {
+        const Connection &c = t->conns[u];
+        owner[u] = rank[is_dst(c.dst.id) ? c.src.id.value : c.dst.id.value];
+    }
+    std::vector<int> by_rank(conn_count);
+    std::iota(by_rank.begin(), by_rank.end(), 0);
+    std::stable_sort(by_rank.begin(), by_rank.end(),
+                     [&](int a, int b) { return owner[a] < owner[b]; });
+
+    std::vector<int> new_uniq(conn_count);
+    std::vector<Connection> conns(conn_count);
+    for (long i = 0; i < conn_count; i++) {
+        new_uniq[by_rank[i]] = static_cast<int>(i);
+        conns[i] = t->conns[by_rank[i]];
+        conns[i].uniq = static_cast<int>(i);
+    }
+    std::copy(conns.begin(), conns.end(), t->conns);
+    long slots = arrlen(t->forward);
+    for (long s = 0; s < slots; s++) {
+        if (t->forward[s] >= 0)
+            t->forward[s] = new_uniq[t->forward[s]];
+        if (t->reverse[s] >= 0)
+            t->reverse[s] = new_uniq[t->reverse[s]];
+    }
+    return 1;
 }
 
 // Compute the ID of the router which is the result of moving 'src_id' along
@@ -203,8 +503,9 @@ Topology topology_torus(int k, int r)
 //
 // This function is mainly used for computing IDs of the intermediate nodes in
 // the dimension order routing.
-int torus_align_id(int k, int src_id, int dst_id, int move_direction)
+int torus_align_id(const Topology *t, int src_id, int dst_id, int move_direction)
 {
-    int component = torus_id_xyz_get(dst_id, k, move_direction);
-    return torus_id_xyz_set(src_id, k, move_direction, component);
+    int delta = topo_coord(t, dst_id, move_direction) -
+                topo_coord(t, src_id, move_direction);
+    return src_id + delta * t->desc.stride[move_direction];
 }
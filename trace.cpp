@@ -0,0 +1,219 @@
+#include "trace.h"
+#include "router.h"
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+// Diagrams wider than this are truncated.
+#define DIAGRAM_MAXLEN 160
+
+Tracer *tracer_create(long sample_every, int filter_src, int filter_dst,
+                      long print_count, long channel_delay)
+{
+    Tracer *tr = new Tracer;
+    tr->sample_every = sample_every;
+    tr->filter_src = filter_src;
+    tr->filter_dst = filter_dst;
+    tr->print_count = print_count;
+    tr->channel_delay = channel_delay;
+    return tr;
+}
+
+void tracer_destroy(Tracer *tr)
+{
+    for (auto pt : tr->kept)
+        delete pt;
+    delete tr;
+}
+
+// Decide whether to trace a newly generated packet.  Returns a fresh trace to
+// be attached to the head flit, or NULL.
+PacketTrace *tracer_sample(Tracer *tr, int src, int dst, long packet_num,
+                           long gen)
+{
+    if (tr->filter_src >= 0 && tr->filter_src != src)
+        return NULL;
+    if (tr->filter_dst >= 0 && tr->filter_dst != dst)
+        return NULL;
+    long n = tr->seen++;
+    if (tr->sample_every > 0 && (n % tr->sample_every) != 0)
+        return NULL;
+
+    PacketTrace *pt = new PacketTrace;
+    pt->src = src;
+    pt->dst = dst;
+    pt->packet_num = packet_num;
+    pt->gen = gen;
+    pt->inject = -1;
+    pt->eject = -1;
+    pt->consume = -1;
+    return pt;
+}
+
+// Zero-load latency along the traced path: the injection channel, a router
+// pipeline and a channel at each router, and one cycle to consume.
+static long zero_load_latency(const PacketTrace *pt, long channel_delay)
+{
+    long latency = channel_delay + 1;
+    for (const HopTrace &h : pt->hops)
+        latency += ROUTER_PIPELINE_DEPTH + h.link_delay;
+    return latency;
+}
+
+// Take ownership of a finished trace and fold it into the aggregate.
+void tracer_finish(Tracer *tr, PacketTrace *pt)
+{
+    assert(!pt->hops.empty());
+    long d = tr->channel_delay;
+
+    tr->traced++;
+    tr->latency_sum += pt->consume - pt->gen;
+    tr->zero_load_sum += zero_load_latency(pt, d);
+    // Source queueing, plus any slip on the injection channel.
+    tr->source_wait_sum +=
+        (pt->inject - pt->gen) + (pt->hops[0].arrive - pt->inject - d);
+
+    if (tr->per_hop.size() < pt->hops.size())
+        tr->per_hop.resize(pt->hops.size());
+    for (size_t i = 0; i < pt->hops.size(); i++) {
+        const HopTrace &h = pt->hops[i];
+        long next = (i + 1 < pt->hops.size()) ? pt->hops[i + 1].arrive
+                                              : pt->eject;
+        HopBreakdown &b = tr->per_hop[i];
+        b.count++;
+        b.buffer += h.rc - h.arrive - ROUTER_RC_CYCLES;
+        b.va += h.va - h.rc - ROUTER_VA_CYCLES;
+        b.sa += h.sa - h.va - ROUTER_SA_CYCLES;
+        b.st += h.st - h.sa - ROUTER_ST_CYCLES;
+        b.link += next - h.st - h.link_delay;
+    }
+    tr->consume_wait_sum += pt->consume - pt->eject - 1;
+
+    if (static_cast<long>(tr->kept.size()) < tr->print_count) {
+        tr->kept.push_back(pt);
+    } else {
+        delete pt;
+    }
+}
+
+static void diagram_fill(char *row, long base, long from, long to, char c)
+{
+    for (long t = from; t < to; t++) {
+        if (t - base >= 0 && t - base < DIAGRAM_MAXLEN)
+            row[t - base] = c;
+    }
+}
+
+static void diagram_mark(char *row, long base, long t, char c)
+{
+    diagram_fill(row, base, t, t + 1, c);
+}
+
+static void diagram_print_row(const char *label, const char *row, long len)
+{
+    printf("  %-8s |%.*s|\n", label, static_cast<int>(len), row);
+}
+
+// Render a trace as a text pipeline diagram, one column per cycle:
+//
+//   G generated       q source queue     I injected         - on a channel
+//   B buffer write    b buffer wait      R route compute
+//   v VA wait         V VA grant         s SA wait          S SA grant
+//   T switch traversal                   E consumed at the destination
+void tracer_print_diagram(const PacketTrace *pt, long channel_delay)
+{
+    long base = pt->gen;
+    long len = pt->consume - base + 1;
+    bool truncated = (len > DIAGRAM_MAXLEN);
+    if (truncated)
+        len = DIAGRAM_MAXLEN;
+    char row[DIAGRAM_MAXLEN];
+    char label[32];
+
+    long latency = pt->consume - pt->gen;
+    long zero_load = zero_load_latency(pt, channel_delay);
+    printf("Packet {s%d.p%ld} %d -> %d, gen=%ld, latency=%ld "
+           "(zero-load %ld + contention %ld)%s\n",
+           pt->src, pt->packet_num, pt->src, pt->dst, pt->gen, latency,
+           zero_load, latency - zero_load, truncated ? " [truncated]" : "");
+
+    memset(row, ' ', sizeof(row));
+    diagram_fill(row, base, pt->gen + 1, pt->inject, 'q');
+    diagram_fill(row, base, pt->inject + 1, pt->hops[0].arrive, '-');
+    diagram_mark(row, base, pt->gen, 'G');
+    diagram_mark(row, base, pt->inject, 'I');
+    snprintf(label, sizeof(label), "Src %d", pt->src);
+    diagram_print_row(label, row, len);
+
+    for (size_t i = 0; i < pt->hops.size(); i++) {
+        const HopTrace &h = pt->hops[i];
+        long next = (i + 1 < pt->hops.size()) ? pt->hops[i + 1].arrive
+                                              : pt->eject;
+        memset(row, ' ', sizeof(row));
+        diagram_fill(row, base, h.arrive + 1, h.rc, 'b');
+        diagram_fill(row, base, h.rc + 1, h.va, 'v');
+        diagram_fill(row, base, h.va + 1, h.sa, 's');
+        diagram_fill(row, base, h.st + 1, next, '-');
+        diagram_mark(row, base, h.arrive, 'B');
+        diagram_mark(row, base, h.rc, 'R');
+        diagram_mark(row, base, h.va, 'V');
+        diagram_mark(row, base, h.sa, 'S');
+        diagram_mark(row, base, h.st, 'T');
+        snprintf(label, sizeof(label), "Rtr %d", h.router);
+        diagram_print_row(label, row, len);
+    }
+
+    memset(row, ' ', sizeof(row));
+    diagram_fill(row, base, pt->eject + 1, pt->consume, 'b');
+    diagram_mark(row, base, pt->eject, 'B');
+    diagram_mark(row, base, pt->consume, 'E');
+    snprintf(label, sizeof(label), "Dst %d", pt->dst);
+    diagram_print_row(label, row, len);
+}
+
+void tracer_report(const Tracer *tr)
+{
+    printf("\n");
+    printf("==== LATENCY BREAKDOWN ====\n");
+    printf("# of traced packets: %ld\n", tr->traced);
+    if (tr->traced == 0)
+        return;
+    printf("\n");
+
+    for (auto pt : tr->kept) {
+        tracer_print_diagram(pt, tr->channel_delay);
+        printf("\n");
+    }
+
+    double n = static_cast<double>(tr->traced);
+    HopBreakdown total;
+    for (const auto &b : tr->per_hop) {
+        total.buffer += b.buffer;
+        total.va += b.va;
+        total.sa += b.sa;
+        total.st += b.st;
+        total.link += b.link;
+    }
+    printf("Average latency: %lf\n", tr->latency_sum / n);
+    printf("  Zero-load: %lf\n", tr->zero_load_sum / n);
+    printf("  Source queue: %lf\n", tr->source_wait_sum / n);
+    printf("  Buffer wait: %lf\n", total.buffer / n);
+    printf("  VA wait: %lf\n", total.va / n);
+    printf("  SA wait: %lf\n", total.sa / n);
+    printf("  ST wait: %lf\n", total.st / n);
+    printf("  Link wait: %lf\n", total.link / n);
+    printf("  Destination wait: %lf\n", tr->consume_wait_sum / n);
+    printf("\n");
+
+    // Contention per hop, averaged over the packets that reached that hop.
+    printf("%5s %8s %8s %8s %8s %8s %8s\n", "hop", "packets", "buffer",
+           "va", "sa", "st", "link");
+    for (size_t i = 0; i < tr->per_hop.size(); i++) {
+        const HopBreakdown &b = tr->per_hop[i];
+        if (b.count == 0)
+            continue;
+        double c = static_cast<double>(b.count);
+        printf("%5zu %8ld %8.3lf %8.3lf %8.3lf %8.3lf %8.3lf\n", i, b.count,
+               b.buffer / c, b.va / c, b.sa / c, b.st / c, b.link / c);
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <vector>
+
+// Sampled per-hop tracing of packets.
+//
+// The head flit of a sampled packet carries a PacketTrace, and each pipeline
+// stage stamps the cycle it processed the head flit at.  Finished traces are
+// rendered as text pipeline diagrams and aggregated into a latency
+// decomposition, without the cost of the full '-v' log.
+
+// Cycles at which the head flit went through each stage of a router.
+typedef struct HopTrace {
+    int router;  // router ID
+    long arrive; // written into the input buffer
+    long rc;     // route computed
+    long va;     // output VC granted
+    long sa;     // switch granted
+    long st;     // traversed the switch onto the output channel
+    long link_delay; // latency of the output channel
+} HopTrace;
+
+typedef struct PacketTrace {
+    int src;
+    int dst;
+    long packet_num;
+    long gen;     // generated at the source
+    long inject;  // left the source queue
+    long eject;   // written into the destination input buffer
+    long consume; // consumed by the destination
+    std::vector<HopTrace> hops;
+} PacketTrace;
+
+// Contention (cycles in excess of the zero-load pipeline) at each stage of a
+// hop.
+typedef struct HopBreakdown {
+    long count = 0;
+    long buffer = 0; // head waiting behind an earlier packet in the VC
+    long va = 0;     // waiting for an output VC
+    long sa = 0;     // waiting for the switch or credits
+    long st = 0;
+    long link = 0;
+} HopBreakdown;
+
+typedef struct Tracer {
+    long sample_every = 0; // trace one in this many packets; 0: all matching
+    int filter_src = -1;   // only trace packets from this source, if >= 0
+    int filter_dst = -1;   // only trace packets to this destination, if >= 0
+    long print_count = 10; // number of diagrams to print
+    long channel_delay = 1; // latency of the injection channel
+    long seen = 0;         // number of packets that matched the filters
+
+    long traced = 0;
+    long source_wait_sum = 0;
+    long zero_load_sum = 0;
+    long latency_sum = 0;
+    long consume_wait_sum = 0; // waiting in the destination input buffer
+    std::vector<HopBreakdown> per_hop;
+    std::vector<PacketTrace *> kept; // traces kept for printing
+} Tracer;
+
+Tracer *tracer_create(long sample_every, int filter_src, int filter_dst,
+                      long print_count, long channel_delay);
+void tracer_destroy(Tracer *tr);
+PacketTrace *tracer_sample(Tracer *tr, int src, int dst, long packet_num,
+                           long gen);
+void tracer_finish(Tracer *tr, PacketTrace *pt);
+void tracer_print_diagram(const PacketTrace *pt, long channel_delay);
+void tracer_report(const Tracer *tr);
+
+#endif